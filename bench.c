@@ -0,0 +1,505 @@
+/* bench.c -- latency and throughput benchmark of the clir line editor.
+ *
+ * Each workload runs the editor in a child process on a pseudo terminal,
+ * and types scripted keys on the master side, one at a time: the latency
+ * of a key is the time from its first byte written to the first byte of
+ * output that follows its last one. The bytes the editor writes are
+ * counted on the master, its read and write system calls are taken from
+ * /proc/<pid>/io where it exists.
+ *
+ * Run "make bench", or ./clir_bench with the names of the workloads to
+ * run only some of them. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "clir.h"
+
+#define BENCH_PROMPT "bench> "
+#define BENCH_KEY_TIMEOUT 1000  /* ms to wait for the output of a key. */
+#define BENCH_QUIET 1           /* ms without output ending a refresh. */
+#define BENCH_HISTORY 1000000   /* Entries of the history workload. */
+#define BENCH_CANDIDATES 100000 /* Candidates of the completion workload. */
+
+struct bench {
+    int master;         /* Master side of the pseudo terminal. */
+    pid_t pid;          /* Editor. */
+    int measure;        /* Keys are measured, not just typed. */
+    int echo;           /* Wait for the key itself, other output comes. */
+    long long calls;    /* System calls before the first measured key. */
+    int sampled;        /* 'calls' was taken. */
+    long *lat;          /* Latency of each measured key, in us. */
+    size_t keys;        /* Measured keys. */
+    size_t cap;         /* Allocated slots of 'lat'. */
+    size_t silent;      /* Measured keys that wrote nothing. */
+    size_t bytes;       /* Bytes written for the measured keys. */
+};
+
+struct workload {
+    const char *name;
+    void (*setup)(void);            /* In the editor, before the prompt. */
+    void (*script)(struct bench *); /* Keys typed. */
+};
+
+static long long benchNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/* Read the output of the editor for at most 'ms' milliseconds, returning
+ * as soon as something was read. Returns the number of bytes read, that
+ * are appended to 'seen' if it is not NULL, or 0 on timeout. */
+static size_t benchRead(struct bench *b, int ms, char *seen, size_t seenlen) {
+    struct pollfd pfd = { b->master, POLLIN, 0 };
+    char buf[65536];
+    ssize_t nread;
+
+    if (poll(&pfd,1,ms) <= 0) return 0;
+    if ((nread = read(b->master,buf,sizeof(buf))) <= 0) return 0;
+    if (b->measure) b->bytes += nread;
+    if (seen) {
+        size_t len = strlen(seen), n = nread;
+
+        if (len+n >= seenlen) {
+            /* Just the tail is needed to find the prompt. */
+            memmove(seen,seen+len/2,len-len/2+1);
+            len -= len/2;
+        }
+        if (len+n >= seenlen) n = seenlen-len-1;
+        memcpy(seen+len,buf+nread-n,n);
+        seen[len+n] = '\0';
+    }
+    return nread;
+}
+
+/* Read the read and write system calls made so far by the editor, as the
+ * sum of syscr and syscw of /proc/<pid>/io. Returns -1 if not available. */
+static long long benchSyscalls(pid_t pid) {
+    char path[64], line[128];
+    long long calls = -1, n;
+    FILE *fp;
+
+    snprintf(path,sizeof(path),"/proc/%d/io",(int)pid);
+    if ((fp = fopen(path,"r")) == NULL) return -1;
+    while (fgets(line,sizeof(line),fp)) {
+        if (sscanf(line,"syscr: %lld",&n) == 1 ||
+            sscanf(line,"syscw: %lld",&n) == 1)
+            calls = (calls == -1 ? 0 : calls)+n;
+    }
+    fclose(fp);
+    return calls;
+}
+
+/* Type the key 'seq' of 'len' bytes and wait for the editor to refresh.
+ * Its output is read while it is typed, so that a long paste does not
+ * block both sides on full buffers. */
+static void benchKey(struct bench *b, const char *seq, size_t len) {
+    long long start;
+    size_t written = 0, got;
+
+    if (b->measure && !b->sampled) {
+        b->calls = benchSyscalls(b->pid);
+        b->sampled = 1;
+    }
+    start = benchNow();
+
+    while (written < len) {
+        struct pollfd pfd = { b->master, POLLIN|POLLOUT, 0 };
+        ssize_t nwritten;
+
+        if (poll(&pfd,1,-1) == -1 && errno != EINTR) return;
+        if (pfd.revents & POLLIN) benchRead(b,0,NULL,0);
+        if (!(pfd.revents & POLLOUT)) continue;
+        nwritten = write(b->master,seq+written,len-written);
+        if (nwritten == -1 && errno != EAGAIN && errno != EINTR) return;
+        if (nwritten > 0) written += nwritten;
+    }
+    if (b->echo && b->measure) {
+        /* The key is a byte that nothing else writes, but the other
+         * output can keep coming, so the timeout is for the whole wait. */
+        char seen[4096] = "";
+
+        while ((got = strchr(seen,seq[len-1]) != NULL) == 0 &&
+            benchNow()-start < BENCH_KEY_TIMEOUT*1000LL &&
+            benchRead(b,BENCH_KEY_TIMEOUT,seen,sizeof(seen)));
+    } else {
+        got = benchRead(b,BENCH_KEY_TIMEOUT,NULL,0);
+    }
+    if (got == 0) {
+        if (b->measure) b->silent++;
+        return;
+    }
+    if (b->measure) {
+        if (b->keys == b->cap) {
+            b->cap = b->cap ? b->cap*2 : 1024;
+            b->lat = realloc(b->lat,b->cap*sizeof(*b->lat));
+            if (b->lat == NULL) exit(1);
+        }
+        b->lat[b->keys++] = (long)(benchNow()-start);
+    }
+    while (benchRead(b,BENCH_QUIET,NULL,0));
+}
+
+/* Type the null terminated key 'seq' 'count' times. */
+static void benchKeys(struct bench *b, const char *seq, int count) {
+    while (count--) benchKey(b,seq,strlen(seq));
+}
+
+/* Paste 'len' bytes of text cycling through 'text', in one bracketed
+ * paste. */
+static void benchPaste(struct bench *b, const char *text, size_t len) {
+    size_t tlen = strlen(text), j;
+    char *seq = malloc(len+12);
+
+    if (seq == NULL) exit(1);
+    memcpy(seq,"\x1b[200~",6);
+    for (j = 0; j < len; j++) seq[6+j] = text[j%tlen];
+    memcpy(seq+6+len,"\x1b[201~",6);
+    benchKey(b,seq,len+12);
+    free(seq);
+}
+
+/* Start the editor of 'w' in a child on a new 80x24 pseudo terminal, and
+ * wait for its prompt. Returns 0 on success, -1 on error. */
+static int benchStart(struct bench *b, const struct workload *w) {
+    struct winsize ws = { 24, 80, 0, 0 };
+    char seen[4096] = "";
+    const char *name;
+    long long deadline;
+
+    if ((b->master = posix_openpt(O_RDWR|O_NOCTTY)) == -1 ||
+        grantpt(b->master) == -1 || unlockpt(b->master) == -1 ||
+        (name = ptsname(b->master)) == NULL ||
+        ioctl(b->master,TIOCSWINSZ,&ws) == -1) return -1;
+    fflush(stdout);
+    if ((b->pid = fork()) == -1) return -1;
+    if (b->pid == 0) {
+        int slave;
+        char *line;
+
+        setsid();
+        if ((slave = open(name,O_RDWR)) == -1) _exit(1);
+        dup2(slave,STDIN_FILENO);
+        dup2(slave,STDOUT_FILENO);
+        close(slave);
+        close(b->master);
+        setenv("TERM","xterm",1);
+        if (w->setup) w->setup();
+        while ((line = clir(BENCH_PROMPT)) != NULL) free(line);
+        _exit(0);
+    }
+    deadline = benchNow()+60*1000000LL;
+    while (strstr(seen,BENCH_PROMPT) == NULL) {
+        if (benchNow() > deadline) return -1;
+        benchRead(b,100,seen,sizeof(seen));
+    }
+    while (benchRead(b,10,NULL,0));
+    return 0;
+}
+
+static void benchStop(struct bench *b) {
+    kill(b->pid,SIGKILL);
+    waitpid(b->pid,NULL,0);
+    close(b->master);
+}
+
+static int cmpLong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Run the workload 'w' and print a line with its results. */
+static int benchRun(const struct workload *w) {
+    struct bench b;
+    long long calls;
+
+    memset(&b,0,sizeof(b));
+    if (benchStart(&b,w) == -1) {
+        fprintf(stderr,"%s: can't start the editor\n",w->name);
+        return -1;
+    }
+    w->script(&b);
+    calls = b.sampled && b.calls != -1 ? benchSyscalls(b.pid)-b.calls : -1;
+    benchStop(&b);
+
+    printf("%-14s %7zu",w->name,b.keys+b.silent);
+    if (b.keys) {
+        qsort(b.lat,b.keys,sizeof(*b.lat),cmpLong);
+        printf(" %8ld %8ld %8ld %8ld",b.lat[(b.keys-1)*50/100],
+            b.lat[(b.keys-1)*90/100],b.lat[(b.keys-1)*99/100],
+            b.lat[b.keys-1]);
+    } else {
+        printf(" %8s %8s %8s %8s","-","-","-","-");
+    }
+    if (b.echo) printf(" %10s","-"); /* Mostly the other output. */
+    else printf(" %10.1f",(double)b.bytes/(b.keys+b.silent));
+    if (calls != -1) printf(" %10.1f",(double)calls/(b.keys+b.silent));
+    else printf(" %10s","-");
+    if (b.silent) printf("  (%zu keys wrote nothing)",b.silent);
+    printf("\n");
+    fflush(stdout);
+    free(b.lat);
+    return 0;
+}
+
+/* ============================== Workloads ================================= */
+
+/* Typing at the end of the line. */
+static void scriptTyping(struct bench *b) {
+    int j;
+
+    b->measure = 1;
+    for (j = 0; j < 2000; j++) {
+        char c = 'a'+j%26;
+
+        benchKey(b,&c,1);
+    }
+}
+
+/* Moving by words and characters, to the start and to the end, in a line
+ * of 20000 characters. */
+static void scriptNavigation(struct bench *b) {
+    int j;
+
+    benchPaste(b,"lorem ipsum dolor sit amet ",20000);
+    b->measure = 1;
+    benchKeys(b,"\x1b[1;5D",500);
+    benchKeys(b,"\x1b[D",500);
+    benchKeys(b,"\x1b[C",500);
+    for (j = 0; j < 250; j++) {
+        benchKeys(b,"\x01",1);
+        benchKeys(b,"\x05",1);
+    }
+}
+
+/* Bracketed paste of blobs of 256 KB. */
+static void scriptPaste(struct bench *b) {
+    b->measure = 1;
+    benchPaste(b,"The quick brown fox jumps over the lazy dog. ",256*1024);
+    benchKeys(b,"\x15",1);
+    benchPaste(b,"0123456789abcdef",256*1024);
+    benchKeys(b,"\x15",1);
+    benchPaste(b,"How vexingly quick daft zebras jump! ",256*1024);
+}
+
+static void setupHistory(void) {
+    char line[64];
+    int j;
+
+    clirHistorySetMaxLen(BENCH_HISTORY);
+    for (j = 0; j < BENCH_HISTORY; j++) {
+        snprintf(line,sizeof(line),"history entry number %d",j);
+        clirHistoryAdd(line);
+    }
+}
+
+/* Up and down through a history of a million entries. */
+static void scriptHistory(struct bench *b) {
+    b->measure = 1;
+    benchKeys(b,"\x1b[A",1000);
+    benchKeys(b,"\x1b[B",1000);
+}
+
+static void setupSuggest(void) {
+    setupHistory();
+    clirSetSuggestions(1);
+}
+
+/* Typing lines that a history of a million entries suggests the rest of,
+ * and accepting the suggestion. The first key builds the index. */
+static void scriptSuggest(struct bench *b) {
+    char line[64];
+    int j, k, len;
+
+    benchKeys(b,"h",1);
+    benchKeys(b,"\x15",1);
+    b->measure = 1;
+    for (j = 0; j < 100; j++) {
+        len = snprintf(line,sizeof(line),"history entry number %d",j*9973);
+        for (k = 0; k < len-2; k++) benchKey(b,line+k,1);
+        benchKeys(b,"\x1b[C",1);
+        benchKeys(b,"\x15",1);
+    }
+}
+
+static void completionMany(const char *buf, clirCompletions *lc) {
+    char word[64];
+    int j;
+
+    if (buf[0] != 'c') return;
+    for (j = 0; j < BENCH_CANDIDATES; j++) {
+        snprintf(word,sizeof(word),"candidate%06d",j);
+        clirAddCompletion(lc,word);
+    }
+}
+
+static void setupCompletion(void) {
+    clirSetCompletionCallback(completionMany);
+}
+
+/* Tab with a hundred thousand candidates: the first inserts their common
+ * prefix, the second asks whether to list them, that is declined. */
+static void scriptCompletion(struct bench *b) {
+    int j;
+
+    b->measure = 1;
+    for (j = 0; j < 20; j++) {
+        benchKeys(b,"c",1);
+        benchKeys(b,"\t",2);
+        benchKeys(b,"n",1);
+        benchKeys(b,"\x15",1);
+    }
+}
+
+/* Keywords in bold, looking only at the words that changed. */
+static void highlightKeywords(const char *buf, size_t len, size_t start,
+    size_t end, unsigned char *styles)
+{
+    size_t j, k;
+
+    while (start > 0 && buf[start-1] != ' ') start--;
+    while (end < len && buf[end] != ' ') end++;
+    for (j = start; j < end; j = k+1) {
+        for (k = j; k < end && buf[k] != ' '; k++);
+        memset(styles+j,(k-j == 6 && !memcmp(buf+j,"select",6)) ||
+            (k-j == 4 && !memcmp(buf+j,"from",4)) ?
+            LINENOISE_STYLE_BOLD : 0,k-j);
+        if (k < end) styles[k] = 0;
+    }
+}
+
+static void setupHighlight(void) {
+    clirSetHighlightCallback(highlightKeywords);
+}
+
+/* Typing a query with keywords, at the end of a line of up to 60
+ * characters, with a highlighting callback. */
+static void scriptHighlight(struct bench *b) {
+    static const char query[] = "select name from users where id ";
+    int j;
+
+    b->measure = 1;
+    for (j = 0; j < 2000; j++) {
+        if (j%60 == 59) benchKeys(b,"\x15",1);
+        else benchKey(b,query+j%(sizeof(query)-1),1);
+    }
+}
+
+/* A log line every 100 us, from another thread. */
+static void *logLines(void *arg) {
+    unsigned long n = 0;
+
+    (void)arg;
+    while (1) {
+        clirPrintAbove("log: request %lu served",++n);
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void setupLogging(void) {
+    pthread_t thread;
+
+    if (pthread_create(&thread,NULL,logLines,NULL) == 0)
+        pthread_detach(thread);
+}
+
+/* Typing while thousands of lines a second are printed above the line,
+ * that are written in batches at the default rate. The latency is until
+ * the key shows up: the letters typed are capitals that neither the log
+ * lines nor the escape sequences have, and the line is cleared, unmeasured,
+ * before one repeats, so a redraw from before the key is not its echo. */
+static void scriptLogging(struct bench *b) {
+    int j;
+
+    b->echo = 1;
+    for (j = 0; j < 2000; j++) {
+        char c = 'L'+j%15;
+
+        if (j%15 == 0) {
+            b->measure = 0;
+            benchKeys(b,"\x15",1);
+        }
+        b->measure = 1;
+        benchKey(b,&c,1);
+    }
+}
+
+static void setupMultiLine(void) {
+    clirSetMultiLine(1);
+}
+
+/* Typing, moving and deleting in a line wrapped over 18 rows. */
+static void scriptMultiLine(struct bench *b) {
+    int j;
+
+    b->measure = 1;
+    for (j = 0; j < 1400; j++) {
+        char c = j%8 == 7 ? ' ' : 'a'+j%26;
+
+        benchKey(b,&c,1);
+    }
+    benchKeys(b,"\x1b[D",400);
+    benchKeys(b,"\x7f",300);
+}
+
+/* Typing, moving and deleting in a line of accented, CJK and emoji text
+ * longer than the terminal is wide, scrolled by display columns. */
+static void scriptUtf8(struct bench *b) {
+    static const char *words[] = {"caf\xc3\xa9 ","e\xcc\x81t\xc3\xa9 ",
+        "\xe4\xb8\xad\xe6\x96\x87 ","\xf0\x9f\x91\x8d\xf0\x9f\x8f\xbd "};
+    int j;
+
+    b->measure = 1;
+    for (j = 0; j < 400; j++) {
+        const char *w = words[j%4];
+
+        benchKey(b,w,strlen(w));
+    }
+    benchKeys(b,"\x1b[D",800);
+    benchKeys(b,"\x1b[C",400);
+    benchKeys(b,"\x7f",400);
+}
+
+static const struct workload workloads[] = {
+    {"typing", NULL, scriptTyping},
+    {"navigation", NULL, scriptNavigation},
+    {"paste", NULL, scriptPaste},
+    {"history", setupHistory, scriptHistory},
+    {"suggest", setupSuggest, scriptSuggest},
+    {"completion", setupCompletion, scriptCompletion},
+    {"highlight", setupHighlight, scriptHighlight},
+    {"logging", setupLogging, scriptLogging},
+    {"multiline", setupMultiLine, scriptMultiLine},
+    {"utf8", NULL, scriptUtf8},
+};
+
+int main(int argc, char **argv) {
+    size_t j;
+    int k, failed = 0;
+
+    signal(SIGPIPE,SIG_IGN);
+    printf("%-14s %7s %8s %8s %8s %8s %10s %10s\n","workload","keys",
+        "p50 us","p90 us","p99 us","max us","bytes/key","calls/key");
+    for (j = 0; j < sizeof(workloads)/sizeof(workloads[0]); j++) {
+        int run = argc == 1;
+
+        for (k = 1; k < argc; k++)
+            if (!strcmp(argv[k],workloads[j].name)) run = 1;
+        if (run && benchRun(&workloads[j]) == -1) failed = 1;
+    }
+    return failed;
+}
@@ -48,9 +48,6 @@
  * - Filter bogus Ctrl+<char> combinations.
  * - Win32 support
  *
- * Bloat:
- * - History search like Ctrl+r in readline?
- *
  * List of escape sequences used by this program, we do everything just
  * with three sequences. In order to be so cheap we may have some
  * flickering effect with some slow terminal, but the lesser sequences
@@ -99,81 +96,495 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "clir.h"
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
-#define LINENOISE_MAX_LINE 4096
+#define LINENOISE_LINE_INIT 128 /* Initial size of growable line buffers. */
 #define LINENOISE_MAX_COMMAND_LEN 128
+#define LINENOISE_HISTORY_COMPACT_FACTOR 2
+#define LINENOISE_HISTORY_TEXT_MIN 4096
+#define LINENOISE_HISTORY_DEAD ((size_t)-1) /* Offset of erased entries. */
+#define LINENOISE_INPUT_BUF 4096
+#define LINENOISE_COMPLETION_CHUNK 4096 /* Minimum completion arena block. */
+#define LINENOISE_COMPLETION_QUERY_ITEMS 100 /* Ask before longer lists. */
+#define LINENOISE_WINCH_MAX 16 /* Contexts woken up by a resize. */
+#define LINENOISE_ESC_TIMEOUT 100 /* ms before an ESC alone is a key. */
+#define LINENOISE_PRINT_RATE 30 /* Redraws a second for clirPrintAbove(). */
+#define LINENOISE_PRINT_INLINE 256 /* Formatted without malloc() up to that. */
+#define LINENOISE_READ_CHUNK 65536 /* Initial buffer of clirReadLines(). */
+#define LINENOISE_FUZZY_THREADS_MAX 64
+#define LINENOISE_FUZZY_PARALLEL_MIN 65536 /* Entries worth more threads. */
+/* Style of suggestions, dark grey. */
+#define LINENOISE_SUGGEST_STYLE (LINENOISE_COLOR(LINENOISE_BLACK)|LINENOISE_STYLE_BRIGHT)
 	static char *unsupported_term[] = {"dumb","cons25",NULL};
-static clirCompletionCallback *completionCallback = NULL;
-
-static struct termios orig_termios; /* In order to restore at exit.*/
-static int rawmode = 0; /* For atexit() function to check if restore is needed*/
-static int mlmode = 0;  /* Multi line mode. Default is single line. */
-static int atexit_registered = 0; /* Register atexit just 1 time. */
-static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
-static int history_len = 0;
-char **history = NULL;
-
-/* The clirState structure represents the state during line editing.
- * We pass this state to functions implementing specific editing
- * functionalities. */
-struct clirState {
-	int fd;             /* Terminal file descriptor. */
-	char *buf;          /* Edited line buffer. */
-	size_t buflen;      /* Edited line buffer size. */
-	const char *prompt; /* Prompt to display. */
-	size_t plen;        /* Prompt length. */
-	size_t pos;         /* Current cursor position. */
-	size_t oldpos;      /* Previous refresh cursor position. */
-	size_t len;         /* Current edited line length. */
-	size_t cols;        /* Number of columns in terminal. */
-	size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
-	int history_index;  /* The history index we are currently editing. */
-	size_t word_pos;    /* Position of the last word's first character. */
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated memory area where we can append to. Refreshes build all the
+ * escape sequences and text in it and flush them with a single write(), to
+ * avoid flickering effects and to send a single packet over the network.
+ * The buffer is reused by every refresh, so it only allocates when a
+ * bigger line than ever is drawn. */
+struct abuf {
+	char *b;
+	size_t len;
+	size_t cap;
+};
+
+struct historyEntry {
+	size_t off;                 /* Offset of the entry in history_text. */
+	size_t len;                 /* Entry length, without the nulterm. */
+};
+
+struct historyEdit {
+	int index;                  /* History index that was edited. */
+	size_t off;                 /* Offset of the text in history_scratch. */
+};
+
+struct historyCompaction {
+	dev_t dev;                  /* The file it wrote. */
+	ino_t ino;
+	off_t size;                 /* Its size, where new records start. */
+	long lines;                 /* The lines it wrote. */
+};
+
+struct dedupSlot {
+	unsigned int id;            /* Sequence number + 1, or 0 if empty. */
+	unsigned int hash;          /* Hash of the entry text. */
+};
+
+struct searchPosting {
+	unsigned int tri;           /* Trigram, first byte most significant. */
+	unsigned int len;           /* Number of sequence numbers in 'ids'. */
+	unsigned int cap;           /* Allocated slots of 'ids'. */
+	unsigned int *ids;          /* Increasing sequence numbers. */
+};
+
+struct suggestNode {
+	size_t off;                 /* Label of the edge, in suggest_text. */
+	unsigned int len;           /* Label length. */
+	unsigned int child;         /* First child, or 0. */
+	unsigned int next;          /* Next sibling, or 0. */
+	unsigned int newest;        /* Newest entry below, sequence number + 1. */
+	unsigned int longer;        /* Same, but not ending here, or 0. */
+};
+
+/* A completion asked to an asynchronous provider. It is shared by the
+ * context, that waits for it, and by the provider, that fills it from any
+ * thread, so it has its own lock, and it is freed by the last of the two
+ * to let it go. */
+struct clirCompletionRequest {
+	pthread_mutex_t lock;
+	int refs;                   /* Holders among the context and provider. */
+	int done;                   /* The provider called clirRequestComplete(). */
+	int canceled;               /* The context no longer waits for it. */
+	int wake_fd;                /* Written when done, -1 once canceled. */
+	clirCompletions cc;         /* Options added so far. */
+	size_t pos;                 /* Cursor position in 'line'. */
+	size_t len;                 /* Length of 'line'. */
+	char line[];                /* Line being completed. */
 };
 
+/* A context holds all the state of a terminal the library edits lines on:
+ * its file descriptors, mode flags and callbacks, the input read and the
+ * screen drawn, and the history. Nothing is shared between contexts, so
+ * each can be used by its own thread, or many by one event loop, without
+ * locks. The API without a context uses a default one on stdin/stdout. */
+struct clirContext {
+	int ifd;                    /* Terminal input file descriptor. */
+	int ofd;                    /* Terminal output file descriptor. */
+	clirCompletionCallback *completionCallback;
+	char *dict_text;            /* Words of the completion dictionary. */
+	char **dict_words;          /* Sorted pointers into dict_text. */
+	size_t dict_len;            /* Number of words in the dictionary. */
+	char **dict_matches;        /* Its fuzzy matches, dict_len slots. */
+	struct fuzzyCandidate *dict_scores; /* Their scores, as many. */
+	clirCompletions comp_cache; /* Last narrowable callback candidates. */
+	struct abuf comp_line;      /* Line up to the cursor they were for. */
+	size_t comp_word_pos;       /* Start of the word they completed. */
+	int comp_cached;            /* comp_cache is valid. */
+	clirAsyncCompletionCallback *asyncCompletionCallback;
+	struct clirCompletionRequest *comp_req; /* Request waited for. */
+	int comp_timeout;           /* Wait at most that many ms, 0 = forever. */
+	long long comp_deadline;    /* When to stop waiting for comp_req. */
+	int wake_fd[2];             /* Pipe written by completed requests. */
+	/* Candidates listed under the line, page by page. While the list is
+	 * shown the keys answer the pager instead of editing the line. */
+	char **comp_list;           /* Candidates, borrowed or in comp_list_cc. */
+	size_t comp_list_len;       /* Number of candidates. */
+	size_t comp_list_rows;      /* Rows of the whole list. */
+	size_t comp_list_cols;      /* Candidates per row. */
+	size_t comp_list_width;     /* Width of a column, with the spacing. */
+	size_t comp_list_row;       /* Next row to show. */
+	int comp_list_state;        /* LIST_QUERY, LIST_MORE, or 0 when done. */
+	clirCompletions comp_list_cc; /* Candidates owned by the list. */
+	int comp_query_items;       /* Ask before listing that many, 0 = never. */
+
+	struct termios orig_termios; /* In order to restore at exit.*/
+	int rawmode;  /* For atexit() function to check if restore is needed*/
+	int raw_fd;                 /* Descriptor put in raw mode. */
+	struct clirContext *raw_next; /* Next in raw_list, locked. */
+	int mlmode;   /* Multi line mode. Default is single line. */
+	int term_cols;              /* Terminal width, 0 until probed. */
+	int term_rows;              /* Terminal height. */
+	int term_winch;             /* winch_count when they were probed. */
+	int term_unsupported;       /* TERM is blacklisted, -1 until probed. */
+	int ifd_tty;                /* ifd is a terminal, -1 until probed. */
+	int winch_slot;             /* Slot in winch_fds + 1, or 0. */
+
+	char input_buf[LINENOISE_INPUT_BUF]; /* Bytes read from the terminal. */
+	size_t input_len;           /* Bytes in input_buf. */
+	size_t input_pos;           /* Next byte of input_buf to process. */
+	int esc_timeout;            /* Wait for the rest of a sequence, in ms. */
+	long long esc_deadline;     /* When a lone ESC becomes a key, or 0. */
+	unsigned char keymap[LINENOISE_KEY_COUNT]; /* Action of each key. */
+	int keymap_valid;           /* keymap was copied from default_keymap. */
+
+	unsigned int *edit_cols;    /* Column index of the line, see editCol(). */
+	size_t edit_cols_cap;       /* Its allocated slots. */
+
+	int refresh_defer;          /* More keys buffered, don't refresh now. */
+	int refresh_pending;        /* A refresh was deferred. */
+	struct abuf refresh_ab;     /* Output of a refresh. */
+	size_t refresh_bytes;       /* Bytes written by the last refresh. */
+	/* In single line mode the renderer remembers what it drew last, that
+	 * is the prompt and the visible part of the buffer, and where it left
+	 * the cursor. The next refresh only sends what changed: a relative
+	 * cursor move when just the cursor moved, or the changed suffix of the
+	 * line. Positions on the screen are cells, counted from the start of
+	 * the prompt, that wrap every 'cols' ones in multi line mode. */
+	struct abuf refresh_frame;  /* Last drawn line. */
+	struct abuf refresh_next;   /* Line being drawn. */
+	size_t refresh_frame_col;   /* Cursor cell of the last frame. */
+	size_t refresh_frame_hint;  /* Where the suggestion starts in it. */
+	struct abuf refresh_frame_style; /* Style of each of its bytes. */
+	struct abuf refresh_next_style;
+	struct abuf refresh_frame_width; /* Cells of each of its bytes. */
+	struct abuf refresh_next_width;
+	size_t refresh_frame_cells; /* Cells of the whole frame. */
+	size_t refresh_next_cells;
+	int refresh_frame_valid;    /* The screen shows refresh_frame. */
+
+	int history_max_len;
+	int history_len;            /* Number of entries in the ring. */
+	int history_cap;            /* Allocated slots, grows up to max len. */
+	int history_head;           /* Slot of the oldest entry. */
+	struct historyEntry *history;
+	char *history_text;         /* Arena with the text of all entries. */
+	size_t history_text_len;    /* Used bytes of the arena. */
+	size_t history_text_cap;    /* Allocated bytes of the arena. */
+	size_t history_text_free;   /* Bytes of evicted entries. */
+	char *history_scratch;      /* Edited copies of the entries. */
+	size_t history_scratch_len;
+	size_t history_scratch_cap;
+	struct historyEdit *history_edits;
+	int history_edits_len;
+	int history_edits_cap;
+	unsigned int history_seq;   /* Sequence number of next entry. */
+	int history_dead;           /* Slots of entries erased as duplicates. */
+	int history_erasedups;      /* Keep a single copy of each entry. */
+	struct dedupSlot *dedup_table;
+	size_t dedup_size;          /* Hash table slots, power of two. */
+	size_t dedup_used;          /* Used hash table slots. */
+	int history_unsaved;        /* Newest entries not yet appended. */
+	int history_sync_every;     /* fsync() every N entries, 0 = never. */
+	int history_unsynced;       /* Entries appended since last fsync(). */
+	long history_file_lines;    /* Lines in the history file. */
+	int history_share_fd;       /* Shared history file, or -1. */
+	char *history_share_path;   /* Its name, to notice it was replaced. */
+	off_t history_share_off;    /* End of the last record read, or -1. */
+	struct historyCompaction history_share_next; /* Of the file that
+	                               replaced it, size -1 if not known. */
+
+	struct searchPosting *search_index; /* Trigram index of the history. */
+	size_t search_index_size;   /* Hash table slots, power of two. */
+	size_t search_index_used;   /* Used hash table slots. */
+	int search_index_adds;      /* Entries added since the build. */
+
+	int suggest;                /* Suggest lines from the history. */
+	int suggest_hidden;         /* The line is done, don't show any. */
+	struct suggestNode *suggest_trie; /* Prefix index of the history. */
+	unsigned int suggest_trie_len;
+	unsigned int suggest_trie_cap;
+	struct abuf suggest_text;   /* Labels of the trie edges. */
+	int suggest_trie_adds;      /* Entries added since the build. */
+	struct abuf suggest_prefix; /* Bytes of the line walked in the trie, */
+	unsigned int suggest_node;  /* to the node, */
+	unsigned int suggest_label; /* and that many bytes of its label. */
+
+	clirHighlightCallback *highlightCallback;
+	struct abuf highlight_text; /* Line the styles were given for. */
+	struct abuf highlight_style; /* Style of each of its bytes. */
+
+	int stats_enabled;          /* Count in 'stats'. */
+	clirStats stats;
+	long long stats_comp_start; /* When the async provider was asked. */
+	clirHookCallback *hook;     /* Called around the callbacks. */
+	void *hook_privdata;
+
+	int fuzzy;                  /* LINENOISE_FUZZY_* flags. */
+	int fuzzy_threads;          /* Threads scanning a big history. */
+
+	/* Output of clirPrintAbove(), that any thread may call. While a line
+	 * is edited it is queued, and the editor writes the whole queue above
+	 * the line at once, redrawing the line once, at most print_rate times
+	 * a second. Only the fields that the other threads touch are guarded
+	 * by print_lock, that the editor only takes when print_pending tells
+	 * there is something queued. */
+	pthread_mutex_t print_lock;
+	atomic_int print_pending;   /* print_queue is not empty. */
+	struct abuf print_queue;    /* Text waiting to be written, locked. */
+	int print_editing;          /* A line is being edited, locked. */
+	int print_ofd;              /* Copy of ofd written meanwhile, locked. */
+	int print_wake;             /* Its wake pipe, or -1, locked. */
+	int print_woken;            /* print_wake was written, locked. */
+	int print_stats;            /* Copy of stats_enabled, locked. */
+	unsigned long long print_writes; /* Its write() calls, locked. */
+	unsigned long long print_write_bytes;
+	struct abuf print_out;      /* The queue taken by the editor. */
+	int print_rate;             /* Redraws a second, 0 = no limit. */
+	long long print_last;       /* When the queue was last written. */
+	long long print_deadline;   /* When it may be written again, or 0. */
+};
+
+static struct clirContext default_ctx = {
+	.ifd = STDIN_FILENO,
+	.ofd = STDOUT_FILENO,
+	.history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN,
+	.wake_fd = { -1, -1 },
+	.comp_query_items = LINENOISE_COMPLETION_QUERY_ITEMS,
+	.term_unsupported = -1,
+	.ifd_tty = -1,
+	.esc_timeout = LINENOISE_ESC_TIMEOUT,
+	.history_share_fd = -1,
+	.history_share_next = { .size = -1 },
+	.fuzzy_threads = 1,
+	.print_lock = PTHREAD_MUTEX_INITIALIZER,
+	.print_ofd = STDOUT_FILENO,
+	.print_wake = -1,
+	.print_rate = LINENOISE_PRINT_RATE,
+};
+
+/* The contexts in raw mode are linked in raw_list, so that the atexit()
+ * hook, registered once, restores all their terminals. */
+static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t raw_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct clirContext *raw_list = NULL;
+
+/* Resizes of the terminal are counted by the SIGWINCH handler, and wake up
+ * the contexts in raw mode by writing their wake pipe, whose descriptor
+ * plus one is in a slot of winch_fds. The handlers running, on any thread,
+ * are counted in winch_busy, so that a slot is only given up once none
+ * can still write the descriptor it held. */
+static atomic_int winch_count;
+static atomic_int winch_fds[LINENOISE_WINCH_MAX];
+static atomic_int winch_busy;
+static pthread_mutex_t winch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t winch_once = PTHREAD_ONCE_INIT;
+static struct sigaction winch_prev; /* Handler called after ours. */
 static void clirAtExit(void);
-int clirHistoryAdd(const char *line);
+static void clirAtExitRegister(void);
+static long long clirNow(void);
+int clirCtxHistoryAdd(struct clirContext *ctx, const char *line);
+static struct historyEntry *historySlot(struct clirContext *ctx, int index);
+static void historyEditReset(struct clirContext *ctx);
+static void historyShareClose(struct clirContext *ctx);
+static void historyShareSync(struct clirContext *ctx);
+static int historyShareAdd(struct clirContext *ctx, const char *line, size_t len);
+static const char *historyEditGet(struct clirContext *ctx, int index);
+static int historyEditSet(struct clirContext *ctx, int index, const char *line);
+static long historySearch(struct clirContext *ctx, const char *query, size_t qlen, unsigned int before);
+static long long historyFuzzySearch(struct clirContext *ctx, const char *query, size_t qlen, long long below);
+static void searchIndexAdd(struct clirContext *ctx, unsigned int seq, const char *line, size_t len);
+static void searchIndexFree(struct clirContext *ctx);
+static void suggestIndexAdd(struct clirContext *ctx, unsigned int seq, const char *line, size_t len);
+static void suggestIndexFree(struct clirContext *ctx);
+static const char *suggestFind(struct clirState *cs, size_t *lenp);
+static struct historyEntry *historySeqSlot(struct clirContext *ctx, unsigned int seq);
+static unsigned int dedupHash(const char *line, size_t len);
+static long dedupFind(struct clirContext *ctx, const char *line, size_t len, unsigned int hash);
+static void dedupInsert(struct clirContext *ctx, unsigned int seq, unsigned int hash);
+static void dedupRemove(struct clirContext *ctx, unsigned int seq, const char *line, size_t len);
+static void dedupBuild(struct clirContext *ctx);
 static void refreshLine(struct clirState *cs);
+static void refreshInvalidate(struct clirContext *ctx);
+static void refreshFromHere(struct clirState *cs);
+static char *editPtr(struct clirState *cs, size_t i);
+static char *editFlat(struct clirState *cs);
+static void editErase(struct clirState *cs, size_t len, int before);
+static void editIndexFix(struct clirState *cs, size_t from);
+static size_t editWidth(struct clirState *cs);
+static size_t editCol(struct clirState *cs, size_t pos);
+static size_t editColPos(struct clirState *cs, size_t col, int before);
+static size_t strFit(const char *s, size_t len, size_t cols, size_t *width);
+static size_t strWidth(const char *s, size_t len);
+static void editAppend(struct clirState *cs, struct abuf *ab, size_t from, size_t len);
+static void abAppend(struct abuf *ab, const char *s, size_t len);
+static int abResize(struct abuf *ab, size_t len);
+static void abPrintf(struct abuf *ab, const char *fmt, ...);
+static int abFlush(struct clirContext *ctx, struct abuf *ab, int fd);
+static int getColumns(int fd);
+static int getRows(int fd);
+int clirEditInsert(struct clirState *cs, int c);
+static void clirEditInsertLen(struct clirState *cs, const char *s, size_t len);
+static void printFlush(struct clirState *cs);
+static void printSetEditing(struct clirContext *ctx, int editing);
 
 /* ======================= Low level terminal handling ====================== */
 
 /* Set if to use or not the multi line mode. */
-void clirSetMultiLine(int ml) {
-	mlmode = ml;
+void clirCtxSetMultiLine(struct clirContext *ctx, int ml) {
+	ctx->mlmode = ml;
 }
 
 /* Return true if the terminal name is in the list of terminals we know are
- * not able to understand basic escape sequences. */
-static int isUnsupportedTerm(void) {
-	char *term = getenv("TERM");
+ * not able to understand basic escape sequences. TERM is only looked up the
+ * first time for a context. */
+static int isUnsupportedTerm(struct clirContext *ctx) {
+	char *term;
 	int j;
 
-	if (term == NULL) return 0;
+	if (ctx->term_unsupported != -1) return ctx->term_unsupported;
+	ctx->term_unsupported = 0;
+	if ((term = getenv("TERM")) == NULL) return 0;
 	for (j = 0; unsupported_term[j]; j++)
-		if (!strcasecmp(term,unsupported_term[j])) return 1;
+		if (!strcasecmp(term,unsupported_term[j]))
+			ctx->term_unsupported = 1;
+	return ctx->term_unsupported;
+}
+
+/* Create the pipe that wakes up the context, see clirEditWakeFd().
+ * Returns 0 on success, -1 on error. */
+static int wakeOpen(struct clirContext *ctx) {
+	int j;
+
+	if (ctx->wake_fd[0] != -1) return 0;
+	if (pipe(ctx->wake_fd) == -1) return -1;
+	for (j = 0; j < 2; j++) {
+		fcntl(ctx->wake_fd[j],F_SETFL,O_NONBLOCK);
+		fcntl(ctx->wake_fd[j],F_SETFD,FD_CLOEXEC);
+	}
 	return 0;
 }
 
+/* Count the resize, wake up the contexts, and call the handler that was
+ * installed before ours. */
+static void winchHandler(int sig, siginfo_t *info, void *uctx) {
+	int saved_errno = errno, j;
+
+	atomic_fetch_add(&winch_count,1);
+	atomic_fetch_add(&winch_busy,1);
+	for (j = 0; j < LINENOISE_WINCH_MAX; j++) {
+		int fd = atomic_load(&winch_fds[j])-1;
+
+		if (fd >= 0 && write(fd,"",1) == -1) {
+			/* Full pipe, the context is already woken up. */
+		}
+	}
+	atomic_fetch_sub(&winch_busy,1);
+	if (winch_prev.sa_flags & SA_SIGINFO)
+		winch_prev.sa_sigaction(sig,info,uctx);
+	else if (winch_prev.sa_handler != SIG_DFL &&
+			 winch_prev.sa_handler != SIG_IGN)
+		winch_prev.sa_handler(sig);
+	errno = saved_errno;
+}
+
+static void winchInstall(void) {
+	struct sigaction sa;
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_sigaction = winchHandler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH,&sa,&winch_prev);
+}
+
+/* Wake up the context when the terminal is resized. The handler is
+ * installed the first time, and left in place. A context that gets no
+ * slot still notices the resize at its next key. */
+static void winchRegister(struct clirContext *ctx) {
+	int j;
+
+	pthread_once(&winch_once,winchInstall);
+	if (ctx->winch_slot || wakeOpen(ctx) == -1) return;
+	pthread_mutex_lock(&winch_lock);
+	for (j = 0; j < LINENOISE_WINCH_MAX; j++) {
+		if (atomic_load(&winch_fds[j]) == 0) {
+			atomic_store(&winch_fds[j],ctx->wake_fd[1]+1);
+			ctx->winch_slot = j+1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&winch_lock);
+}
+
+/* Give up the slot of the context. A handler that read it before it was
+ * cleared may still be writing the wake pipe, that is only closed once
+ * they all returned. A handler interrupting this thread returns before
+ * the wait goes on, so only those of the other threads are waited for. */
+static void winchUnregister(struct clirContext *ctx) {
+	if (ctx->winch_slot == 0) return;
+	pthread_mutex_lock(&winch_lock);
+	atomic_store(&winch_fds[ctx->winch_slot-1],0);
+	pthread_mutex_unlock(&winch_lock);
+	while (atomic_load(&winch_busy)) sched_yield();
+	ctx->winch_slot = 0;
+}
+
+/* Probe the size of the terminal 'fd' is attached to, unless it is known
+ * and was not resized since. */
+static void termProbe(struct clirContext *ctx, int fd) {
+	int count = atomic_load(&winch_count);
+
+	if (ctx->term_cols && ctx->term_winch == count) return;
+	ctx->term_winch = count;
+	ctx->term_cols = getColumns(fd);
+	ctx->term_rows = getRows(fd);
+}
+
+/* Unlink 'ctx' from raw_list if it is there, with raw_lock held. */
+static void rawListRemove(struct clirContext *ctx) {
+	struct clirContext **p;
+
+	for (p = &raw_list; *p; p = &(*p)->raw_next) {
+		if (*p == ctx) {
+			*p = ctx->raw_next;
+			break;
+		}
+	}
+}
+
 /* Raw mode: 1960 magic shit. */
-static int enableRawMode(int fd) {
+static int enableRawMode(struct clirContext *ctx, int fd) {
 	struct termios raw;
 
-	if (!isatty(STDIN_FILENO)) goto fatal;
-	if (!atexit_registered) {
-		atexit(clirAtExit);
-		atexit_registered = 1;
-	}
-	if (tcgetattr(fd,&orig_termios) == -1) goto fatal;
+	if (!isatty(fd)) goto fatal;
+	pthread_once(&atexit_once,clirAtExitRegister);
+	if (tcgetattr(fd,&ctx->orig_termios) == -1) goto fatal;
 
-	raw = orig_termios;  /* modify the original mode */
+	raw = ctx->orig_termios;  /* modify the original mode */
 	/* input modes: no break, no CR to NL, no parity check, no strip char,
 	 * no start/stop output control. */
 	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -190,7 +601,14 @@ static int enableRawMode(int fd) {
 
 	/* put terminal in raw mode after flushing */
 	if (tcsetattr(fd,TCSAFLUSH,&raw) < 0) goto fatal;
-	rawmode = 1;
+	pthread_mutex_lock(&raw_lock);
+	rawListRemove(ctx);
+	ctx->rawmode = 1;
+	ctx->raw_fd = fd;
+	ctx->raw_next = raw_list;
+	raw_list = ctx;
+	pthread_mutex_unlock(&raw_lock);
+	winchRegister(ctx);
 	return 0;
 
 fatal:
@@ -198,802 +616,5191 @@ fatal:
 	return -1;
 }
 
-static void disableRawMode(int fd) {
+static void disableRawMode(struct clirContext *ctx, int fd) {
 	/* Don't even check the return value as it's too late. */
-	if (rawmode && tcsetattr(fd,TCSAFLUSH,&orig_termios) != -1)
-		rawmode = 0;
+	pthread_mutex_lock(&raw_lock);
+	if (ctx->rawmode && tcsetattr(fd,TCSAFLUSH,&ctx->orig_termios) != -1)
+		ctx->rawmode = 0;
+	rawListRemove(ctx);
+	pthread_mutex_unlock(&raw_lock);
+	winchUnregister(ctx);
 }
 
-/* Try to get the number of columns in the current terminal, or assume 80
- * if it fails. */
-static int getColumns(void) {
+/* Try to get the number of columns of the terminal 'fd' is attached to,
+ * or assume 80 if it fails. */
+static int getColumns(int fd) {
 	struct winsize ws;
 
-	if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return 80;
+	if (ioctl(fd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return 80;
 	return ws.ws_col;
 }
 
-/* Clear the screen. Used to handle ctrl+cs */
-void clirClearScreen(void) {
-	if (write(STDIN_FILENO,"\x1b[H\x1b[2J",7) <= 0) {
-		/* nothing to do, just to avoid warning. */
+/* Try to get the number of rows of the terminal 'fd' is attached to, or
+ * assume 24 if it fails. */
+static int getRows(int fd) {
+	struct winsize ws;
+
+	if (ioctl(fd, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0) return 24;
+	return ws.ws_row;
+}
+
+/* Write all of 'len' bytes to 'fd', retrying on short writes.
+ * Returns 0 on success, -1 on error. */
+static int writeAll(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t nwritten = write(fd,buf,len);
+
+		if (nwritten == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += nwritten;
+		len -= nwritten;
 	}
+	return 0;
 }
 
-/* Beep, used for completion when there is nothing to complete or when all
- * the choices were already shown. */
-static void clirBeep(void) {
-	fprintf(stderr, "\x7");
-	fflush(stderr);
+/* Statistics are only counted, and the clock only read, once enabled with
+ * clirSetStats(), so they cost nothing otherwise. */
+#define STATS_ADD(ctx,field,n) do { \
+	if ((ctx)->stats_enabled) (ctx)->stats.field += (n); \
+} while(0)
+
+/* Return the time in nanoseconds when statistics are enabled, 0 otherwise. */
+static long long statsClock(struct clirContext *ctx) {
+	struct timespec ts;
+
+	if (!ctx->stats_enabled) return 0;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000+ts.tv_nsec;
 }
 
-/* ============================== Completion ================================ */
+/* Count a completion callback that was called at 'start'. */
+static void statsCompletion(struct clirContext *ctx, long long start) {
+	unsigned long long elapsed;
 
-/* Free a list of completion option populated by clirAddCompletion(). */
-static void freeCompletions(clirCompletions *cc) {
-	size_t i;
-	for (i = 0; i < cc->len; i++)
-		free(cc->cvec[i]);
-	if (cc->cvec != NULL)
-		free(cc->cvec);
+	if (!ctx->stats_enabled) return;
+	elapsed = statsClock(ctx)-start;
+	ctx->stats.completions++;
+	ctx->stats.completion_ns += elapsed;
+	if (elapsed > ctx->stats.completion_max_ns)
+		ctx->stats.completion_max_ns = elapsed;
 }
 
-static int completeWord(struct clirState *cs) {
-	clirCompletions cc = { 0, NULL };
-	size_t pos = cs->word_pos;
+/* Start counting the statistics of the context when 'enable' is not 0,
+ * see clirCtxGetStats(), or stop. Counting is off by default. */
+void clirCtxSetStats(struct clirContext *ctx, int enable) {
+	ctx->stats_enabled = enable != 0;
+	pthread_mutex_lock(&ctx->print_lock);
+	ctx->print_stats = ctx->stats_enabled;
+	pthread_mutex_unlock(&ctx->print_lock);
+}
 
-	completionCallback(cs->buf, &cc); // Add completions
+/* Copy the statistics counted so far in '*stats'. The writes of
+ * clirPrintAbove(), that other threads may do, are counted apart under
+ * print_lock and added here. */
+void clirCtxGetStats(struct clirContext *ctx, clirStats *stats) {
+	*stats = ctx->stats;
+	pthread_mutex_lock(&ctx->print_lock);
+	stats->writes += ctx->print_writes;
+	stats->write_bytes += ctx->print_write_bytes;
+	pthread_mutex_unlock(&ctx->print_lock);
+}
 
-	int valid[cc.len];
-	size_t valid_c = 0;
-	size_t valid_p = 0;
-	size_t valid_i;
-	for (valid_i = 0; valid_i < cc.len; valid_i++) { valid[valid_i] = 1; }
+/* Set all the statistics back to zero. */
+void clirCtxResetStats(struct clirContext *ctx) {
+	memset(&ctx->stats,0,sizeof(ctx->stats));
+	pthread_mutex_lock(&ctx->print_lock);
+	ctx->print_writes = ctx->print_write_bytes = 0;
+	pthread_mutex_unlock(&ctx->print_lock);
+}
 
-	if (cc.len == 0) {
-		clirBeep();
-	} else {
-		size_t comp_i, char_i;
-		for (comp_i = 0; comp_i < cc.len; comp_i++) { // 'foreach' completion
-			for (char_i = 0, pos = cs->word_pos; cc.cvec[comp_i][char_i] != '\0' && cs->word_pos + char_i < cs->pos; char_i++, pos++) {
-				if (cc.cvec[comp_i][char_i] != cs->buf[pos]) {
-					valid[comp_i] = 0;
-				}
-			}
-			if (valid[comp_i] == 1) {
-				valid_p = cs->pos;
-				valid_i = comp_i;
-				valid_c++;
-			}
-			//printf(" '%s'=%i", cc.cvec[comp_i], valid[comp_i]);
-		}
-		if (valid_c == 1) {
-			//printf(" %zu %zu", valid_i, valid_p);
-			while (cc.cvec[valid_i][valid_p] != '\0') {
-				clirEditInsert(cs, cc.cvec[valid_i][valid_p]);
-				valid_p++;
-			}
-			clirEditInsert(cs, ' ');
-		}
-		else if (valid_c > 1) {
-			//clirEditInsert(cs, '\n');
-			printf("\r\n");
-			for (comp_i = 0; comp_i < cc.len; comp_i++) {
-				if (valid[comp_i] == 1) {
-					printf(" '%s'", cc.cvec[comp_i]);
-				}
-			}
-			printf("\r\n");
-			//clirEditInsert(cs, '\n');
-			return 1;
+/* Call 'fn' with one of the LINENOISE_HOOK_* events and 'privdata' right
+ * before and after each call of a callback, so that its time can be
+ * measured. NULL removes the hook. */
+void clirCtxSetHook(struct clirContext *ctx, clirHookCallback *fn,
+	void *privdata)
+{
+	ctx->hook = fn;
+	ctx->hook_privdata = privdata;
+}
+
+/* Tell the hook, if any, about 'event'. */
+static void hookCall(struct clirContext *ctx, int event) {
+	if (ctx->hook) ctx->hook(event,ctx->hook_privdata);
+}
+
+/* Like writeAll(), for the terminal of 'ctx', that counts the calls. */
+static int termWrite(struct clirContext *ctx, int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t nwritten = write(fd,buf,len);
+
+		STATS_ADD(ctx,writes,1);
+		if (nwritten == -1) {
+			if (errno == EINTR) continue;
+			return -1;
 		}
+		STATS_ADD(ctx,write_bytes,nwritten);
+		buf += nwritten;
+		len -= nwritten;
 	}
 	return 0;
 }
 
-/* This is an helper function for clirEdit() and is called when the
- * user types the <tab> key in order to complete the string currently in the
- * input.
- * 
- * The state of the editing is encapsulated into the pointed clirState
- * structure as described in the structure definition. */
-static int completeLine(struct clirState *cs) {
-	clirCompletions cc = { 0, NULL };
-	int nread, nwritten;
-	char c = 0;
+/* Input is read from the terminal in chunks as big as what is available,
+ * and keys are then taken from the buffer one byte at a time. This way a
+ * paste costs a few read() calls instead of one per byte. */
 
-	completionCallback(cs->buf, &cc);
-	if (cc.len == 0) {
-		clirBeep();
-	} else {
-		size_t stop = 0, i = 0;
+/* Return the number of bytes already read from the terminal and not yet
+ * processed. */
+static size_t inputPending(struct clirContext *ctx) {
+	return ctx->input_len - ctx->input_pos;
+}
 
-		while (!stop) {
-			/* Show completion or original buffer */
-			if (i < cc.len) {
-				struct clirState saved = *cs;
+/* Read more bytes from 'fd' into the input buffer with a single read(),
+ * that blocks unless 'fd' is non blocking. Bytes not yet processed are
+ * kept.
+ * Returns the number of bytes read, 0 on end of file, -1 on error. */
+static int inputFill(struct clirContext *ctx, int fd) {
+	ssize_t nread;
 
-				cs->len = cs->pos = strlen(cc.cvec[i]);
-				cs->buf = cc.cvec[i];
-				refreshLine(cs);
-				cs->len = saved.len;
-				cs->pos = saved.pos;
-				cs->buf = saved.buf;
-			} else {
-				refreshLine(cs);
-			}
+	if (ctx->input_pos) {
+		memmove(ctx->input_buf,ctx->input_buf+ctx->input_pos,ctx->input_len-ctx->input_pos);
+		ctx->input_len -= ctx->input_pos;
+		ctx->input_pos = 0;
+	}
+	if (ctx->input_len == sizeof(ctx->input_buf)) return (int)ctx->input_len;
+	do {
+		nread = read(fd,ctx->input_buf+ctx->input_len,sizeof(ctx->input_buf)-ctx->input_len);
+		STATS_ADD(ctx,reads,1);
+	} while (nread == -1 && errno == EINTR);
+	if (nread <= 0) return nread;
+	STATS_ADD(ctx,read_bytes,nread);
+	ctx->input_len += nread;
+	return nread;
+}
 
-			nread = read(cs->fd, &c, 1);
-			if (nread <= 0) {
-				freeCompletions(&cc);
-				return -1;
-			}
+/* Store in 'buf' the next 'len' bytes of input, reading from 'fd' if they
+ * were not already buffered. Returns 'len' on success, otherwise the
+ * number of bytes stored before end of file or error. */
+static int inputRead(struct clirContext *ctx, int fd, char *buf, size_t len) {
+	size_t j;
 
-			switch(c) {
-				case 9: /* tab */
-					i = (i+1) % (cc.len+1);
-					if (i == cc.len) clirBeep();
-					break;
-				case 27: /* escape */
-					/* Re-show original buffer */
-					if (i < cc.len) refreshLine(cs);
-					stop = 1;
-					break;
-				default:
-					/* Update buffer and return */
-					if (i < cc.len) {
-						nwritten = snprintf(cs->buf, cs->buflen, "%s", cc.cvec[i]);
-						cs->len = cs->pos = nwritten;
-					}
-					stop = 1;
-					break;
-			}
-		}
+	for (j = 0; j < len; j++) {
+		if (inputPending(ctx) == 0 && inputFill(ctx,fd) <= 0) break;
+		buf[j] = ctx->input_buf[ctx->input_pos++];
 	}
-
-	freeCompletions(&cc);
-	return c; /* Return last read character */
+	return (int)j;
 }
 
-/* Register a callback function to be called for tab-completion. */
-void clirSetCompletionCallback(clirCompletionCallback *fn) {
-	completionCallback = fn;
+/* Sent by the terminal before pasted text, when bracketed paste is on. It
+ * is decoded as a key, but is never looked up in the keymap. */
+#define LINENOISE_KEY_PASTE LINENOISE_KEY_COUNT
+
+/* The escape sequences decoded as keys, without the leading ESC. Others
+ * are LINENOISE_KEY_UNKNOWN. */
+static const struct {
+	const char *seq;
+	int key;
+} escapeKeys[] = {
+	{"[A", LINENOISE_KEY_UP},
+	{"[B", LINENOISE_KEY_DOWN},
+	{"[C", LINENOISE_KEY_RIGHT},
+	{"[D", LINENOISE_KEY_LEFT},
+	{"[H", LINENOISE_KEY_HOME},
+	{"[F", LINENOISE_KEY_END},
+	{"OA", LINENOISE_KEY_UP},
+	{"OB", LINENOISE_KEY_DOWN},
+	{"OC", LINENOISE_KEY_RIGHT},
+	{"OD", LINENOISE_KEY_LEFT},
+	{"OH", LINENOISE_KEY_HOME},
+	{"OF", LINENOISE_KEY_END},
+	{"[1~", LINENOISE_KEY_HOME},
+	{"[7~", LINENOISE_KEY_HOME},
+	{"[4~", LINENOISE_KEY_END},
+	{"[8~", LINENOISE_KEY_END},
+	{"[3~", LINENOISE_KEY_DELETE},
+	{"[1;5C", LINENOISE_KEY_CTRL_RIGHT},
+	{"[1;5D", LINENOISE_KEY_CTRL_LEFT},
+	{"[Z", LINENOISE_KEY_SHIFT_TAB},
+	{"[200~", LINENOISE_KEY_PASTE},
+};
+
+/* The action of each key when it was not rebound with clirBindKey(). The
+ * bytes not listed, that are zero, insert themselves. */
+static const unsigned char default_keymap[LINENOISE_KEY_COUNT] = {
+	[1] = LINENOISE_ACTION_HOME,                /* ctrl-a */
+	[2] = LINENOISE_ACTION_LEFT,                /* ctrl-b */
+	[3] = LINENOISE_ACTION_CANCEL,              /* ctrl-c */
+	[4] = LINENOISE_ACTION_EOF_OR_DELETE,       /* ctrl-d */
+	[5] = LINENOISE_ACTION_END,                 /* ctrl-e */
+	[6] = LINENOISE_ACTION_RIGHT,               /* ctrl-f */
+	[8] = LINENOISE_ACTION_BACKSPACE,           /* ctrl-h */
+	[9] = LINENOISE_ACTION_COMPLETE,            /* tab */
+	[11] = LINENOISE_ACTION_KILL_TO_END,        /* ctrl-k */
+	[12] = LINENOISE_ACTION_CLEAR_SCREEN,       /* ctrl-l */
+	[13] = LINENOISE_ACTION_ACCEPT,             /* enter */
+	[14] = LINENOISE_ACTION_HISTORY_NEXT,       /* ctrl-n */
+	[16] = LINENOISE_ACTION_HISTORY_PREV,       /* ctrl-p */
+	[18] = LINENOISE_ACTION_SEARCH,             /* ctrl-r */
+	[20] = LINENOISE_ACTION_TRANSPOSE,          /* ctrl-t */
+	[21] = LINENOISE_ACTION_KILL_LINE,          /* ctrl-u */
+	[23] = LINENOISE_ACTION_DELETE_PREV_WORD,   /* ctrl-w */
+	[127] = LINENOISE_ACTION_BACKSPACE,
+	[LINENOISE_KEY_UP] = LINENOISE_ACTION_HISTORY_PREV,
+	[LINENOISE_KEY_DOWN] = LINENOISE_ACTION_HISTORY_NEXT,
+	[LINENOISE_KEY_RIGHT] = LINENOISE_ACTION_RIGHT,
+	[LINENOISE_KEY_LEFT] = LINENOISE_ACTION_LEFT,
+	[LINENOISE_KEY_HOME] = LINENOISE_ACTION_HOME,
+	[LINENOISE_KEY_END] = LINENOISE_ACTION_END,
+	[LINENOISE_KEY_DELETE] = LINENOISE_ACTION_DELETE,
+	[LINENOISE_KEY_CTRL_RIGHT] = LINENOISE_ACTION_WORD_RIGHT,
+	[LINENOISE_KEY_CTRL_LEFT] = LINENOISE_ACTION_WORD_LEFT,
+	[LINENOISE_KEY_SHIFT_TAB] = LINENOISE_ACTION_NONE,
+	[LINENOISE_KEY_ESC] = LINENOISE_ACTION_NONE,
+	[LINENOISE_KEY_UNKNOWN] = LINENOISE_ACTION_NONE,
+};
+
+/* Look up the escape sequence of 'len' bytes at 'seq', ESC included. */
+static int escapeKey(const char *seq, size_t len) {
+	size_t j;
+
+	for (j = 0; j < sizeof(escapeKeys)/sizeof(escapeKeys[0]); j++)
+		if (strlen(escapeKeys[j].seq) == len-1 &&
+			memcmp(escapeKeys[j].seq,seq+1,len-1) == 0) return escapeKeys[j].key;
+	return LINENOISE_KEY_UNKNOWN;
 }
 
-/* This function is used by the callback function registered by the user
- * in order to add completion options given the input string when the
- * user typed <tab>. See the example.c source code for a very easy to
- * understand example. */
-void clirAddCompletion(clirCompletions *cc, char *str) {
-	size_t len = strlen(str);
-	char *copy = malloc(len+1);
-	memcpy(copy, str, len+1);
-	cc->cvec = realloc(cc->cvec,sizeof(char*)*(cc->len+1));
-	cc->cvec[cc->len++] = copy;
+/* Decode the key at the start of the buffered input, that is a single byte
+ * or a whole escape sequence, setting '*key' to its code. Returns the
+ * number of bytes it takes, or 0 if more bytes must be read to know it.
+ *
+ * The bytes are fed to a small state machine: after an ESC comes the
+ * introducer of a CSI sequence, '[', or of an SS3 one, 'O'. A CSI sequence
+ * is parameter and intermediate bytes up to the final byte, an SS3 one is
+ * a single byte. ESC followed by another ESC is an ESC alone, and so is
+ * an ESC when the rest of its sequence does not come in time, see
+ * inputEscExpired(). Followed by any other byte it is an unknown key, as
+ * sent for alt and that byte. */
+static size_t inputKey(struct clirContext *ctx, int *key) {
+	enum { KEY_START, KEY_ESC, KEY_CSI, KEY_SS3 } state = KEY_START;
+	const char *p = ctx->input_buf+ctx->input_pos;
+	size_t len = inputPending(ctx), j;
+
+	for (j = 0; j < len; j++) {
+		unsigned char b = p[j];
+
+		switch(state) {
+			case KEY_START:
+				if (b != 27) {
+					*key = b;
+					return 1;
+				}
+				state = KEY_ESC;
+				break;
+			case KEY_ESC:
+				if (b == '[') {
+					state = KEY_CSI;
+				} else if (b == 'O') {
+					state = KEY_SS3;
+				} else if (b == 27) {
+					*key = LINENOISE_KEY_ESC;
+					return 1;
+				} else {
+					*key = LINENOISE_KEY_UNKNOWN;
+					return 2;
+				}
+				break;
+			case KEY_CSI:
+				if (b >= 0x20 && b <= 0x3f) break;
+				*key = escapeKey(p,j+1);
+				return j+1;
+			case KEY_SS3:
+				*key = escapeKey(p,j+1);
+				return j+1;
+		}
+	}
+	return 0;
 }
 
-/* =========================== Line editing ================================= */
+/* Tell whether an escape sequence that is still incomplete waited long
+ * enough for its other bytes, then its ESC is taken as a key alone. The
+ * wait starts at the first call, see also clirEditTimeout(). A sequence
+ * that fills the whole input buffer is garbage that never completes. */
+static int inputEscExpired(struct clirContext *ctx) {
+	long long now = clirNow();
 
-/* Single line low level line refresh.
- *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
-static void refreshSingleLine(struct clirState *cs) {
-	char seq[64];
-	size_t plen = strlen(cs->prompt);
-	int fd = cs->fd;
-	char *buf = cs->buf;
-	size_t len = cs->len;
-	size_t pos = cs->pos;
-
-	while((plen+pos) >= cs->cols) {
-		buf++;
-		len--;
-		pos--;
+	if (inputPending(ctx) == sizeof(ctx->input_buf)) return 1;
+	if (ctx->esc_deadline == 0) ctx->esc_deadline = now+ctx->esc_timeout;
+	return now >= ctx->esc_deadline;
+}
+
+/* Bind 'key', a byte value or one of the LINENOISE_KEY_* codes, to one of
+ * the LINENOISE_ACTION_* editing actions. Returns 0 on success, -1 if the
+ * key or the action is not known. */
+int clirCtxBindKey(struct clirContext *ctx, int key, int action) {
+	if (key < 0 || key >= LINENOISE_KEY_COUNT ||
+		action < 0 || action >= LINENOISE_ACTION_COUNT) return -1;
+	if (!ctx->keymap_valid) {
+		memcpy(ctx->keymap,default_keymap,sizeof(ctx->keymap));
+		ctx->keymap_valid = 1;
 	}
-	while (plen+len > cs->cols) {
-		len--;
+	ctx->keymap[key] = action;
+	return 0;
+}
+
+/* Wait at most 'ms' milliseconds for the rest of an escape sequence after
+ * its ESC, before taking the ESC as a key alone. The default is
+ * LINENOISE_ESC_TIMEOUT. */
+void clirCtxSetEscapeTimeout(struct clirContext *ctx, int ms) {
+	ctx->esc_timeout = ms > 0 ? ms : 0;
+}
+
+/* Clear the screen. Used to handle ctrl+l */
+void clirCtxClearScreen(struct clirContext *ctx) {
+	if (termWrite(ctx,ctx->ofd,"\x1b[H\x1b[2J",7) == -1) {
+		/* nothing to do, just to avoid warning. */
 	}
+}
 
-	/* Cursor to left edge */
-	snprintf(seq, 64, "\x1b[0G");
-	if (write(fd,seq,strlen(seq)) == -1) return;
-	/* Write the prompt and the current buffer content */
-	if (write(fd,cs->prompt,strlen(cs->prompt)) == -1) return;
-	if (write(fd,buf,len) == -1) return;
-	/* Erase to right */
-	snprintf(seq, 64, "\x1b[0K");
-	if (write(fd,seq,strlen(seq)) == -1) return;
-	/* Move cursor to original position. */
-	snprintf(seq, 64, "\x1b[0G\x1b[%dC", (int)(pos+plen));
-	if (write(fd,seq,strlen(seq)) == -1) return;
+/* Beep, used for completion when there is nothing to complete or when all
+ * the choices were already shown. */
+static void clirBeep(struct clirContext *ctx) {
+	if (termWrite(ctx,ctx->ofd,"\x7",1) == -1) {
+		/* nothing to do, just to avoid warning. */
+	}
 }
 
-/* Multi line low level line refresh.
+/* ============================= Fuzzy matching ============================= */
+
+/* In fuzzy mode a query matches a text when all its bytes are found in it
+ * in the same order, not necessarily next to each other, like fzf does. As
+ * with smart case, letters match either case unless the query has capital
+ * letters.
  *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
-static void refreshMultiLine(struct clirState *cs) {
-	char seq[64];
-	int plen = strlen(cs->prompt);
-	int rows = (plen+cs->len+cs->cols-1)/cs->cols; /* rows used by current buf. */
-	int rpos = (plen+cs->oldpos+cs->cols)/cs->cols; /* cursor relative row. */
-	int rpos2; /* rpos after refresh. */
-	int old_rows = cs->maxrows;
-	int fd = cs->fd, j;
+ * Most texts don't match, so the bytes of the query are first looked for
+ * one after the other with fuzzyFind(), that compares 16 bytes at once
+ * with SSE2 or NEON where available. Only for the texts that match, the
+ * match is then narrowed and scored by fuzzyScore(). */
 
-	/* Update maxrows if needed. */
-	if (rows > (int)cs->maxrows) cs->maxrows = rows;
+/* Tell whether the query 'q' of 'len' bytes is matched ignoring case. */
+static int fuzzyFold(const char *q, size_t len) {
+	size_t j;
 
-#ifdef LN_DEBUG
-	FILE *fp = fopen("/tmp/debug.txt","a");
-	fprintf(fp,"[%d %d %d] p: %d, rows: %d, rpos: %d, max: %d, oldmax: %d",
-			(int)cs->len,(int)cs->pos,(int)cs->oldpos,plen,rows,rpos,(int)cs->maxrows,old_rows);
-#endif
+	for (j = 0; j < len; j++)
+		if (q[j] >= 'A' && q[j] <= 'Z') return 0;
+	return 1;
+}
 
-	/* First step: clear all the lines used before. To do so start by
-	 * going to the last row. */
-	if (old_rows-rpos > 0) {
-#ifdef LN_DEBUG
-		fprintf(fp,", go down %d", old_rows-rpos);
-#endif
-		snprintf(seq,64,"\x1b[%dB", old_rows-rpos);
-		if (write(fd,seq,strlen(seq)) == -1) return;
-	}
+/* Tell whether the byte 'c' of a text matches the byte 'q' of a query. */
+static int fuzzyEq(unsigned char c, unsigned char q, int fold) {
+	if (fold && q >= 'a' && q <= 'z') c |= 0x20;
+	return c == q;
+}
 
-	/* Now for every row clear it, go up. */
-	for (j = 0; j < old_rows-1; j++) {
-#ifdef LN_DEBUG
-		fprintf(fp,", clear+up");
-#endif
-		snprintf(seq,64,"\x1b[0G\x1b[0K\x1b[1A");
-		if (write(fd,seq,strlen(seq)) == -1) return;
-	}
+/* Return the offset of the first byte of the 'len' bytes at 's' that
+ * matches the byte 'q' of a query, or 'len' if none does. Setting the
+ * 0x20 bit of the text turns the capital letters to small ones, and no
+ * other byte to a small letter. */
+static size_t fuzzyFind(const unsigned char *s, size_t len, unsigned char q,
+	int fold)
+{
+	unsigned char mask = (fold && q >= 'a' && q <= 'z') ? 0x20 : 0;
+	size_t j = 0;
 
-	/* Clean the top line. */
-#ifdef LN_DEBUG
-	fprintf(fp,", clear");
-#endif
-	snprintf(seq,64,"\x1b[0G\x1b[0K");
-	if (write(fd,seq,strlen(seq)) == -1) return;
+#if defined(__SSE2__)
+	__m128i vq = _mm_set1_epi8((char)q), vmask = _mm_set1_epi8((char)mask);
 
-	/* Write the prompt and the current buffer content */
-	if (write(fd,cs->prompt,strlen(cs->prompt)) == -1) return;
-	if (write(fd,cs->buf,cs->len) == -1) return;
+	for (; j+16 <= len; j += 16) {
+		__m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s+j)),vmask);
+		int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(v,vq));
 
-	/* If we are at the very end of the screen with our prompt, we need to
-	 * emit a newline and move the prompt to the first column. */
-	if (cs->pos &&
-			cs->pos == cs->len &&
-			(cs->pos+plen) % cs->cols == 0)
-	{
-#ifdef LN_DEBUG
-		fprintf(fp,", <newline>");
-#endif
-		if (write(fd,"\n",1) == -1) return;
-		snprintf(seq,64,"\x1b[0G");
-		if (write(fd,seq,strlen(seq)) == -1) return;
-		rows++;
-		if (rows > (int)cs->maxrows) cs->maxrows = rows;
+		if (bits) return j+__builtin_ctz(bits);
 	}
+#elif defined(__ARM_NEON)
+	uint8x16_t vq = vdupq_n_u8(q), vmask = vdupq_n_u8(mask);
 
-	/* Move cursor to right position. */
-	rpos2 = (plen+cs->pos+cs->cols)/cs->cols; /* current cursor relative row. */
-#ifdef LN_DEBUG
-	fprintf(fp,", rpos2 %d", rpos2);
-#endif
-	/* Go up till we reach the expected positon. */
-	if (rows-rpos2 > 0) {
-#ifdef LN_DEBUG
-		fprintf(fp,", go-up %d", rows-rpos2);
-#endif
-		snprintf(seq,64,"\x1b[%dA", rows-rpos2);
-		if (write(fd,seq,strlen(seq)) == -1) return;
+	for (; j+16 <= len; j += 16) {
+		uint8x16_t eq = vceqq_u8(vorrq_u8(vld1q_u8(s+j),vmask),vq);
+		/* Four bits per byte of the comparison. */
+		uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(eq),4)),0);
+
+		if (bits) return j+(__builtin_ctzll(bits)>>2);
 	}
-	/* Set column. */
-#ifdef LN_DEBUG
-	fprintf(fp,", set col %d", 1+((plen+(int)cs->pos) % (int)cs->cols));
 #endif
-	snprintf(seq,64,"\x1b[%dG", 1+((plen+(int)cs->pos) % (int)cs->cols));
-	if (write(fd,seq,strlen(seq)) == -1) return;
-
-	cs->oldpos = cs->pos;
+	for (; j < len; j++)
+		if ((s[j] | mask) == q) return j;
+	return len;
+}
 
-#ifdef LN_DEBUG
-	fprintf(fp,"\n");
-	fclose(fp);
-#endif
+/* Tell whether a match is at the start of a word, after the byte 'c'. */
+static int fuzzyBoundary(unsigned char c) {
+	return c == ' ' || c == '/' || c == '-' || c == '_' || c == '.' ||
+		c == ':' || c == '=' || c == ',';
+}
+
+/* Score the match of the query 'q', of 'qlen' bytes, in the text 't' of
+ * 'tlen' bytes. Returns -1 when it does not match, otherwise a score that
+ * is higher for better matches, storing the offset of the first byte
+ * matched in '*startp'.
+ *
+ * The end of the match is found scanning forward, then its start scanning
+ * back from there, so that it spans as few bytes as possible. Each byte
+ * matched earns points, more at the start of a word or right after the
+ * previous one, and each byte skipped inside the match costs one. */
+static int fuzzyScore(const char *q, size_t qlen, const char *t, size_t tlen,
+	int fold, size_t *startp)
+{
+	const unsigned char *u = (const unsigned char *)t;
+	size_t j = 0, k, start, end, prev = 0;
+	int score = 0;
+
+	*startp = 0;
+	if (qlen == 0) return 0;
+	for (k = 0; k < qlen; k++) {
+		j += fuzzyFind(u+j,tlen-j,q[k],fold);
+		if (j == tlen) return -1;
+		j++;
+	}
+	end = j;
+	for (start = end, k = qlen; k > 0; )
+		if (fuzzyEq(u[--start],q[k-1],fold)) k--;
+
+	for (j = start, k = 0; k < qlen; j++) {
+		if (!fuzzyEq(u[j],q[k],fold)) continue;
+		score += 16;
+		if (j == 0 || fuzzyBoundary(u[j-1])) score += 8;
+		if (k > 0 && prev == j-1) score += 8;
+		prev = j;
+		k++;
+	}
+	score -= (int)(end-start-qlen);
+	*startp = start;
+	return score > 0 ? score : 0;
+}
+
+/* Match either the completions or the history search, or both, according
+ * to 'flags', LINENOISE_FUZZY_COMPLETION and LINENOISE_FUZZY_HISTORY, with
+ * fuzzy matching, or only exactly when 0, the default. */
+void clirCtxSetFuzzy(struct clirContext *ctx, int flags) {
+	ctx->fuzzy = flags;
+}
+
+/* Scan histories of more than LINENOISE_FUZZY_PARALLEL_MIN entries with up
+ * to 'threads' threads in fuzzy mode. The default is 1, no other thread. */
+void clirCtxSetFuzzyThreads(struct clirContext *ctx, int threads) {
+	if (threads < 1) threads = 1;
+	if (threads > LINENOISE_FUZZY_THREADS_MAX) threads = LINENOISE_FUZZY_THREADS_MAX;
+	ctx->fuzzy_threads = threads;
+}
+
+/* ============================== Completion ================================ */
+
+/* The strings of the completions added with a copy live in an arena of
+ * blocks that never move, so the pointers in cvec stay valid as it grows,
+ * and all of them are freed at once. */
+struct clirArena {
+	struct clirArena *next;     /* Previous block. */
+	size_t len;                 /* Used bytes of 'data'. */
+	size_t cap;                 /* Size of 'data'. */
+	char data[];
+};
+
+/* Free a list of completion option populated by clirAddCompletion(). */
+static void freeCompletions(clirCompletions *cc) {
+	while (cc->arena) {
+		struct clirArena *next = cc->arena->next;
+
+		free(cc->arena);
+		cc->arena = next;
+	}
+	free(cc->cvec);
+	cc->cvec = NULL;
+	cc->len = cc->cap = 0;
+}
+
+/* Return the start of the word the cursor is at the end of, that is the
+ * position after the last space before the cursor. */
+static size_t completeWordStart(struct clirState *cs) {
+	size_t start = cs->pos;
+
+	while (start > 0 && *editPtr(cs,start-1) != ' ') start--;
+	return start;
+}
+
+/* Forget the cached candidates of the last completion. */
+static void completeCacheFree(struct clirContext *ctx) {
+	if (!ctx->comp_cached) return;
+	freeCompletions(&ctx->comp_cache);
+	ctx->comp_cached = 0;
+}
+
+/* Several candidates are listed under the line in columns, sorted down
+ * then across like ls does, and sized to fit the terminal width. All of
+ * it is built in the refresh buffer and written at once, a page at a time:
+ * when the list is longer than the screen it stops at "--More--", and
+ * when it has many candidates the user is first asked whether to show it,
+ * so that a <tab> never writes more than a screen. */
+
+#define LIST_QUERY 1 /* Asked whether to show the list. */
+#define LIST_MORE 2  /* Shown up to "--More--". */
+
+/* Stop listing candidates, freeing the ones the list owned. */
+static void completeListEnd(struct clirContext *ctx) {
+	ctx->comp_list_state = 0;
+	ctx->comp_list = NULL;
+	ctx->comp_list_len = 0;
+	freeCompletions(&ctx->comp_list_cc);
+}
+
+/* Show the next 'lines' rows of the list and "--More--" after them while
+ * there are more, when the list ends the line must be shown again.
+ * Returns 1 in that case, 0 otherwise. */
+static int completeListShow(struct clirState *cs, size_t lines) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab;
+	size_t end = ctx->comp_list_row+lines, row, col;
+
+	if (end > ctx->comp_list_rows) end = ctx->comp_list_rows;
+	for (row = ctx->comp_list_row; row < end; row++) {
+		for (col = 0; col < ctx->comp_list_cols; col++) {
+			size_t j = col*ctx->comp_list_rows+row, len, width;
+
+			if (j >= ctx->comp_list_len) break;
+			len = strFit(ctx->comp_list[j],strlen(ctx->comp_list[j]),
+				cs->cols-1,&width);
+			abAppend(ab,ctx->comp_list[j],len);
+			if (j+ctx->comp_list_rows < ctx->comp_list_len)
+				abPrintf(ab,"%*s",(int)(ctx->comp_list_width-width),"");
+		}
+		abAppend(ab,"\r\n",2);
+	}
+	ctx->comp_list_row = end;
+	if (end < ctx->comp_list_rows) {
+		abAppend(ab,"--More--",8);
+		ctx->comp_list_state = LIST_MORE;
+	} else {
+		completeListEnd(ctx);
+	}
+	abFlush(ctx,ab,cs->ofd);
+	return ctx->comp_list_state == 0;
+}
+
+/* Return the number of rows of the list shown by a page. */
+static size_t completeListPage(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	termProbe(ctx,cs->ofd);
+	return ctx->term_rows > 1 ? ctx->term_rows-1 : 1;
+}
+
+/* List the 'len' candidates in 'words' under the line.
+ *
+ * Returns 1 if the list was shown entirely and the line must be shown
+ * again. Otherwise the pager keeps using 'words', that must stay valid
+ * until completeListEnd(), and answers the next keys with
+ * completeListKey(). */
+static int completeList(struct clirState *cs, char **words, size_t len) {
+	struct clirContext *ctx = cs->ctx;
+	size_t width = 0, j;
+
+	/* No word is wider than its length, so most are not measured. */
+	for (j = 0; j < len; j++) {
+		size_t l = strlen(words[j]);
+
+		if (l > width && (l = strWidth(words[j],l)) > width) width = l;
+	}
+	if (width > cs->cols-1) width = cs->cols-1;
+	width += 2;
+	ctx->comp_list = words;
+	ctx->comp_list_len = len;
+	ctx->comp_list_width = width;
+	ctx->comp_list_cols = (cs->cols+1)/width;
+	if (ctx->comp_list_cols == 0) ctx->comp_list_cols = 1;
+	ctx->comp_list_rows = (len+ctx->comp_list_cols-1)/ctx->comp_list_cols;
+	ctx->comp_list_row = 0;
+
+	refreshFromHere(cs);
+	abAppend(&ctx->refresh_ab,"\r\n",2);
+	if (ctx->comp_query_items && len >= (size_t)ctx->comp_query_items) {
+		abPrintf(&ctx->refresh_ab,
+			"Display all %zu possibilities? (y or n)",len);
+		abFlush(ctx,&ctx->refresh_ab,cs->ofd);
+		ctx->comp_list_state = LIST_QUERY;
+		return 0;
+	}
+	return completeListShow(cs,completeListPage(cs));
+}
+
+/* Answer the key 'c' to the question or the "--More--" of the list: y or
+ * space show the list or its next page, enter its next row in the pager,
+ * any other key stops it.
+ *
+ * Returns 1 if the list ended and the line must be shown again. */
+static int completeListKey(struct clirState *cs, char c) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab;
+	int more = c == 'y' || c == 'Y' || c == ' ' || c == 9;
+
+	if (ctx->comp_list_state == LIST_QUERY) {
+		abAppend(ab,"\r\n",2);
+		if (more) return completeListShow(cs,completeListPage(cs));
+	} else {
+		abAppend(ab,"\r\x1b[0K",5);
+		if (more) return completeListShow(cs,completeListPage(cs));
+		if (c == 13) return completeListShow(cs,1);
+	}
+	abFlush(ctx,ab,cs->ofd);
+	completeListEnd(ctx);
+	return 1;
+}
+
+/* Return the length of the prefix that the 'len' candidates in 'words'
+ * have in common, knowing that they share the first 'min' bytes. */
+static size_t completePrefix(char **words, size_t len, size_t min) {
+	size_t prefix = strlen(words[0]), j;
+
+	for (j = 1; j < len && prefix > min; j++) {
+		size_t k = min;
+
+		while (k < prefix && words[j][k] == words[0][k]) k++;
+		prefix = k;
+	}
+	return prefix;
+}
+
+struct fuzzyCandidate {
+	int score;
+	size_t index;               /* Position in the order of the provider. */
+	char *str;
+};
+
+static int fuzzyCandidateCompare(const void *a, const void *b) {
+	const struct fuzzyCandidate *x = a, *y = b;
+
+	if (x->score != y->score) return x->score > y->score ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Put in 'out' the ones of the 'len' words of 'words' that fuzzy match the
+ * word at the cursor, best first, using the 'len' slots of 'm' to sort
+ * them. 'out' may be 'words' itself. Returns how many matched. */
+static size_t fuzzyFilter(struct clirState *cs, char **words, size_t len,
+	char **out, struct fuzzyCandidate *m)
+{
+	const char *word = cs->buf+cs->word_pos;
+	size_t wordlen = cs->pos-cs->word_pos, n = 0, j, start;
+	int fold = fuzzyFold(word,wordlen);
+
+	for (j = 0; j < len; j++) {
+		int score = fuzzyScore(word,wordlen,words[j],strlen(words[j]),
+			fold,&start);
+
+		if (score == -1) continue;
+		m[n].score = score;
+		m[n].index = j;
+		m[n].str = words[j];
+		n++;
+	}
+	qsort(m,n,sizeof(*m),fuzzyCandidateCompare);
+	for (j = 0; j < n; j++) out[j] = m[j].str;
+	return n;
+}
+
+/* Move the candidates of 'cc' that fuzzy match the word at the cursor to
+ * the front of cvec, the best first, keeping the order of the provider
+ * for those that score the same. Returns how many matched. */
+static size_t completeFuzzy(struct clirState *cs, clirCompletions *cc) {
+	struct fuzzyCandidate *m;
+	size_t len;
+
+	if (cc->len == 0 || (m = malloc(sizeof(*m)*cc->len)) == NULL) return 0;
+	len = fuzzyFilter(cs,cc->cvec,cc->len,cc->cvec,m);
+	free(m);
+	return len;
+}
+
+/* Complete the word at the cursor with the 'len' fuzzy matches in
+ * 'matches', best first: the word is replaced by a single one, or by their
+ * common prefix when it still matches, otherwise they are listed and
+ * '*listed' is set. Returns what completeList() does, or 0. */
+static int completeFuzzyMatches(struct clirState *cs, char **matches,
+	size_t len, int *listed)
+{
+	size_t wordlen = cs->pos-cs->word_pos, prefix, start;
+	int retval;
+
+	prefix = completePrefix(matches,len,0);
+	if (len == 1) {
+		editErase(cs,wordlen,1);
+		clirEditInsertLen(cs,matches[0],prefix);
+		clirEditInsert(cs,' ');
+	} else if (prefix > wordlen &&
+		fuzzyScore(cs->buf+cs->word_pos,wordlen,matches[0],prefix,
+			fuzzyFold(cs->buf+cs->word_pos,wordlen),&start) != -1)
+	{
+		editErase(cs,wordlen,1);
+		clirEditInsertLen(cs,matches[0],prefix);
+	} else {
+		retval = completeList(cs,matches,len);
+		*listed = !retval;
+		return retval;
+	}
+	return 0;
+}
+
+/* Complete the word at the cursor with the candidates in 'cc', that is
+ * freed or kept: those starting with the word are matched, a single one is
+ * inserted, with a space after it, and of several ones the prefix they
+ * have in common is inserted, or they are listed when there is none. In
+ * fuzzy mode those that fuzzy match it are, and the word is replaced by
+ * a single one, or by their common prefix when it still matches.
+ *
+ * When the provider marked its candidates as narrowable, they are kept
+ * with the line up to the cursor. A following <tab> on the same word,
+ * with only more characters typed after the text of that line, filters
+ * them instead of asking the provider again.
+ *
+ * Returns 1 if the candidates were listed and the line must be shown
+ * again, 0 otherwise. */
+static int completeApply(struct clirState *cs, clirCompletions *src) {
+	struct clirContext *ctx = cs->ctx;
+	clirCompletions cc = *src;
+	size_t wordlen = cs->pos-cs->word_pos, valid_c = 0, comp_i, prefix;
+	int retval = 0, listed = 0;
+
+	/* The line the candidates are kept for, before it is completed. */
+	if (cc.narrowable) {
+		ctx->comp_line.len = 0;
+		abAppend(&ctx->comp_line,cs->buf,cs->word_pos+wordlen);
+	}
+
+	if (ctx->fuzzy & LINENOISE_FUZZY_COMPLETION) {
+		valid_c = completeFuzzy(cs,&cc);
+	} else {
+		/* Move the candidates starting with the word to the front of
+		 * cvec, the others are still freed with the arena. */
+		for (comp_i = 0; comp_i < cc.len; comp_i++) { // 'foreach' completion
+			if (strncmp(cc.cvec[comp_i],cs->buf+cs->word_pos,wordlen) == 0)
+				cc.cvec[valid_c++] = cc.cvec[comp_i];
+		}
+	}
+
+	if (valid_c == 0) {
+		clirBeep(ctx);
+	} else if (ctx->fuzzy & LINENOISE_FUZZY_COMPLETION) {
+		retval = completeFuzzyMatches(cs,cc.cvec,valid_c,&listed);
+	} else if (valid_c == 1) {
+		const char *rest = cc.cvec[0]+wordlen;
+
+		clirEditInsertLen(cs,rest,strlen(rest));
+		clirEditInsert(cs, ' ');
+	} else if ((prefix = completePrefix(cc.cvec,valid_c,wordlen)) > wordlen) {
+		clirEditInsertLen(cs,cc.cvec[0]+wordlen,prefix-wordlen);
+	} else {
+		retval = completeList(cs,cc.cvec,valid_c);
+		listed = !retval;
+	}
+
+	if (cc.narrowable) {
+		cc.len = valid_c;
+		ctx->comp_cache = cc;
+		ctx->comp_word_pos = cs->word_pos;
+		ctx->comp_cached = ctx->comp_line.len == cs->word_pos+wordlen;
+	}
+	/* Candidates still listed by the pager are freed when it ends. */
+	if (!cc.narrowable || !ctx->comp_cached) {
+		if (listed) ctx->comp_list_cc = cc;
+		else freeCompletions(&cc);
+	}
+	return retval;
+}
+
+/* Return the time of the monotonic clock, in milliseconds. */
+static long long clirNow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+/* Let 'req' go, for the context or for the provider, and free it when
+ * the other one did as well. */
+static void requestRelease(struct clirCompletionRequest *req) {
+	int refs;
+
+	pthread_mutex_lock(&req->lock);
+	refs = --req->refs;
+	pthread_mutex_unlock(&req->lock);
+	if (refs) return;
+	pthread_mutex_destroy(&req->lock);
+	freeCompletions(&req->cc);
+	free(req);
+}
+
+/* Stop waiting for the asynchronous completion of the context, if any.
+ * The options the provider adds after this are dropped, and completing
+ * the request no longer writes the wake pipe, that may then be closed. */
+static void completeAsyncCancel(struct clirContext *ctx) {
+	struct clirCompletionRequest *req = ctx->comp_req;
+
+	if (req == NULL) return;
+	pthread_mutex_lock(&req->lock);
+	req->canceled = 1;
+	req->wake_fd = -1;
+	pthread_mutex_unlock(&req->lock);
+	requestRelease(req);
+	ctx->comp_req = NULL;
+}
+
+/* Ask the asynchronous provider for the completions of the line. The keys
+ * keep being handled meanwhile, and completeAsyncPoll() completes the word
+ * when the provider is done. */
+static int completeAsyncStart(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct clirCompletionRequest *req;
+
+	completeAsyncCancel(ctx);
+	if ((req = malloc(sizeof(*req)+cs->len+1)) == NULL) {
+		clirBeep(ctx);
+		return 0;
+	}
+	pthread_mutex_init(&req->lock,NULL);
+	req->refs = 2;
+	req->done = req->canceled = 0;
+	req->wake_fd = ctx->wake_fd[1];
+	memset(&req->cc,0,sizeof(req->cc));
+	req->pos = cs->pos;
+	req->len = cs->len;
+	memcpy(req->line,cs->buf,cs->len+1);
+	ctx->comp_req = req;
+	ctx->comp_deadline = ctx->comp_timeout ?
+		clirNow()+ctx->comp_timeout : 0;
+	ctx->stats_comp_start = statsClock(ctx);
+	hookCall(ctx,LINENOISE_HOOK_ASYNC_COMPLETION_BEGIN);
+	ctx->asyncCompletionCallback(req->line, req);
+	hookCall(ctx,LINENOISE_HOOK_ASYNC_COMPLETION_END);
+	return 0;
+}
+
+/* Handle the asynchronous completion being waited for: when the line
+ * changed since it was asked the request is dropped, when the provider is
+ * done, or the timeout expired, the word is completed with the options
+ * added so far.
+ *
+ * Returns 1 if the word was completed, 0 otherwise. */
+static int completeAsyncPoll(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct clirCompletionRequest *req = ctx->comp_req;
+	clirCompletions cc;
+	int ready;
+
+	if (req == NULL) return 0;
+	if (cs->pos != req->pos || cs->len != req->len ||
+		memcmp(editFlat(cs),req->line,req->len) != 0)
+	{
+		completeAsyncCancel(ctx);
+		return 0;
+	}
+
+	pthread_mutex_lock(&req->lock);
+	ready = req->done ||
+		(ctx->comp_deadline && clirNow() >= ctx->comp_deadline);
+	if (ready) {
+		cc = req->cc;
+		memset(&req->cc,0,sizeof(req->cc));
+	}
+	pthread_mutex_unlock(&req->lock);
+	if (!ready) return 0;
+
+	statsCompletion(ctx,ctx->stats_comp_start);
+	completeAsyncCancel(ctx);
+	cs->word_pos = completeWordStart(cs);
+	if (completeApply(cs,&cc)) refreshLine(cs);
+	return 1;
+}
+
+/* Call the completion callback for 'buf', telling the hook and counting. */
+static void completeCall(struct clirContext *ctx, const char *buf,
+	clirCompletions *cc)
+{
+	long long start = statsClock(ctx);
+
+	hookCall(ctx,LINENOISE_HOOK_COMPLETION_BEGIN);
+	ctx->completionCallback(buf,cc);
+	hookCall(ctx,LINENOISE_HOOK_COMPLETION_END);
+	statsCompletion(ctx,start);
+}
+
+/* Complete the word at the cursor with the candidates given by the
+ * callback, or the ones cached by the last completion, see
+ * completeApply(). With an asynchronous provider the completion is only
+ * asked here, and done later by completeAsyncPoll().
+ *
+ * Returns 1 if the candidates were listed and the line must be shown
+ * again, 0 otherwise. */
+static int completeWord(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	clirCompletions cc = { 0, NULL, 0, NULL, 0 };
+
+	editFlat(cs);
+	cs->word_pos = completeWordStart(cs);
+	if (ctx->comp_cached && ctx->comp_word_pos == cs->word_pos &&
+		ctx->comp_line.len <= cs->pos &&
+		memcmp(ctx->comp_line.b,cs->buf,ctx->comp_line.len) == 0)
+	{
+		cc = ctx->comp_cache;
+		ctx->comp_cached = 0;
+	} else {
+		completeCacheFree(ctx);
+		if (ctx->asyncCompletionCallback != NULL)
+			return completeAsyncStart(cs);
+		completeCall(ctx,cs->buf,&cc); // Add completions
+	}
+	return completeApply(cs,&cc);
+}
+
+/* The completion dictionary is a sorted array of pointers to the words,
+ * that are all stored in a single allocation. The words starting with a
+ * prefix are a contiguous range of the array, found with two binary
+ * searches, so a lookup costs O(log N) comparisons of the prefix plus the
+ * matches, with no callback and no allocation. */
+
+static int dictCompare(const void *a, const void *b) {
+	return strcmp(*(char * const *)a,*(char * const *)b);
+}
+
+/* Return the index of the first dictionary word that, compared on its
+ * first 'len' bytes, is not less than 'prefix' if 'after' is 0, or is
+ * greater than 'prefix' if 'after' is 1. */
+static size_t dictBound(struct clirContext *ctx, const char *prefix,
+	size_t len, int after)
+{
+	size_t lo = 0, hi = ctx->dict_len;
+
+	while (lo < hi) {
+		size_t mid = lo+(hi-lo)/2;
+		int cmp = strncmp(ctx->dict_words[mid],prefix,len);
+
+		if (cmp < 0 || (after && cmp == 0)) lo = mid+1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Complete the word at the cursor with the dictionary words starting with
+ * it, the same way completeWord() does with the callback ones. */
+static int completeDictionary(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	size_t start = completeWordStart(cs), len = cs->pos-start;
+	const char *prefix = editFlat(cs)+start;
+	size_t lo = dictBound(ctx,prefix,len,0);
+	size_t hi = dictBound(ctx,prefix,len,1);
+
+	cs->word_pos = start;
+	if (ctx->fuzzy & LINENOISE_FUZZY_COMPLETION) {
+		/* Any word may match, they are filtered in the slots allocated
+		 * with the dictionary. */
+		size_t n = fuzzyFilter(cs,ctx->dict_words,ctx->dict_len,
+			ctx->dict_matches,ctx->dict_scores);
+		int listed;
+
+		if (n == 0) {
+			clirBeep(ctx);
+			return 0;
+		}
+		return completeFuzzyMatches(cs,ctx->dict_matches,n,&listed);
+	}
+	if (lo == hi) {
+		clirBeep(ctx);
+	} else if (hi-lo == 1) {
+		const char *rest = ctx->dict_words[lo]+len;
+
+		clirEditInsertLen(cs,rest,strlen(rest));
+		clirEditInsert(cs,' ');
+	} else {
+		/* The words are sorted, the first and the last have the prefix
+		 * of all of them in common. */
+		char *ends[2];
+		size_t prefix;
+
+		ends[0] = ctx->dict_words[lo];
+		ends[1] = ctx->dict_words[hi-1];
+		prefix = completePrefix(ends,2,len);
+		if (prefix > len)
+			clirEditInsertLen(cs,ends[0]+len,prefix-len);
+		else
+			return completeList(cs,ctx->dict_words+lo,hi-lo);
+	}
+	return 0;
+}
+
+/* Free the completion dictionary. */
+static void freeDictionary(struct clirContext *ctx) {
+	completeListEnd(ctx);
+	free(ctx->dict_text);
+	free(ctx->dict_words);
+	free(ctx->dict_matches);
+	free(ctx->dict_scores);
+	ctx->dict_text = NULL;
+	ctx->dict_words = NULL;
+	ctx->dict_matches = NULL;
+	ctx->dict_scores = NULL;
+	ctx->dict_len = 0;
+}
+
+/* Set the 'count' words of 'words' as the completion dictionary, replacing
+ * the previous one, or remove it when 'count' is 0. The words are copied,
+ * and duplicates dropped. While a dictionary is set, the <tab> key
+ * completes from it instead of calling the completion callback.
+ *
+ * Returns 0 on success, -1 when out of memory. */
+int clirCtxSetCompletionDictionary(struct clirContext *ctx,
+	const char **words, size_t count)
+{
+	size_t j, len = 0, n;
+	char *p;
+
+	freeDictionary(ctx);
+	if (count == 0) return 0;
+	for (j = 0; j < count; j++) len += strlen(words[j])+1;
+	ctx->dict_text = malloc(len);
+	ctx->dict_words = malloc(sizeof(char*)*count);
+	ctx->dict_matches = malloc(sizeof(char*)*count);
+	ctx->dict_scores = malloc(sizeof(*ctx->dict_scores)*count);
+	if (ctx->dict_text == NULL || ctx->dict_words == NULL ||
+		ctx->dict_matches == NULL || ctx->dict_scores == NULL)
+	{
+		freeDictionary(ctx);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (j = 0, p = ctx->dict_text; j < count; j++) {
+		size_t l = strlen(words[j])+1;
+
+		memcpy(p,words[j],l);
+		ctx->dict_words[j] = p;
+		p += l;
+	}
+	qsort(ctx->dict_words,count,sizeof(char*),dictCompare);
+	for (j = n = 1; j < count; j++)
+		if (strcmp(ctx->dict_words[j],ctx->dict_words[n-1]))
+			ctx->dict_words[n++] = ctx->dict_words[j];
+	ctx->dict_len = n;
+	return 0;
+}
+
+/* This is an helper function for clirEditFeed() and is called when the
+ * user types the <tab> key in order to complete the string currently in the
+ * input.
+ * 
+ * The state of the editing is encapsulated into the pointed clirState
+ * structure as described in the structure definition. */
+static int completeLine(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	clirCompletions cc = { 0, NULL, 0, NULL, 0 };
+	int nread, nwritten;
+	char c = 0;
+
+	completeCall(ctx,editFlat(cs),&cc);
+	if (cc.len == 0) {
+		clirBeep(ctx);
+	} else {
+		size_t stop = 0, i = 0;
+
+		while (!stop) {
+			/* Show completion or original buffer */
+			if (i < cc.len) {
+				struct clirState saved = *cs;
+
+				cs->len = cs->pos = cs->gap_pos = strlen(cc.cvec[i]);
+				cs->buf = cc.cvec[i];
+				refreshLine(cs);
+				cs->len = saved.len;
+				cs->pos = saved.pos;
+				cs->gap_pos = saved.gap_pos;
+				cs->buf = saved.buf;
+			} else {
+				refreshLine(cs);
+			}
+
+			nread = inputRead(ctx,cs->ifd, &c, 1);
+			if (nread <= 0) {
+				freeCompletions(&cc);
+				return -1;
+			}
+
+			switch(c) {
+				case 9: /* tab */
+					i = (i+1) % (cc.len+1);
+					if (i == cc.len) clirBeep(ctx);
+					break;
+				case 27: /* escape */
+					/* Re-show original buffer */
+					if (i < cc.len) refreshLine(cs);
+					stop = 1;
+					break;
+				default:
+					/* Update buffer and return */
+					if (i < cc.len) {
+						nwritten = snprintf(cs->buf, cs->buflen, "%s", cc.cvec[i]);
+						cs->len = cs->pos = cs->gap_pos = nwritten;
+						editIndexFix(cs,0);
+					}
+					stop = 1;
+					break;
+			}
+		}
+	}
+
+	freeCompletions(&cc);
+	return c; /* Return last read character */
+}
+
+/* Register a callback function to be called for tab-completion. */
+void clirCtxSetCompletionCallback(struct clirContext *ctx, clirCompletionCallback *fn) {
+	ctx->completionCallback = fn;
+}
+
+/* Register a callback function to be called for tab-completion, that
+ * only starts it: the options are added to the request with
+ * clirRequestAddCompletion(), and it is ended by clirRequestComplete(),
+ * from any thread, once the callback returned or even before. The keys
+ * keep being handled meanwhile, the request is dropped when the line
+ * changes, and without an answer the timeout set with
+ * clirCtxSetCompletionTimeout() completes with the options added so far.
+ * It takes precedence over the synchronous callback.
+ *
+ * The provider wakes the context by writing a pipe, that an event loop
+ * also watches, see clirEditWakeFd(). Returns 0 on success, -1 if the
+ * pipe can't be created. */
+int clirCtxSetAsyncCompletionCallback(struct clirContext *ctx,
+	clirAsyncCompletionCallback *fn)
+{
+	if (fn != NULL && wakeOpen(ctx) == -1) return -1;
+	if (fn == NULL) completeAsyncCancel(ctx);
+	ctx->asyncCompletionCallback = fn;
+	return 0;
+}
+
+/* Ask whether to show lists of at least 'items' candidates, 0 to never
+ * ask. The default is LINENOISE_COMPLETION_QUERY_ITEMS. */
+void clirCtxSetCompletionQueryItems(struct clirContext *ctx, int items) {
+	ctx->comp_query_items = items > 0 ? items : 0;
+}
+
+/* Wait at most 'ms' milliseconds for an asynchronous completion, 0 to
+ * wait until the provider is done. */
+void clirCtxSetCompletionTimeout(struct clirContext *ctx, int ms) {
+	ctx->comp_timeout = ms > 0 ? ms : 0;
+}
+
+/* Add 'str' to the options of an asynchronous completion. It is dropped
+ * when the request was canceled or completed. */
+void clirRequestAddCompletion(clirCompletionRequest *req, const char *str) {
+	pthread_mutex_lock(&req->lock);
+	if (!req->canceled && !req->done) clirAddCompletion(&req->cc,(char*)str);
+	pthread_mutex_unlock(&req->lock);
+}
+
+/* Mark the options of an asynchronous completion as narrowable, see
+ * clirSetCompletionNarrowable(). */
+void clirRequestSetNarrowable(clirCompletionRequest *req, int narrowable) {
+	pthread_mutex_lock(&req->lock);
+	req->cc.narrowable = narrowable;
+	pthread_mutex_unlock(&req->lock);
+}
+
+/* Return 1 if nobody waits for the request anymore, so that a provider
+ * can give up early. */
+int clirRequestCanceled(clirCompletionRequest *req) {
+	int canceled;
+
+	pthread_mutex_lock(&req->lock);
+	canceled = req->canceled;
+	pthread_mutex_unlock(&req->lock);
+	return canceled;
+}
+
+/* End an asynchronous completion, waking the context waiting for it. The
+ * request must not be used after this. */
+void clirRequestComplete(clirCompletionRequest *req) {
+	pthread_mutex_lock(&req->lock);
+	if (!req->canceled) {
+		req->done = 1;
+		if (write(req->wake_fd,"",1) == -1) {
+			/* Full pipe, the context is already woken up. */
+		}
+	}
+	pthread_mutex_unlock(&req->lock);
+	requestRelease(req);
+}
+
+/* Append 'str' to the completion options, growing cvec geometrically.
+ * On out of memory the option is dropped. */
+static void completionPush(clirCompletions *cc, char *str) {
+	if (cc->len == cc->cap) {
+		size_t cap = cc->cap ? cc->cap*2 : 16;
+		char **cvec = realloc(cc->cvec,sizeof(char*)*cap);
+
+		if (cvec == NULL) return;
+		cc->cvec = cvec;
+		cc->cap = cap;
+	}
+	cc->cvec[cc->len++] = str;
+}
+
+/* Add the 'len' bytes of 'str' as a completion option, copied in the
+ * arena of 'cc'. The string does not need to be null terminated. */
+void clirAddCompletionLen(clirCompletions *cc, const char *str, size_t len) {
+	struct clirArena *a = cc->arena;
+	char *copy;
+
+	if (a == NULL || a->cap-a->len < len+1) {
+		size_t cap = a ? a->cap*2 : LINENOISE_COMPLETION_CHUNK;
+
+		if (cap < len+1) cap = len+1;
+		if ((a = malloc(sizeof(*a)+cap)) == NULL) return;
+		a->next = cc->arena;
+		a->len = 0;
+		a->cap = cap;
+		cc->arena = a;
+	}
+	copy = a->data+a->len;
+	memcpy(copy,str,len);
+	copy[len] = '\0';
+	a->len += len+1;
+	completionPush(cc,copy);
+}
+
+/* This function is used by the callback function registered by the user
+ * in order to add completion options given the input string when the
+ * user typed <tab>. See the example.c source code for a very easy to
+ * understand example. */
+void clirAddCompletion(clirCompletions *cc, char *str) {
+	clirAddCompletionLen(cc,str,strlen(str));
+}
+
+/* Add 'str' as a completion option without copying it, for strings that
+ * outlive the completion, like static tables. Narrowable options are kept
+ * until the line is complete, so must their strings. */
+void clirAddCompletionBorrowed(clirCompletions *cc, const char *str) {
+	completionPush(cc,(char*)str);
+}
+
+/* Called by the completion callback to tell whether its options may be
+ * narrowed: if the word is only extended, the options for the longer word
+ * are the ones already given that start with it, so the callback does not
+ * need to be called again. */
+void clirSetCompletionNarrowable(clirCompletions *cc, int narrowable) {
+	cc->narrowable = narrowable;
+}
+
+/* ============================= Highlighting =============================== */
+
+/* The highlighting callback gives a style to each byte of the line, that
+ * is kept with a copy of the line. Before a refresh the line is compared
+ * to the copy: the bytes before the first difference and after the last
+ * one keep their style, and the callback is only asked for the bytes in
+ * between, so typing does not tokenize the whole line again. */
+
+/* Bring the styles of the line up to date, calling the callback for the
+ * bytes that changed since it was last called, and return them, or NULL
+ * if there is no callback. */
+static const unsigned char *highlightUpdate(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *text = &ctx->highlight_text, *style = &ctx->highlight_style;
+	size_t len = cs->len, old = text->len, start = 0, end, tail = 0, j;
+
+	if (ctx->highlightCallback == NULL) return NULL;
+	while (start < len && start < old && *editPtr(cs,start) == text->b[start])
+		start++;
+	if (start == len && start == old) return (unsigned char *)style->b;
+	while (tail < len-start && tail < old-start &&
+		*editPtr(cs,len-1-tail) == text->b[old-1-tail]) tail++;
+	end = len-tail;
+
+	/* Move the unchanged tail, then copy the changed bytes. */
+	if (abResize(text,(len > old ? len : old)+1) == -1 ||
+		abResize(style,text->len) == -1)
+	{
+		text->len = style->len = 0;
+		return NULL;
+	}
+	memmove(text->b+end,text->b+old-tail,tail);
+	memmove(style->b+end,style->b+old-tail,tail);
+	for (j = start; j < end; j++) text->b[j] = *editPtr(cs,j);
+	memset(style->b+start,0,end-start);
+	text->b[len] = '\0';
+	text->len = style->len = len;
+
+	hookCall(ctx,LINENOISE_HOOK_HIGHLIGHT_BEGIN);
+	ctx->highlightCallback(text->b,len,start,end,(unsigned char *)style->b);
+	hookCall(ctx,LINENOISE_HOOK_HIGHLIGHT_END);
+	return (unsigned char *)style->b;
+}
+
+/* Register a callback function to be called to highlight the line, or
+ * NULL for none. It is called with the line 'buf' of 'len' bytes, the
+ * range from 'start' to 'end' of the bytes that changed, and the style of
+ * each byte in 'styles', that it updates. A style combines a colour and
+ * attributes, such as LINENOISE_COLOR(LINENOISE_RED)|LINENOISE_STYLE_BOLD,
+ * see clir.h, and is 0 for the default.
+ *
+ * The bytes outside the range keep the style they were given, and those
+ * inside are reset to 0. The callback sets the style of the bytes in the
+ * range, then also of any outside it whose style depends on them, like
+ * the start of a word that got longer, or the rest of the line after a
+ * quote. */
+void clirCtxSetHighlightCallback(struct clirContext *ctx, clirHighlightCallback *fn) {
+	ctx->highlightCallback = fn;
+	ctx->highlight_text.len = ctx->highlight_style.len = 0;
+}
+
+/* ============================ Display width =============================== */
+
+/* The line is UTF-8, and each code point takes the columns of charWidth():
+ * 0 for combining marks and the other zero width ones, 2 for the wide and
+ * fullwidth ones, from the ranges below, and 1 for all the others, like
+ * what wcwidth() computes, without depending on the locale. A byte that is
+ * not part of a valid sequence takes a column, like the replacement
+ * character that terminals show for it.
+ *
+ * The cursor moves over grapheme clusters: a code point and the zero width
+ * ones, emoji modifiers, and code points after a zero width joiner that
+ * follow it. */
+
+/* Code points from U+0300 whose width is not 1, generated from the Unicode
+ * 14 data. Unassigned code points are in the range of their neighbours. */
+static const struct widthRange {
+	unsigned int first, last;
+	int width;
+} width_ranges[] = {
+	{0x300,0x36F,0},{0x483,0x489,0},{0x591,0x5BD,0},{0x5BF,0x5BF,0},
+	{0x5C1,0x5C2,0},{0x5C4,0x5C5,0},{0x5C7,0x5C7,0},{0x600,0x605,0},
+	{0x610,0x61A,0},{0x61C,0x61C,0},{0x64B,0x65F,0},{0x670,0x670,0},
+	{0x6D6,0x6DD,0},{0x6DF,0x6E4,0},{0x6E7,0x6E8,0},{0x6EA,0x6ED,0},
+	{0x70F,0x70F,0},{0x711,0x711,0},{0x730,0x74A,0},{0x7A6,0x7B0,0},
+	{0x7EB,0x7F3,0},{0x7FD,0x7FD,0},{0x816,0x819,0},{0x81B,0x823,0},
+	{0x825,0x827,0},{0x829,0x82D,0},{0x859,0x85B,0},{0x890,0x89F,0},
+	{0x8CA,0x902,0},{0x93A,0x93A,0},{0x93C,0x93C,0},{0x941,0x948,0},
+	{0x94D,0x94D,0},{0x951,0x957,0},{0x962,0x963,0},{0x981,0x981,0},
+	{0x9BC,0x9BC,0},{0x9C1,0x9C4,0},{0x9CD,0x9CD,0},{0x9E2,0x9E3,0},
+	{0x9FE,0xA02,0},{0xA3C,0xA3C,0},{0xA41,0xA51,0},{0xA70,0xA71,0},
+	{0xA75,0xA75,0},{0xA81,0xA82,0},{0xABC,0xABC,0},{0xAC1,0xAC8,0},
+	{0xACD,0xACD,0},{0xAE2,0xAE3,0},{0xAFA,0xB01,0},{0xB3C,0xB3C,0},
+	{0xB3F,0xB3F,0},{0xB41,0xB44,0},{0xB4D,0xB56,0},{0xB62,0xB63,0},
+	{0xB82,0xB82,0},{0xBC0,0xBC0,0},{0xBCD,0xBCD,0},{0xC00,0xC00,0},
+	{0xC04,0xC04,0},{0xC3C,0xC3C,0},{0xC3E,0xC40,0},{0xC46,0xC56,0},
+	{0xC62,0xC63,0},{0xC81,0xC81,0},{0xCBC,0xCBC,0},{0xCBF,0xCBF,0},
+	{0xCC6,0xCC6,0},{0xCCC,0xCCD,0},{0xCE2,0xCE3,0},{0xD00,0xD01,0},
+	{0xD3B,0xD3C,0},{0xD41,0xD44,0},{0xD4D,0xD4D,0},{0xD62,0xD63,0},
+	{0xD81,0xD81,0},{0xDCA,0xDCA,0},{0xDD2,0xDD6,0},{0xE31,0xE31,0},
+	{0xE34,0xE3A,0},{0xE47,0xE4E,0},{0xEB1,0xEB1,0},{0xEB4,0xEBC,0},
+	{0xEC8,0xECD,0},{0xF18,0xF19,0},{0xF35,0xF35,0},{0xF37,0xF37,0},
+	{0xF39,0xF39,0},{0xF71,0xF7E,0},{0xF80,0xF84,0},{0xF86,0xF87,0},
+	{0xF8D,0xFBC,0},{0xFC6,0xFC6,0},{0x102D,0x1030,0},{0x1032,0x1037,0},
+	{0x1039,0x103A,0},{0x103D,0x103E,0},{0x1058,0x1059,0},{0x105E,0x1060,0},
+	{0x1071,0x1074,0},{0x1082,0x1082,0},{0x1085,0x1086,0},{0x108D,0x108D,0},
+	{0x109D,0x109D,0},{0x1100,0x115F,2},{0x1160,0x11FF,0},{0x135D,0x135F,0},
+	{0x1712,0x1714,0},{0x1732,0x1733,0},{0x1752,0x1753,0},{0x1772,0x1773,0},
+	{0x17B4,0x17B5,0},{0x17B7,0x17BD,0},{0x17C6,0x17C6,0},{0x17C9,0x17D3,0},
+	{0x17DD,0x17DD,0},{0x180B,0x180F,0},{0x1885,0x1886,0},{0x18A9,0x18A9,0},
+	{0x1920,0x1922,0},{0x1927,0x1928,0},{0x1932,0x1932,0},{0x1939,0x193B,0},
+	{0x1A17,0x1A18,0},{0x1A1B,0x1A1B,0},{0x1A56,0x1A56,0},{0x1A58,0x1A60,0},
+	{0x1A62,0x1A62,0},{0x1A65,0x1A6C,0},{0x1A73,0x1A7F,0},{0x1AB0,0x1B03,0},
+	{0x1B34,0x1B34,0},{0x1B36,0x1B3A,0},{0x1B3C,0x1B3C,0},{0x1B42,0x1B42,0},
+	{0x1B6B,0x1B73,0},{0x1B80,0x1B81,0},{0x1BA2,0x1BA5,0},{0x1BA8,0x1BA9,0},
+	{0x1BAB,0x1BAD,0},{0x1BE6,0x1BE6,0},{0x1BE8,0x1BE9,0},{0x1BED,0x1BED,0},
+	{0x1BEF,0x1BF1,0},{0x1C2C,0x1C33,0},{0x1C36,0x1C37,0},{0x1CD0,0x1CD2,0},
+	{0x1CD4,0x1CE0,0},{0x1CE2,0x1CE8,0},{0x1CED,0x1CED,0},{0x1CF4,0x1CF4,0},
+	{0x1CF8,0x1CF9,0},{0x1DC0,0x1DFF,0},{0x200B,0x200F,0},{0x202A,0x202E,0},
+	{0x2060,0x206F,0},{0x20D0,0x20F0,0},{0x231A,0x231B,2},{0x2329,0x232A,2},
+	{0x23E9,0x23EC,2},{0x23F0,0x23F0,2},{0x23F3,0x23F3,2},{0x25FD,0x25FE,2},
+	{0x2614,0x2615,2},{0x2648,0x2653,2},{0x267F,0x267F,2},{0x2693,0x2693,2},
+	{0x26A1,0x26A1,2},{0x26AA,0x26AB,2},{0x26BD,0x26BE,2},{0x26C4,0x26C5,2},
+	{0x26CE,0x26CE,2},{0x26D4,0x26D4,2},{0x26EA,0x26EA,2},{0x26F2,0x26F3,2},
+	{0x26F5,0x26F5,2},{0x26FA,0x26FA,2},{0x26FD,0x26FD,2},{0x2705,0x2705,2},
+	{0x270A,0x270B,2},{0x2728,0x2728,2},{0x274C,0x274C,2},{0x274E,0x274E,2},
+	{0x2753,0x2755,2},{0x2757,0x2757,2},{0x2795,0x2797,2},{0x27B0,0x27B0,2},
+	{0x27BF,0x27BF,2},{0x2B1B,0x2B1C,2},{0x2B50,0x2B50,2},{0x2B55,0x2B55,2},
+	{0x2CEF,0x2CF1,0},{0x2D7F,0x2D7F,0},{0x2DE0,0x2DFF,0},{0x2E80,0x3029,2},
+	{0x302A,0x302D,0},{0x302E,0x303E,2},{0x3041,0x3096,2},{0x3099,0x309A,0},
+	{0x309B,0x3247,2},{0x3250,0x4DBF,2},{0x4E00,0xA4C6,2},{0xA66F,0xA672,0},
+	{0xA674,0xA67D,0},{0xA69E,0xA69F,0},{0xA6F0,0xA6F1,0},{0xA802,0xA802,0},
+	{0xA806,0xA806,0},{0xA80B,0xA80B,0},{0xA825,0xA826,0},{0xA82C,0xA82C,0},
+	{0xA8C4,0xA8C5,0},{0xA8E0,0xA8F1,0},{0xA8FF,0xA8FF,0},{0xA926,0xA92D,0},
+	{0xA947,0xA951,0},{0xA960,0xA97C,2},{0xA980,0xA982,0},{0xA9B3,0xA9B3,0},
+	{0xA9B6,0xA9B9,0},{0xA9BC,0xA9BD,0},{0xA9E5,0xA9E5,0},{0xAA29,0xAA2E,0},
+	{0xAA31,0xAA32,0},{0xAA35,0xAA36,0},{0xAA43,0xAA43,0},{0xAA4C,0xAA4C,0},
+	{0xAA7C,0xAA7C,0},{0xAAB0,0xAAB0,0},{0xAAB2,0xAAB4,0},{0xAAB7,0xAAB8,0},
+	{0xAABE,0xAABF,0},{0xAAC1,0xAAC1,0},{0xAAEC,0xAAED,0},{0xAAF6,0xAAF6,0},
+	{0xABE5,0xABE5,0},{0xABE8,0xABE8,0},{0xABED,0xABED,0},{0xAC00,0xD7A3,2},
+	{0xD7B0,0xD7FB,0},{0xF900,0xFAD9,2},{0xFB1E,0xFB1E,0},{0xFE00,0xFE0F,0},
+	{0xFE10,0xFE19,2},{0xFE20,0xFE2F,0},{0xFE30,0xFE6B,2},{0xFEFF,0xFEFF,0},
+	{0xFF01,0xFF60,2},{0xFFE0,0xFFE6,2},{0xFFF9,0xFFFB,0},{0x101FD,0x101FD,0},
+	{0x102E0,0x102E0,0},{0x10376,0x1037A,0},{0x10A01,0x10A0F,0},
+	{0x10A38,0x10A3F,0},{0x10AE5,0x10AE6,0},{0x10D24,0x10D27,0},
+	{0x10EAB,0x10EAC,0},{0x10F46,0x10F50,0},{0x10F82,0x10F85,0},
+	{0x11001,0x11001,0},{0x11038,0x11046,0},{0x11070,0x11070,0},
+	{0x11073,0x11074,0},{0x1107F,0x11081,0},{0x110B3,0x110B6,0},
+	{0x110B9,0x110BA,0},{0x110BD,0x110BD,0},{0x110C2,0x110CD,0},
+	{0x11100,0x11102,0},{0x11127,0x1112B,0},{0x1112D,0x11134,0},
+	{0x11173,0x11173,0},{0x11180,0x11181,0},{0x111B6,0x111BE,0},
+	{0x111C9,0x111CC,0},{0x111CF,0x111CF,0},{0x1122F,0x11231,0},
+	{0x11234,0x11234,0},{0x11236,0x11237,0},{0x1123E,0x1123E,0},
+	{0x112DF,0x112DF,0},{0x112E3,0x112EA,0},{0x11300,0x11301,0},
+	{0x1133B,0x1133C,0},{0x11340,0x11340,0},{0x11366,0x11374,0},
+	{0x11438,0x1143F,0},{0x11442,0x11444,0},{0x11446,0x11446,0},
+	{0x1145E,0x1145E,0},{0x114B3,0x114B8,0},{0x114BA,0x114BA,0},
+	{0x114BF,0x114C0,0},{0x114C2,0x114C3,0},{0x115B2,0x115B5,0},
+	{0x115BC,0x115BD,0},{0x115BF,0x115C0,0},{0x115DC,0x115DD,0},
+	{0x11633,0x1163A,0},{0x1163D,0x1163D,0},{0x1163F,0x11640,0},
+	{0x116AB,0x116AB,0},{0x116AD,0x116AD,0},{0x116B0,0x116B5,0},
+	{0x116B7,0x116B7,0},{0x1171D,0x1171F,0},{0x11722,0x11725,0},
+	{0x11727,0x1172B,0},{0x1182F,0x11837,0},{0x11839,0x1183A,0},
+	{0x1193B,0x1193C,0},{0x1193E,0x1193E,0},{0x11943,0x11943,0},
+	{0x119D4,0x119DB,0},{0x119E0,0x119E0,0},{0x11A01,0x11A0A,0},
+	{0x11A33,0x11A38,0},{0x11A3B,0x11A3E,0},{0x11A47,0x11A47,0},
+	{0x11A51,0x11A56,0},{0x11A59,0x11A5B,0},{0x11A8A,0x11A96,0},
+	{0x11A98,0x11A99,0},{0x11C30,0x11C3D,0},{0x11C3F,0x11C3F,0},
+	{0x11C92,0x11CA7,0},{0x11CAA,0x11CB0,0},{0x11CB2,0x11CB3,0},
+	{0x11CB5,0x11CB6,0},{0x11D31,0x11D45,0},{0x11D47,0x11D47,0},
+	{0x11D90,0x11D91,0},{0x11D95,0x11D95,0},{0x11D97,0x11D97,0},
+	{0x11EF3,0x11EF4,0},{0x13430,0x13438,0},{0x16AF0,0x16AF4,0},
+	{0x16B30,0x16B36,0},{0x16F4F,0x16F4F,0},{0x16F8F,0x16F92,0},
+	{0x16FE0,0x16FE3,2},{0x16FE4,0x16FE4,0},{0x16FF0,0x1B2FB,2},
+	{0x1BC9D,0x1BC9E,0},{0x1BCA0,0x1CF46,0},{0x1D167,0x1D169,0},
+	{0x1D173,0x1D182,0},{0x1D185,0x1D18B,0},{0x1D1AA,0x1D1AD,0},
+	{0x1D242,0x1D244,0},{0x1DA00,0x1DA36,0},{0x1DA3B,0x1DA6C,0},
+	{0x1DA75,0x1DA75,0},{0x1DA84,0x1DA84,0},{0x1DA9B,0x1DAAF,0},
+	{0x1E000,0x1E02A,0},{0x1E130,0x1E136,0},{0x1E2AE,0x1E2AE,0},
+	{0x1E2EC,0x1E2EF,0},{0x1E8D0,0x1E8D6,0},{0x1E944,0x1E94A,0},
+	{0x1F004,0x1F004,2},{0x1F0CF,0x1F0CF,2},{0x1F18E,0x1F18E,2},
+	{0x1F191,0x1F19A,2},{0x1F200,0x1F320,2},{0x1F32D,0x1F335,2},
+	{0x1F337,0x1F37C,2},{0x1F37E,0x1F393,2},{0x1F3A0,0x1F3CA,2},
+	{0x1F3CF,0x1F3D3,2},{0x1F3E0,0x1F3F0,2},{0x1F3F4,0x1F3F4,2},
+	{0x1F3F8,0x1F43E,2},{0x1F440,0x1F440,2},{0x1F442,0x1F4FC,2},
+	{0x1F4FF,0x1F53D,2},{0x1F54B,0x1F54E,2},{0x1F550,0x1F567,2},
+	{0x1F57A,0x1F57A,2},{0x1F595,0x1F596,2},{0x1F5A4,0x1F5A4,2},
+	{0x1F5FB,0x1F64F,2},{0x1F680,0x1F6C5,2},{0x1F6CC,0x1F6CC,2},
+	{0x1F6D0,0x1F6D2,2},{0x1F6D5,0x1F6DF,2},{0x1F6EB,0x1F6EC,2},
+	{0x1F6F4,0x1F6FC,2},{0x1F7E0,0x1F7F0,2},{0x1F90C,0x1F93A,2},
+	{0x1F93C,0x1F945,2},{0x1F947,0x1F9FF,2},{0x1FA70,0x1FAF6,2},
+	{0x20000,0x3FFFD,2},{0xE0001,0xE01EF,0}
+};
+
+/* Return the columns taken by the code point 'cp'. */
+static int charWidth(unsigned int cp) {
+	size_t lo = 0, hi = sizeof(width_ranges)/sizeof(width_ranges[0]);
+
+	if (cp < 0x300) return 1;
+	while (lo < hi) {
+		size_t mid = (lo+hi)/2;
+
+		if (cp > width_ranges[mid].last) lo = mid+1;
+		else if (cp < width_ranges[mid].first) hi = mid;
+		else return width_ranges[mid].width;
+	}
+	return 1;
+}
+
+/* Tell whether the code point 'cp' continues the grapheme cluster before
+ * it, instead of starting a new one. */
+static int charExtends(unsigned int cp) {
+	return cp >= 0x300 && (charWidth(cp) == 0 || (cp >= 0x1F3FB && cp <= 0x1F3FF));
+}
+
+/* Decode the UTF-8 sequence at the start of the 'len' bytes of 's' into
+ * '*cp'. Returns its length, or 0 if it is not a valid sequence. */
+static int utf8Decode(const unsigned char *s, size_t len, unsigned int *cp) {
+	unsigned int v;
+	int n, j;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	}
+	if (s[0] < 0xC2) return 0;
+	else if (s[0] < 0xE0) n = 2, v = s[0] & 0x1F;
+	else if (s[0] < 0xF0) n = 3, v = s[0] & 0x0F;
+	else if (s[0] < 0xF5) n = 4, v = s[0] & 0x07;
+	else return 0;
+	if (len < (size_t)n) return 0;
+	for (j = 1; j < n; j++) {
+		if ((s[j] & 0xC0) != 0x80) return 0;
+		v = v<<6 | (s[j] & 0x3F);
+	}
+	if ((n == 3 && (v < 0x800 || (v >= 0xD800 && v <= 0xDFFF))) ||
+		(n == 4 && (v < 0x10000 || v > 0x10FFFF))) return 0;
+	*cp = v;
+	return n;
+}
+
+/* Set the width of each of the 'len' bytes of 's' in 'w': the whole width
+ * of a code point goes to its first byte. Returns the total width. */
+static size_t strWidths(const char *s, size_t len, char *w) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i = 0, width = 0;
+
+	while (i < len) {
+		unsigned int cp;
+		int n = utf8Decode(u+i,len-i,&cp);
+
+		if (n == 0) n = 1, cp = u[i];
+		width += w[i++] = charWidth(cp);
+		while (--n) w[i++] = 0;
+	}
+	return width;
+}
+
+/* Return how many of the 'len' bytes of 's' fit in 'cols' columns, without
+ * splitting a grapheme cluster, and set '*width' to their width. */
+static size_t strFit(const char *s, size_t len, size_t cols, size_t *width) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i = 0, w = 0, fit = 0, fitw = 0;
+	unsigned int cp, prev = 0;
+
+	while (i < len) {
+		int n = utf8Decode(u+i,len-i,&cp);
+
+		if (n == 0) n = 1, cp = u[i];
+		if (!charExtends(cp) && prev != 0x200D) fit = i, fitw = w;
+		if (w+charWidth(cp) > cols) {
+			*width = fitw;
+			return fit;
+		}
+		w += charWidth(cp);
+		prev = cp;
+		i += n;
+	}
+	*width = w;
+	return len;
+}
+
+/* Return the width of the 'len' bytes of 's'. */
+static size_t strWidth(const char *s, size_t len) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i = 0, width = 0;
+
+	while (i < len) {
+		unsigned int cp;
+		int n;
+
+		if (u[i] < 0x80) {
+			width++;
+			i++;
+			continue;
+		}
+		if ((n = utf8Decode(u+i,len-i,&cp)) == 0) n = 1, cp = u[i];
+		width += charWidth(cp);
+		i += n;
+	}
+	return width;
+}
+
+/* =========================== Line editing ================================= */
+
+/* Append 'len' bytes of 's' to the buffer. On out of memory the bytes are
+ * dropped, the only effect being a wrong refresh. */
+static void abAppend(struct abuf *ab, const char *s, size_t len) {
+	size_t old = ab->len;
+
+	if (abResize(ab,old+len) == -1) return;
+	memcpy(ab->b+old,s,len);
+}
+
+/* Set the length of the buffer to 'len', growing it as needed, the bytes
+ * added being undefined. Returns -1 on out of memory. */
+static int abResize(struct abuf *ab, size_t len) {
+	if (len > ab->cap) {
+		size_t cap = ab->cap ? ab->cap : 256;
+		char *new;
+
+		while (cap < len) cap *= 2;
+		if ((new = realloc(ab->b,cap)) == NULL) return -1;
+		ab->b = new;
+		ab->cap = cap;
+	}
+	ab->len = len;
+	return 0;
+}
+
+/* Append the printf() style formatted string to the buffer. Only used for
+ * short escape sequences. */
+static void abPrintf(struct abuf *ab, const char *fmt, ...) {
+	char seq[64];
+	va_list ap;
+	int len;
+
+	va_start(ap,fmt);
+	len = vsnprintf(seq,sizeof(seq),fmt,ap);
+	va_end(ap);
+	if (len <= 0) return;
+	abAppend(ab,seq,(size_t)len < sizeof(seq) ? (size_t)len : sizeof(seq)-1);
+}
+
+/* Write the content of the buffer to 'fd' and empty it.
+ * Returns -1 on error, 0 otherwise. */
+static int abFlush(struct clirContext *ctx, struct abuf *ab, int fd) {
+	int retval = termWrite(ctx,fd,ab->b,ab->len);
+
+	ctx->refresh_bytes = ab->len;
+	ab->len = 0;
+	return retval;
+}
+
+/* Return the number of bytes written to the terminal by the last refresh
+ * of the edited line. */
+size_t clirCtxLastRefreshBytes(struct clirContext *ctx) {
+	return ctx->refresh_bytes;
+}
+
+/* Forget what the last frame was, because something else was written on
+ * the terminal. The next refresh will redraw the whole line. */
+static void refreshInvalidate(struct clirContext *ctx) {
+	ctx->refresh_frame_valid = 0;
+}
+
+/* Record that the terminal shows 'len' bytes of 's' on the current row,
+ * with the cursor after them. */
+static void refreshSetFrame(struct clirContext *ctx, const char *s, size_t len) {
+	struct abuf *style = &ctx->refresh_frame_style;
+	struct abuf *width = &ctx->refresh_frame_width;
+
+	ctx->refresh_frame.len = 0;
+	abAppend(&ctx->refresh_frame,s,len);
+	ctx->refresh_frame_hint = ctx->refresh_frame.len;
+	ctx->refresh_frame_valid = abResize(style,ctx->refresh_frame.len) == 0 &&
+		abResize(width,ctx->refresh_frame.len) == 0;
+	if (!ctx->refresh_frame_valid) return;
+	memset(style->b,0,style->len);
+	ctx->refresh_frame_cells = strWidths(ctx->refresh_frame.b,width->len,width->b);
+	ctx->refresh_frame_col = ctx->refresh_frame_cells;
+}
+
+/* Append to 'ab' the sequence that moves the cursor on the current row
+ * from column 'from' to column 'to'. Relative moves are shorter, but can't
+ * be used when the cursor may be waiting to wrap past the last column. */
+static void abMoveCursor(struct abuf *ab, size_t from, size_t to, size_t cols) {
+	if (from == to) return;
+	if (from >= cols) abPrintf(ab,"\x1b[%dG",(int)to+1);
+	else if (to < from) abPrintf(ab,"\x1b[%dD",(int)(from-to));
+	else abPrintf(ab,"\x1b[%dC",(int)(to-from));
+}
+
+/* Frames are made of the bytes shown, with the style and the cells of each
+ * byte, so that widths and differences are computed without decoding the
+ * text again, and without escape sequences: these are only written with
+ * the bytes, by abAppendFrame(). A style is a byte of LINENOISE_STYLE_*
+ * bits, written as one SGR sequence, 0 for the default. The cells of a
+ * code point all go to its first byte, and in multi line mode a wide
+ * character that does not fit at the end of a row takes 3: that of the
+ * space written to fill the row, then its own. */
+#define FRAME_WRAP_WIDE 3
+
+/* Append to the SGR sequence of 'len' bytes in 'seq' the parameter 'n'.
+ * Returns the new length. */
+static size_t sgrParam(char *seq, size_t len, int n) {
+	if (len > 2) seq[len++] = ';';
+	return len+sprintf(seq+len,"%d",n);
+}
+
+/* Append to 'ab' the SGR sequence selecting the style 'st', a colour and
+ * attributes, after resetting the previous one when 'reset' is not 0. */
+static void abAppendStyle(struct abuf *ab, unsigned char st, int reset) {
+	char seq[24] = "\x1b[";
+	size_t len = 2;
+
+	if (reset) len = sgrParam(seq,len,0);
+	if (st & LINENOISE_STYLE_BOLD) len = sgrParam(seq,len,1);
+	if (st & LINENOISE_STYLE_UNDERLINE) len = sgrParam(seq,len,4);
+	if (st & LINENOISE_STYLE_REVERSE) len = sgrParam(seq,len,7);
+	if (st & LINENOISE_STYLE_COLOR)
+		len = sgrParam(seq,len,(st & LINENOISE_STYLE_BRIGHT ? 90 : 30)+(st & 7));
+	seq[len++] = 'm';
+	abAppend(ab,seq,len);
+}
+
+/* Append to 'ab' the bytes 'from' to 'to' of the frame 'f', whose styles
+ * are 'style' and cells 'width', each run of bytes of the same style after
+ * the SGR sequence selecting it. The default style is restored at the
+ * end. */
+static void abAppendFrame(struct abuf *ab, const char *f, const char *style,
+	const char *width, size_t from, size_t to)
+{
+	unsigned char cur = 0;
+
+	while (from < to) {
+		unsigned char st = style[from];
+		size_t run = from, j;
+
+		while (run < to && (unsigned char)style[run] == st) run++;
+		if (st != cur) {
+			/* Reset first, unless nothing is to be undone. */
+			if (st == 0) abAppend(ab,"\x1b[0m",4);
+			else abAppendStyle(ab,st,cur != 0);
+			cur = st;
+		}
+		for (j = from; j < run; j++) {
+			if (width[j] != FRAME_WRAP_WIDE) continue;
+			abAppend(ab,f+from,j-from);
+			abAppend(ab," ",1);
+			from = j;
+		}
+		abAppend(ab,f+from,run-from);
+		from = run;
+	}
+	if (cur) abAppend(ab,"\x1b[0m",4);
+}
+
+/* Return the cells taken by the first 'len' bytes of a frame whose bytes
+ * take 'width' cells. */
+static size_t frameCells(const char *width, size_t len) {
+	size_t cells = 0, j;
+
+	for (j = 0; j < len; j++) cells += (unsigned char)width[j];
+	return cells;
+}
+
+/* Compose in refresh_next the frame of the line: the prompt, the 'len'
+ * bytes of the buffer from 'off' and the 'hlen' bytes of the suggestion,
+ * with their styles in refresh_next_style and cells in refresh_next_width.
+ * Rows wrap every 'wrap' cells, or never with 0. Returns where the
+ * suggestion starts. */
+static size_t refreshCompose(struct clirState *cs, size_t off, size_t len,
+	const char *suggestion, size_t hlen, size_t wrap)
+{
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *next = &ctx->refresh_next, *style = &ctx->refresh_next_style;
+	struct abuf *width = &ctx->refresh_next_width;
+	const unsigned char *styles = highlightUpdate(cs);
+	size_t plen = strlen(cs->prompt), hint, cells = 0, col, j;
+
+	next->len = 0;
+	abAppend(next,cs->prompt,plen);
+	editAppend(cs,next,off,len);
+	hint = next->len;
+	if (suggestion) abAppend(next,suggestion,hlen);
+	if (abResize(style,next->len) == -1 || abResize(width,next->len) == -1) {
+		ctx->refresh_next_cells = 0;
+		return next->len = 0;
+	}
+	memset(style->b,0,hint);
+	if (styles && hint == plen+len) memcpy(style->b+plen,styles+off,len);
+	memset(style->b+hint,LINENOISE_SUGGEST_STYLE,next->len-hint);
+
+	/* The cells of the line come from its index. */
+	strWidths(next->b,plen,width->b);
+	col = editCol(cs,off);
+	for (j = 0; j < hint-plen; j++) {
+		size_t end = editCol(cs,off+j+1);
+
+		width->b[plen+j] = end-col;
+		col = end;
+	}
+	strWidths(next->b+hint,next->len-hint,width->b+hint);
+	for (j = 0; j < next->len; j++) {
+		if (wrap > 1 && width->b[j] == 2 && cells%wrap == wrap-1)
+			width->b[j] = FRAME_WRAP_WIDE;
+		cells += width->b[j];
+	}
+	ctx->refresh_next_cells = cells;
+	return hint;
+}
+
+/* Swap the frame composed in refresh_next with the last drawn one, once it
+ * was drawn, with the cursor at cell 'col'. */
+static void refreshSwapFrame(struct clirContext *ctx, size_t col, size_t hint) {
+	struct abuf swap;
+	size_t cells;
+
+	swap = ctx->refresh_frame;
+	ctx->refresh_frame = ctx->refresh_next;
+	ctx->refresh_next = swap;
+	swap = ctx->refresh_frame_style;
+	ctx->refresh_frame_style = ctx->refresh_next_style;
+	ctx->refresh_next_style = swap;
+	swap = ctx->refresh_frame_width;
+	ctx->refresh_frame_width = ctx->refresh_next_width;
+	ctx->refresh_next_width = swap;
+	cells = ctx->refresh_frame_cells;
+	ctx->refresh_frame_cells = ctx->refresh_next_cells;
+	ctx->refresh_next_cells = cells;
+	ctx->refresh_frame_col = col;
+	ctx->refresh_frame_hint = hint;
+	ctx->refresh_frame_valid = 1;
+}
+
+/* Return how many bytes the frame composed in refresh_next has the same
+ * as the last drawn one at their start, with the same styles and cells.
+ * That is backed up to the start of a code point, and of the zero width
+ * ones after it, since the terminal draws them together in a cell. */
+static size_t frameSame(struct clirContext *ctx) {
+	const char *a = ctx->refresh_next.b, *b = ctx->refresh_frame.b;
+	const char *as = ctx->refresh_next_style.b, *bs = ctx->refresh_frame_style.b;
+	const char *aw = ctx->refresh_next_width.b, *bw = ctx->refresh_frame_width.b;
+	size_t alen = ctx->refresh_next.len, blen = ctx->refresh_frame.len;
+	size_t len = alen < blen ? alen : blen, same = 0;
+
+	while (same < len && a[same] == b[same] && as[same] == bs[same] &&
+		aw[same] == bw[same]) same++;
+	while (same > 0 && ((same < alen && aw[same] == 0) ||
+		(same < blen && bw[same] == 0))) same--;
+	return same;
+}
+
+/* Single line low level line refresh.
+ *
+ * Rewrite the currently edited line accordingly to the buffer content,
+ * cursor position, and number of columns of the terminal. Only the part of
+ * the line that changed since the last refresh is sent. */
+static void refreshSingleLine(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	size_t plen = strlen(cs->prompt), pw = strWidth(cs->prompt,plen);
+	struct abuf *ab = &ctx->refresh_ab, *next = &ctx->refresh_next;
+	struct abuf *frame = &ctx->refresh_frame;
+	const char *style, *width;
+	size_t room = cs->cols > pw ? cs->cols-pw : 1; /* Columns for the line. */
+	size_t at = editCol(cs,cs->pos), off = 0, end = cs->len, start = 0;
+	size_t col, same = 0, hint, hlen, hw, used;
+	const char *suggestion = suggestFind(cs,&hlen);
+
+	/* Scroll the line so that the cursor is visible, and cut it at the
+	 * right edge. The positions of the columns come from the index. */
+	if (at >= room) {
+		off = editColPos(cs,at-room+1,0);
+		start = editCol(cs,off);
+	}
+	if (editWidth(cs)-start > room) end = editColPos(cs,start+room,1);
+	used = pw+editCol(cs,end)-start;
+
+	/* Compose the new frame: the prompt, the current buffer content, and
+	 * as much of the suggestion as fits. */
+	if (used >= cs->cols) suggestion = NULL;
+	else if (suggestion) hlen = strFit(suggestion,hlen,cs->cols-used,&hw);
+	hint = refreshCompose(cs,off,end-off,suggestion,hlen,0);
+	style = ctx->refresh_next_style.b;
+	width = ctx->refresh_next_width.b;
+	col = pw+at-start;
+
+	if (ctx->refresh_frame_valid) same = frameSame(ctx);
+
+	if (!ctx->refresh_frame_valid) {
+		/* Cursor to left edge, write everything, erase to right. */
+		abAppend(ab,"\x1b[0G",4);
+		abAppendFrame(ab,next->b,style,width,0,next->len);
+		abAppend(ab,"\x1b[0K",4);
+		abMoveCursor(ab,ctx->refresh_next_cells,col,cs->cols);
+	} else if (same == next->len && same == frame->len) {
+		/* Same text, maybe the cursor moved. */
+		abMoveCursor(ab,ctx->refresh_frame_col,col,cs->cols);
+	} else {
+		/* Rewrite from the first changed byte, erasing what's left of
+		 * the old frame if the new one is shorter. */
+		abMoveCursor(ab,ctx->refresh_frame_col,frameCells(width,same),cs->cols);
+		abAppendFrame(ab,next->b,style,width,same,next->len);
+		if (ctx->refresh_next_cells < ctx->refresh_frame_cells)
+			abAppend(ab,"\x1b[0K",4);
+		abMoveCursor(ab,ctx->refresh_next_cells,col,cs->cols);
+	}
+	if (ab->len) abFlush(ctx,ab,cs->ofd);
+	else ctx->refresh_bytes = 0;
+	refreshSwapFrame(ctx,col,hint);
+}
+
+/* Forget what the screen shows: the next refresh draws the line from the
+ * current row, without erasing anything above it. */
+static void refreshFromHere(struct clirState *cs) {
+	refreshInvalidate(cs->ctx);
+	cs->oldpos = 0;
+	cs->maxrows = 0;
+}
+
+/* Append to 'ab' the sequence that moves the cursor from row 'from' to row
+ * 'to' of the line, in multi line mode. Rows past the 'rows' ones already
+ * drawn are created with newlines, that scroll the screen when needed. */
+static void abMoveRow(struct abuf *ab, size_t from, size_t to, size_t rows) {
+	if (to < from) {
+		abPrintf(ab,"\x1b[%dA",(int)(from-to));
+		return;
+	}
+	if (rows && from < rows-1) {
+		size_t down = (to < rows ? to : rows-1)-from;
+
+		if (down) abPrintf(ab,"\x1b[%dB",(int)down);
+		from += down;
+	}
+	for (; from < to; from++) abAppend(ab,"\n",1);
+}
+
+/* Multi line low level line refresh, drawing everything.
+ *
+ * Rewrite the currently edited line accordingly to the buffer content,
+ * cursor position, and number of columns of the terminal, that is draw
+ * the frame composed in refresh_next, with the cursor at cell 'cur'. */
+static void refreshMultiLineFull(struct clirState *cs, size_t cur) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *next = &ctx->refresh_next;
+	int cells = ctx->refresh_next_cells;
+	int rows = (cells+cs->cols-1)/cs->cols; /* rows used by current buf. */
+	int rpos = (cs->oldpos+cs->cols)/cs->cols; /* cursor relative row. */
+	int rpos2; /* rpos after refresh. */
+	int old_rows = cs->maxrows;
+	struct abuf *ab = &ctx->refresh_ab;
+	int j;
+
+	/* Update maxrows if needed. */
+	if (rows > (int)cs->maxrows) cs->maxrows = rows;
+
+#ifdef LN_DEBUG
+	FILE *fp = fopen("/tmp/debug.txt","a");
+	fprintf(fp,"[%d %d %d] c: %d, rows: %d, rpos: %d, max: %d, oldmax: %d",
+			(int)cs->len,(int)cs->pos,(int)cs->oldpos,cells,rows,rpos,(int)cs->maxrows,old_rows);
+#endif
+
+	/* First step: clear all the lines used before. To do so start by
+	 * going to the last row. */
+	if (old_rows-rpos > 0) {
+#ifdef LN_DEBUG
+		fprintf(fp,", go down %d", old_rows-rpos);
+#endif
+		abPrintf(ab,"\x1b[%dB", old_rows-rpos);
+	}
+
+	/* Now for every row clear it, go up. */
+	for (j = 0; j < old_rows-1; j++) {
+#ifdef LN_DEBUG
+		fprintf(fp,", clear+up");
+#endif
+		abAppend(ab,"\x1b[0G\x1b[0K\x1b[1A",12);
+	}
+
+	/* Clean the top line. */
+#ifdef LN_DEBUG
+	fprintf(fp,", clear");
+#endif
+	abAppend(ab,"\x1b[0G\x1b[0K",8);
+
+	/* Write the prompt, the current buffer content and the suggestion. */
+	abAppendFrame(ab,next->b,ctx->refresh_next_style.b,
+		ctx->refresh_next_width.b,0,next->len);
+
+	/* If we are at the very end of the screen with our prompt, we need to
+	 * emit a newline and move the prompt to the first column. */
+	if (cs->pos && cur == (size_t)cells && cur % cs->cols == 0) {
+#ifdef LN_DEBUG
+		fprintf(fp,", <newline>");
+#endif
+		abAppend(ab,"\n\x1b[0G",5);
+		rows++;
+		if (rows > (int)cs->maxrows) cs->maxrows = rows;
+	}
+
+	/* Move cursor to right position. */
+	rpos2 = (cur+cs->cols)/cs->cols; /* current cursor relative row. */
+#ifdef LN_DEBUG
+	fprintf(fp,", rpos2 %d", rpos2);
+#endif
+	/* Go up till we reach the expected positon. */
+	if (rows-rpos2 > 0) {
+#ifdef LN_DEBUG
+		fprintf(fp,", go-up %d", rows-rpos2);
+#endif
+		abPrintf(ab,"\x1b[%dA", rows-rpos2);
+	}
+	/* Set column. */
+#ifdef LN_DEBUG
+	fprintf(fp,", set col %d", 1+(int)(cur % cs->cols));
+#endif
+	abPrintf(ab,"\x1b[%dG", 1+(int)(cur % cs->cols));
+
+	cs->oldpos = cur;
+	abFlush(ctx,ab,cs->ofd);
+
+#ifdef LN_DEBUG
+	fprintf(fp,"\n");
+	fclose(fp);
+#endif
+}
+
+/* Multi line low level line refresh.
+ *
+ * The line wraps over as many rows as needed, and the renderer remembers
+ * what it drew last, like in single line mode. Only the rows from the
+ * first changed byte to the last one are written again, then the cursor
+ * is moved, so the output of an edit does not grow with the size of the
+ * buffer. When the screen content is not known the whole line is drawn
+ * by refreshMultiLineFull(). */
+static void refreshMultiLine(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab, *next = &ctx->refresh_next;
+	struct abuf *frame = &ctx->refresh_frame;
+	const char *style, *width, *fstyle = ctx->refresh_frame_style.b;
+	const char *fwidth = ctx->refresh_frame_width.b;
+	size_t plen = strlen(cs->prompt), cols = cs->cols;
+	size_t col, same = 0, end, cur, row, hint, hlen, from, to;
+	const char *suggestion = suggestFind(cs,&hlen);
+
+	/* Compose the new frame: the prompt, the current buffer content and
+	 * the suggestion. The cursor goes to the cell of its byte, past the
+	 * space filling the row before a wide character. */
+	hint = refreshCompose(cs,0,cs->len,suggestion,hlen,cols);
+	style = ctx->refresh_next_style.b;
+	width = ctx->refresh_next_width.b;
+	col = frameCells(width,plen+cs->pos);
+	if (plen+cs->pos < next->len && width[plen+cs->pos] == FRAME_WRAP_WIDE)
+		col++;
+
+	if (!ctx->refresh_frame_valid) {
+		refreshMultiLineFull(cs,col);
+	} else {
+		/* The changed bytes go from 'same' to 'end' of the new frame.
+		 * When the length changed, everything after the first change
+		 * moved, up to the end. The end is never inside a cell. */
+		same = frameSame(ctx);
+		end = next->len;
+		if (next->len == frame->len &&
+			ctx->refresh_next_cells == ctx->refresh_frame_cells)
+		{
+			while (end > same && next->b[end-1] == frame->b[end-1] &&
+				style[end-1] == fstyle[end-1] &&
+				width[end-1] == fwidth[end-1]) end--;
+			while (end < next->len && width[end] == 0) end++;
+		}
+
+		cur = ctx->refresh_frame_col/cols;
+		if (same < end || ctx->refresh_next_cells < ctx->refresh_frame_cells) {
+			from = frameCells(width,same);
+			to = from+frameCells(width+same,end-same);
+			row = from/cols;
+			abMoveRow(ab,cur,row,cs->maxrows);
+			abPrintf(ab,"\x1b[%dG",(int)(from%cols)+1);
+			if (ctx->refresh_next_cells < ctx->refresh_frame_cells)
+				abAppend(ab,"\x1b[0J",4);
+			abAppendFrame(ab,next->b,style,width,same,end);
+			/* After a byte written in the last column the cursor waits
+			 * there to wrap. */
+			cur = to > from ? (to-1)/cols : row;
+			if (to > from && (to-1)/cols+1 > cs->maxrows)
+				cs->maxrows = (to-1)/cols+1;
+		}
+		row = col/cols;
+		abMoveRow(ab,cur,row,cs->maxrows);
+		if (row+1 > cs->maxrows) cs->maxrows = row+1;
+		abPrintf(ab,"\x1b[%dG",(int)(col%cols)+1);
+		cs->oldpos = col;
+		abFlush(ctx,ab,cs->ofd);
+	}
+	refreshSwapFrame(ctx,col,hint);
 }
 
 /* Calls the two low level functions refreshSingleLine() or
  * refreshMultiLine() according to the selected mode. */
 static void refreshLine(struct clirState *cs) {
-	if (mlmode)
+	struct clirContext *ctx = cs->ctx;
+	long long start;
+
+	if (ctx->refresh_defer) {
+		ctx->refresh_pending = 1;
+		return;
+	}
+	ctx->refresh_pending = 0;
+	start = statsClock(ctx);
+	if (ctx->mlmode) {
 		refreshMultiLine(cs);
+		STATS_ADD(ctx,refresh_multi,1);
+	} else {
+		refreshSingleLine(cs);
+		STATS_ADD(ctx,refresh_single,1);
+	}
+	STATS_ADD(ctx,refresh_ns,statsClock(ctx)-start);
+}
+
+/* The edited line is kept in a gap buffer: the text before 'gap_pos' is
+ * at the start of 'buf', the text after it at the end, and the free space
+ * is the gap in between. Edits first move the gap where they happen, so
+ * typing, or deleting, at the same place costs the same whatever the
+ * length of the line, and only moving to another place moves the text in
+ * between. editFlat() moves the gap at the end, where the text makes a
+ * string again, when it is needed as one: for the completion, the history
+ * and the accepted line. */
+
+/* Return the address of the byte at position 'i' of the line. The byte
+ * at the end of the line is always a nulterm. */
+static char *editPtr(struct clirState *cs, size_t i) {
+	return i < cs->gap_pos ? cs->buf+i : cs->buf+cs->buflen-cs->len+i;
+}
+
+/* The line also has an index of the columns its bytes take, in the same
+ * layout as the gap buffer: before the gap the slot of byte 'i' holds the
+ * columns of the bytes from the start of the line to 'i' included, after
+ * the gap those from 'i' to the end. So the column of any position is read
+ * in one or two slots, and an edit, or a move of the gap, only updates the
+ * slots of the bytes it touches, and of the few around them whose UTF-8
+ * sequences it may complete or break. */
+
+/* Return the index slot of the byte at position 'i' of the line. */
+static unsigned int *editSlot(struct clirState *cs, size_t i) {
+	return cs->ctx->edit_cols+(i < cs->gap_pos ? i : cs->buflen-cs->len+i);
+}
+
+/* Return the width of the whole line. */
+static size_t editWidth(struct clirState *cs) {
+	return (cs->gap_pos ? *editSlot(cs,cs->gap_pos-1) : 0)+
+		(cs->gap_pos < cs->len ? *editSlot(cs,cs->gap_pos) : 0);
+}
+
+/* Return the column of position 'pos' of the line, from its start. */
+static size_t editCol(struct clirState *cs, size_t pos) {
+	if (pos <= cs->gap_pos) return pos ? *editSlot(cs,pos-1) : 0;
+	return editWidth(cs)-(pos < cs->len ? *editSlot(cs,pos) : 0);
+}
+
+/* Decode the code point at position 'i' of the line into '*cp'. Returns
+ * the length of its sequence, 1 for a byte that is not part of a valid
+ * one, that is taken as the code point of the same value, or 0 for a byte
+ * inside a valid sequence. */
+static int editDecode(struct clirState *cs, size_t i, unsigned int *cp) {
+	unsigned char s[4], c = *editPtr(cs,i);
+	size_t j, n;
+	int len;
+
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	}
+	if ((c & 0xC0) == 0x80) {
+		for (j = 1; j <= 3 && j <= i; j++) {
+			if ((*editPtr(cs,i-j) & 0xC0) == 0x80) continue;
+			if (editDecode(cs,i-j,cp) > (int)j) return 0;
+			break;
+		}
+		*cp = c;
+		return 1;
+	}
+	n = cs->len-i < 4 ? cs->len-i : 4;
+	for (j = 0; j < n; j++) s[j] = *editPtr(cs,i+j);
+	if ((len = utf8Decode(s,n,cp)) == 0) {
+		*cp = c;
+		len = 1;
+	}
+	return len;
+}
+
+/* Return the columns taken by the byte at position 'i' of the line. */
+static unsigned int editByteWidth(struct clirState *cs, size_t i) {
+	unsigned int cp;
+
+	return editDecode(cs,i,&cp) ? charWidth(cp) : 0;
+}
+
+/* Tell whether a grapheme cluster starts at position 'pos' of the line. */
+static int editBoundary(struct clirState *cs, size_t pos) {
+	unsigned int cp;
+
+	if (pos == 0 || pos >= cs->len) return 1;
+	if (editDecode(cs,pos,&cp) == 0 || charExtends(cp)) return 0;
+	return pos < 3 || editDecode(cs,pos-3,&cp) != 3 || cp != 0x200D;
+}
+
+/* Return the position of the grapheme cluster after the one at 'pos', or
+ * of the one before it, that must exist. */
+static size_t editNext(struct clirState *cs, size_t pos) {
+	while (++pos < cs->len && !editBoundary(cs,pos));
+	return pos;
+}
+
+static size_t editPrev(struct clirState *cs, size_t pos) {
+	while (--pos > 0 && !editBoundary(cs,pos));
+	return pos;
+}
+
+/* Return the first position of the line at or after the column 'col', or
+ * with 'before' set the last one at or before it, that is not inside a
+ * grapheme cluster. The columns grow with the positions, so it is found
+ * by a binary search. */
+static size_t editColPos(struct clirState *cs, size_t col, int before) {
+	size_t lo = 0, hi = cs->len, target = before ? col+1 : col;
+
+	while (lo < hi) {
+		size_t mid = lo+(hi-lo)/2;
+
+		if (editCol(cs,mid) < target) lo = mid+1;
+		else hi = mid;
+	}
+	if (before) return editCol(cs,lo) > col ? editPrev(cs,lo) : lo;
+	while (lo < cs->len && !editBoundary(cs,lo)) lo++;
+	return lo;
+}
+
+/* Reverse the 'len' bytes at 's'. */
+static void editReverse(char *s, size_t len) {
+	char *e = s+len, aux;
+
+	while (s < e && s < --e) {
+		aux = *s;
+		*s++ = *e;
+		*e = aux;
+	}
+}
+
+/* Update the index after the bytes from 'from' to the gap changed: their
+ * slots, and those of the bytes around whose width may have changed. */
+static void editIndexFix(struct clirState *cs, size_t from) {
+	size_t j, end = cs->len-cs->gap_pos > 3 ? cs->gap_pos+3 : cs->len;
+	unsigned int cols, *head = cs->ctx->edit_cols;
+
+	from = from > 3 ? from-3 : 0;
+	cols = from ? head[from-1] : 0;
+	for (j = from; j < cs->gap_pos; j++) {
+		/* ASCII, that most of the bytes pasted are, takes one column. */
+		cols += (unsigned char)cs->buf[j] < 0x80 ? 1 : editByteWidth(cs,j);
+		head[j] = cols;
+	}
+	cols = end < cs->len ? *editSlot(cs,end) : 0;
+	for (j = end; j-- > cs->gap_pos;)
+		*editSlot(cs,j) = cols += editByteWidth(cs,j);
+}
+
+/* Make room in the index of the context for a buffer of 'buflen' bytes.
+ * Returns 0 on success, -1 on out of memory. */
+static int editIndexReserve(struct clirContext *ctx, size_t buflen) {
+	unsigned int *cols;
+
+	if (buflen+1 <= ctx->edit_cols_cap) return 0;
+	if ((cols = realloc(ctx->edit_cols,(buflen+1)*sizeof(*cols))) == NULL)
+		return -1;
+	ctx->edit_cols = cols;
+	ctx->edit_cols_cap = buflen+1;
+	return 0;
+}
+
+/* Move the gap at position 'to' of the line. The width of each byte moved
+ * is the difference between its slot and the one next to it. */
+static void editGapMove(struct clirState *cs, size_t to) {
+	char *tail = cs->buf+cs->buflen-cs->len;
+	unsigned int *head = cs->ctx->edit_cols, *after = head+cs->buflen-cs->len;
+	size_t j;
+
+	if (to < cs->gap_pos) {
+		memmove(tail+to,cs->buf+to,cs->gap_pos-to);
+		for (j = cs->gap_pos; j-- > to;)
+			after[j] = (j+1 < cs->len ? after[j+1] : 0)+
+				head[j]-(j ? head[j-1] : 0);
+	} else if (to > cs->gap_pos) {
+		memmove(cs->buf+cs->gap_pos,tail+cs->gap_pos,to-cs->gap_pos);
+		for (j = cs->gap_pos; j < to; j++)
+			head[j] = (j ? head[j-1] : 0)+
+				after[j]-(j+1 < cs->len ? after[j+1] : 0);
+	}
+	cs->gap_pos = to;
+}
+
+/* Make the line a nul terminated string at the start of 'buf', and
+ * return it. */
+static char *editFlat(struct clirState *cs) {
+	editGapMove(cs,cs->len);
+	cs->buf[cs->len] = '\0';
+	return cs->buf;
+}
+
+/* Append the 'len' bytes of the line from position 'from' to 'ab'. */
+static void editAppend(struct clirState *cs, struct abuf *ab, size_t from, size_t len) {
+	if (from < cs->gap_pos) {
+		size_t n = cs->gap_pos-from < len ? cs->gap_pos-from : len;
+
+		abAppend(ab,cs->buf+from,n);
+		from += n;
+		len -= n;
+	}
+	if (len) abAppend(ab,editPtr(cs,from),len);
+}
+
+/* Replace the line with the 'len' bytes of 'line', with the cursor at the
+ * end. */
+static void editSet(struct clirState *cs, const char *line, size_t len) {
+	memcpy(cs->buf,line,len);
+	cs->buf[len] = '\0';
+	cs->len = cs->pos = cs->gap_pos = len;
+	editIndexFix(cs,0);
+}
+
+/* Make sure the buffer holds 'len' bytes plus the nulterm, doubling the
+ * size of a growable buffer until they fit, and moving the text after the
+ * gap to its new end. Returns 0 on success, -1 if the buffer is fixed and
+ * too small or out of memory. */
+static int clirEditReserve(struct clirState *cs, size_t len) {
+	size_t cap, tail = cs->len-cs->gap_pos;
+	unsigned int *cols;
+	char *buf;
+
+	if (len <= cs->buflen) return 0;
+	if (!cs->growable) return -1;
+	cap = (cs->buflen+1)*2;
+	while (cap < len+1) cap *= 2;
+	if (editIndexReserve(cs->ctx,cap-1) == -1) return -1;
+	if ((buf = realloc(cs->buf,cap)) == NULL) return -1;
+	memmove(buf+cap-1-tail,buf+cs->buflen-tail,tail+1);
+	cols = cs->ctx->edit_cols;
+	memmove(cols+cap-1-tail,cols+cs->buflen-tail,tail*sizeof(*cols));
+	cs->buf = buf;
+	cs->buflen = cap-1;
+	return 0;
+}
+
+/* Insert the 'len' bytes of 's' at the cursor, that must fit. */
+static void editInsert(struct clirState *cs, const char *s, size_t len) {
+	editGapMove(cs,cs->pos);
+	memcpy(cs->buf+cs->pos,s,len);
+	cs->pos += len;
+	cs->len += len;
+	cs->gap_pos = cs->pos;
+	if (cs->gap_pos == cs->len) cs->buf[cs->len] = '\0';
+	editIndexFix(cs,cs->pos-len);
+}
+
+/* Delete the 'len' bytes before the cursor, if 'before' is true, or the
+ * ones after it. */
+static void editErase(struct clirState *cs, size_t len, int before) {
+	editGapMove(cs,cs->pos);
+	if (before) {
+		cs->pos -= len;
+		cs->gap_pos = cs->pos;
+	}
+	cs->len -= len;
+	if (cs->gap_pos == cs->len) cs->buf[cs->len] = '\0';
+	editIndexFix(cs,cs->gap_pos);
+}
+
+/* Tell whether, after the character 'c' was typed at the end of the line
+ * in single line mode, echoing it is all the screen needs: 'c' and the
+ * rest of the line keep the default style, and no suggestion was shown
+ * and none is now, or 'c' was the next byte of the suggestion shown, that
+ * is still the same. The cursor was at the end of the whole line, so the
+ * characters after it fit in what is left of the row. */
+static int refreshEchoes(struct clirState *cs, char c) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *frame = &ctx->refresh_frame;
+	const unsigned char *styles = highlightUpdate(cs);
+	size_t hlen = 0, room = cs->cols-ctx->refresh_frame_col-1, shown, hw;
+	const char *suggestion = suggestFind(cs,&hlen);
+
+	if (!ctx->refresh_frame_valid || frame->len < cs->plen+cs->len-1)
+		return 0;
+	if (styles && (styles[cs->len-1] ||
+		memcmp(ctx->refresh_frame_style.b+cs->plen,styles,cs->len-1) != 0))
+		return 0;
+	if (suggestion) hlen = strFit(suggestion,hlen,room,&hw);
+	if (ctx->refresh_frame_hint == frame->len) return hlen == 0;
+	shown = frame->len-ctx->refresh_frame_hint-1;
+	return frame->b[ctx->refresh_frame_hint] == c && shown == hlen &&
+		memcmp(frame->b+ctx->refresh_frame_hint+1,suggestion,hlen) == 0;
+}
+
+/* Insert the character 'c' at cursor current position.
+ *
+ * On error writing to the terminal -1 is returned, otherwise 0. */
+int clirEditInsert(struct clirState *cs, int c) {
+	struct clirContext *ctx = cs->ctx;
+	char ch = c;
+
+	if (clirEditReserve(cs,cs->len+1) == 0) {
+		if (cs->len == cs->pos) {
+			editInsert(cs,&ch,1);
+			if (!ctx->mlmode && (unsigned char)ch < 0x80 &&
+				ctx->refresh_frame_col+1 < cs->cols &&
+				!ctx->refresh_defer && !ctx->refresh_pending &&
+				refreshEchoes(cs,ch)) {
+				/* Avoid a full update of the line in the
+				 * trivial case. */
+				if (termWrite(ctx,cs->ofd,&ch,1) == -1) return -1;
+				STATS_ADD(ctx,refresh_append,1);
+				if (ctx->refresh_frame_hint == ctx->refresh_frame.len) {
+					abAppend(&ctx->refresh_frame,&ch,1);
+					abAppend(&ctx->refresh_frame_style,"",1);
+					abAppend(&ctx->refresh_frame_width,"\1",1);
+					ctx->refresh_frame_cells++;
+				} else {
+					ctx->refresh_frame_style.b[ctx->refresh_frame_hint] = 0;
+				}
+				ctx->refresh_frame_hint++;
+				ctx->refresh_frame_col++;
+			} else {
+				refreshLine(cs);
+			}
+		} else {
+			editInsert(cs,&ch,1);
+			refreshLine(cs);
+		}
+	}
+	return 0;
+}
+
+/* Insert the 'len' bytes of 's' at cursor current position. Bytes that
+ * don't fit in the buffer are dropped. */
+static void clirEditInsertLen(struct clirState *cs, const char *s, size_t len) {
+	if (clirEditReserve(cs,cs->len+len) == -1) len = cs->buflen-cs->len;
+	if (len == 0) return;
+	editInsert(cs,s,len);
+	refreshLine(cs);
+}
+
+/* Handle a bracketed paste, after the ESC [ 200 ~ start sequence was read:
+ * everything up to the ESC [ 201 ~ end sequence goes straight into the
+ * buffer, in runs as long as the input read, without key bindings or
+ * completion. Control characters, that can't be shown on the prompt line,
+ * become spaces, except carriage returns that are dropped so that CR LF
+ * line endings turn into a single space.
+ *
+ * Only the input already read is used, a paste may span many calls. The
+ * function returns 1 when the end sequence was found, 0 when it needs more
+ * input. */
+static int clirEditPaste(struct clirState *cs) {
+	static const char end[] = "\x1b[201~";
+	struct clirContext *ctx = cs->ctx;
+
+	while (inputPending(ctx)) {
+		char *p, *esc;
+		size_t len, j, k;
+
+		p = ctx->input_buf+ctx->input_pos;
+		len = inputPending(ctx);
+		if ((esc = memchr(p,27,len)) != NULL) len = esc-p;
+		for (j = k = 0; j < len; j++) {
+			if (p[j] == '\r') continue;
+			p[k++] = ((unsigned char)p[j] < 32 || p[j] == 127) ? ' ' : p[j];
+		}
+		clirEditInsertLen(cs,p,k);
+		ctx->input_pos += len;
+		if (esc == NULL) break;
+		/* Wait for the rest of an end sequence split between reads. */
+		if (inputPending(ctx) < 6 &&
+			memcmp(ctx->input_buf+ctx->input_pos,end,inputPending(ctx)) == 0) break;
+		if (inputPending(ctx) >= 6 &&
+			memcmp(ctx->input_buf+ctx->input_pos,end,6) == 0)
+		{
+			ctx->input_pos += 6;
+			cs->pasting = 0;
+			return 1;
+		}
+		ctx->input_pos++; /* Drop a stray ESC. */
+	}
+	return 0;
+}
+
+/* Move cursor on the left, over a whole grapheme cluster. */
+void clirEditMoveLeft(struct clirState *cs) {
+	if (cs->pos > 0) {
+		cs->pos = editPrev(cs,cs->pos);
+		refreshLine(cs);
+	}
+}
+
+/* Move cursor on the right, or at the end of the line accept the
+ * suggestion. */
+void clirEditMoveRight(struct clirState *cs) {
+	const char *suggestion;
+	size_t hlen;
+
+	if (cs->pos != cs->len) {
+		cs->pos = editNext(cs,cs->pos);
+		refreshLine(cs);
+	} else if ((suggestion = suggestFind(cs,&hlen)) != NULL) {
+		clirEditInsertLen(cs,suggestion,hlen);
+	}
+}
+
+/* Substitute the currently edited line with the next or previous history
+ * entry as specified by 'dir'.
+ *
+ * Index 0 is the line being typed, index N the N-th newest history entry.
+ * The history itself is never modified: what the user typed over an entry
+ * is kept in the edit scratch buffer until the line is accepted, so moving
+ * around does not allocate anything. */
+#define LINENOISE_HISTORY_NEXT 0
+#define LINENOISE_HISTORY_PREV 1
+void clirEditHistoryNext(struct clirState *cs, int dir) {
+	struct clirContext *ctx = cs->ctx;
+	const char *line;
+	size_t len;
+	int index;
+
+	if (ctx->history_len > 0) {
+		/* Remember the edited line before to overwrite it with the
+		 * next one. Unmodified entries are not copied. */
+		line = historyEditGet(ctx,cs->history_index);
+		if (line == NULL && cs->history_index > 0) {
+			struct historyEntry *e = historySlot(ctx,cs->history_index-1);
+			line = ctx->history_text+e->off;
+		}
+		editFlat(cs);
+		if (line == NULL || strcmp(line,cs->buf))
+			historyEditSet(ctx,cs->history_index,cs->buf);
+		/* Show the new entry, skipping the ones erased as duplicates. */
+		index = cs->history_index;
+		do {
+			index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
+		} while (index > 0 && index <= ctx->history_len &&
+				 historySlot(ctx,index-1)->off == LINENOISE_HISTORY_DEAD);
+		if (index < 0) {
+			cs->history_index = 0;
+			return;
+		} else if (index > ctx->history_len) {
+			return;
+		}
+		cs->history_index = index;
+		line = historyEditGet(ctx,cs->history_index);
+		if (line) {
+			len = strlen(line);
+		} else {
+			struct historyEntry *e = historySlot(ctx,cs->history_index-1);
+			line = ctx->history_text+e->off;
+			len = e->len;
+		}
+		cs->len = cs->gap_pos = 0;
+		if (clirEditReserve(cs,len) == -1) len = cs->buflen;
+		editSet(cs,line,len);
+		refreshLine(cs);
+	}
+}
+
+/* Show the search prompt and the current match of the incremental
+ * history search. */
+static void historySearchRefresh(struct clirState *cs) {
+	snprintf(cs->searchprompt,sizeof(cs->searchprompt),
+		"(%sreverse-%s-search)`%s': ",
+		cs->searchfailed ? "failed " : "",
+		cs->ctx->fuzzy & LINENOISE_FUZZY_HISTORY ? "fuzzy" : "i",
+		cs->search);
+	cs->prompt = cs->searchprompt;
+	refreshLine(cs);
+}
+
+/* Load the history entry 'seq' matched by the search in the buffer, with
+ * the cursor at 'pos'. */
+static void historySearchLoad(struct clirState *cs, long seq, size_t pos) {
+	struct clirContext *ctx = cs->ctx;
+	const char *line;
+	size_t len;
+
+	cs->searchfailed = 0;
+	cs->searchseq = seq;
+	cs->history_index = ctx->history_seq - seq;
+	line = ctx->history_text + historySlot(ctx,cs->history_index-1)->off;
+	len = strlen(line);
+	cs->len = cs->gap_pos = 0;
+	if (clirEditReserve(cs,len) == -1) len = cs->buflen;
+	editSet(cs,line,len);
+	cs->pos = pos < len ? pos : len;
+}
+
+/* Search the history for the query, starting from the entries older than
+ * the sequence number 'before', and load the match in the buffer with the
+ * cursor on the matching text. */
+static void historySearchUpdate(struct clirState *cs, unsigned int before) {
+	struct clirContext *ctx = cs->ctx;
+	long seq = historySearch(ctx,cs->search,cs->searchlen,before);
+	const char *line, *match;
+
+	if (seq == -1) {
+		cs->searchfailed = 1;
+		return;
+	}
+	line = ctx->history_text + historySeqSlot(ctx,seq)->off;
+	match = strstr(line,cs->search);
+	historySearchLoad(cs,seq,match-line);
+}
+
+/* Search the history for the best fuzzy match of the query, or with
+ * 'next' for the one after the current match, see historyFuzzySearch(),
+ * and load it in the buffer with the cursor on the start of the match. */
+static void historyFuzzyUpdate(struct clirState *cs, int next) {
+	struct clirContext *ctx = cs->ctx;
+	int fold = fuzzyFold(cs->search,cs->searchlen);
+	long long below = LLONG_MAX, key;
+	struct historyEntry *e;
+	size_t start;
+
+	if (next) {
+		if (cs->searchseq == -1) return;
+		e = historySeqSlot(ctx,cs->searchseq);
+		below = (long long)fuzzyScore(cs->search,cs->searchlen,
+			ctx->history_text+e->off,e->len,fold,&start) << 32 | cs->searchseq;
+	}
+	key = historyFuzzySearch(ctx,cs->search,cs->searchlen,below);
+	if (key == -1) {
+		cs->searchfailed = 1;
+		return;
+	}
+	e = historySeqSlot(ctx,(unsigned int)key);
+	fuzzyScore(cs->search,cs->searchlen,ctx->history_text+e->off,e->len,
+		fold,&start);
+	historySearchLoad(cs,(unsigned int)key,start);
+}
+
+/* Search the history for the query, from the current match when 'next',
+ * or else from the newest entry the longer query may still match. */
+static void historySearchFind(struct clirState *cs, int next) {
+	struct clirContext *ctx = cs->ctx;
+
+	if (ctx->fuzzy & LINENOISE_FUZZY_HISTORY)
+		historyFuzzyUpdate(cs,next);
+	else if (next)
+		historySearchUpdate(cs,cs->searchseq);
 	else
-		refreshSingleLine(cs);
+		historySearchUpdate(cs,cs->searchseq == -1 ? ctx->history_seq :
+			(unsigned int)cs->searchseq+1);
+}
+
+/* Enter the incremental history search mode (ctrl-r). The line being
+ * edited is saved so that the search can be cancelled. */
+void clirEditHistorySearch(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	historyEditSet(ctx,cs->history_index,editFlat(cs));
+	cs->searchindex = cs->history_index;
+	cs->searching = 1;
+	cs->searchfailed = 0;
+	cs->searchseq = -1;
+	cs->searchlen = 0;
+	cs->search[0] = '\0';
+	cs->origprompt = cs->prompt;
+	historySearchRefresh(cs);
+}
+
+/* Leave the search mode, keeping the match in the buffer unless 'cancel'
+ * is true, in which case the line edited before the search is restored. */
+static void historySearchStop(struct clirState *cs, int cancel) {
+	struct clirContext *ctx = cs->ctx;
+
+	cs->searching = 0;
+	cs->prompt = cs->origprompt;
+	if (cancel) {
+		const char *line = historyEditGet(ctx,cs->searchindex);
+		size_t len = line ? strlen(line) : 0;
+
+		cs->history_index = cs->searchindex;
+		editSet(cs,line ? line : "",len);
+	}
+	refreshLine(cs);
+}
+
+/* Handle the key 'c' while in search mode. Returns 1 if the key was
+ * consumed, or 0 if the search was terminated and the key should get its
+ * usual meaning. */
+static int historySearchKey(struct clirState *cs, int c) {
+	switch(c) {
+		case 18: /* ctrl-r, next older match */
+			if (cs->searchlen && cs->searchseq != -1)
+				historySearchFind(cs,1);
+			break;
+		case 7: /* ctrl-g, cancel the search */
+			historySearchStop(cs,1);
+			return 1;
+		case 127: /* backspace */
+		case 8:   /* ctrl-h */
+			if (cs->searchlen == 0) break;
+			/* Drop the whole last character of the query. */
+			while (cs->searchlen &&
+				((unsigned char)cs->search[--cs->searchlen] & 0xC0) == 0x80);
+			cs->search[cs->searchlen] = '\0';
+			cs->searchseq = -1;
+			if (cs->searchlen) historySearchFind(cs,0);
+			else cs->searchfailed = 0;
+			break;
+		default:
+			if ((unsigned char)c < 32 || cs->searchlen == LINENOISE_SEARCH_MAX_LEN) {
+				historySearchStop(cs,c == 3);
+				return 0;
+			}
+			cs->search[cs->searchlen++] = c;
+			cs->search[cs->searchlen] = '\0';
+			/* The current match may still match the longer query. */
+			historySearchFind(cs,0);
+			break;
+	}
+	historySearchRefresh(cs);
+	return 1;
+}
+
+/* Delete the character at the right of the cursor without altering the cursor
+ * position. Basically this is what happens with the "Delete" keyboard key. */
+void clirEditDelete(struct clirState *cs) {
+	if (cs->len > 0 && cs->pos < cs->len) {
+		editErase(cs,editNext(cs,cs->pos)-cs->pos,0);
+		refreshLine(cs);
+	}
+}
+
+/* Backspace implementation. */
+void clirEditBackspace(struct clirState *cs) {
+	if (cs->pos > 0 && cs->len > 0) {
+		editErase(cs,cs->pos-editPrev(cs,cs->pos),1);
+		refreshLine(cs);
+	}
+}
+
+/* Delete the previosu word, maintaining the cursor at the start of the
+ * current word. */
+void clirEditDeletePrevWord(struct clirState *cs) {
+	size_t start = cs->pos;
+
+	while (start > 0 && *editPtr(cs,start-1) == ' ')
+		start--;
+	while (start > 0 && *editPtr(cs,start-1) != ' ')
+		start--;
+	editErase(cs,cs->pos-start,1);
+	refreshLine(cs);
+}
+
+/* Returned by clirEditFeed() while the user is still editing the line. */
+char *clirEditMore = "If you see this, you are misusing the API: when "
+					 "clirEditFeed() is called, if it returns clirEditMore "
+					 "the user is yet editing the line.";
+
+/* Start the editing of a line on the terminal of 'ctx', as part of the non
+ * blocking API: the state in 'cs' is set up, the terminal is put in raw
+ * mode and the prompt is shown. The edited line goes into 'buf', of
+ * 'buflen' bytes. When 'buf' is NULL the line goes into a buffer allocated
+ * by the library, of 'buflen' bytes or a default size when 0, that grows
+ * as needed and is then returned by clirEditFeed() without a copy.
+ * An input descriptor that is not a tty, like a socket, is
+ * expected to be a remote terminal that already sends every key as typed.
+ *
+ * After this, clirEditFeed() is called every time the input descriptor is
+ * readable, until it returns something else than clirEditMore, then
+ * clirEditStop() restores the terminal. Output meanwhile must be
+ * surrounded by clirHide() and clirShow(), or go through clirPrintAbove().
+ *
+ * Returns 0 on success, -1 on error. */
+int clirCtxEditStart(struct clirContext *ctx, struct clirState *cs,
+	char *buf, size_t buflen, const char *prompt)
+{
+	cs->growable = buf == NULL;
+	if (cs->growable) {
+		if (buflen == 0) buflen = LINENOISE_LINE_INIT;
+		if ((buf = malloc(buflen)) == NULL) return -1;
+	} else if (buflen == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Populate the clir state that we pass to functions implementing
+	 * specific editing functionalities. */
+	cs->ctx = ctx;
+	cs->ifd = ctx->ifd;
+	cs->ofd = ctx->ofd;
+	cs->buf = buf;
+	cs->prompt = prompt;
+	cs->plen = strlen(prompt);
+	cs->oldpos = cs->pos = 0;
+	cs->len = cs->gap_pos = 0;
+	termProbe(ctx,cs->ofd);
+	cs->cols = ctx->term_cols;
+	cs->maxrows = 0;
+	cs->history_index = 0;
+	cs->word_pos = 0;
+	cs->searching = 0;
+	cs->pasting = 0;
+
+	/* Buffer starts empty. */
+	buf[0] = '\0';
+	cs->buflen = buflen-1; /* Make sure there is always space for the nulterm */
+	buf[cs->buflen] = '\0';
+	if (editIndexReserve(ctx,cs->buflen) == -1) goto fail;
+
+	/* Forget the edits done to the history while typing the last line,
+	 * and the completions of that line. */
+	historyShareSync(ctx);
+	historyEditReset(ctx);
+	completeCacheFree(ctx);
+	completeAsyncCancel(ctx);
+	completeListEnd(ctx);
+	ctx->refresh_defer = ctx->refresh_pending = 0;
+
+	if (isatty(cs->ifd) && enableRawMode(ctx,cs->ifd) == -1) goto fail;
+	printSetEditing(ctx,1);
+
+	/* Show the prompt, and ask the terminal to mark pasted text. */
+	ctx->refresh_ab.len = 0;
+	abAppend(&ctx->refresh_ab,"\x1b[?2004h",8);
+	abAppend(&ctx->refresh_ab,prompt,cs->plen);
+	if (abFlush(ctx,&ctx->refresh_ab,cs->ofd) == -1) {
+		disableRawMode(ctx,cs->ifd);
+		printSetEditing(ctx,0);
+		goto fail;
+	}
+	refreshSetFrame(ctx,prompt,cs->plen);
+	cs->oldpos = ctx->refresh_frame_col;
+	return 0;
+
+fail:
+	if (cs->growable) free(cs->buf);
+	cs->buf = NULL;
+	return -1;
+}
+
+/* Move the cursor to the start of the next word. */
+static void clirEditMoveWordRight(struct clirState *cs) {
+	while (cs->pos < cs->len &&
+		!isspace((unsigned char)*editPtr(cs,cs->pos))) {
+		cs->pos++;
+	}
+	while (cs->pos < cs->len &&
+		isspace((unsigned char)*editPtr(cs,cs->pos))) {
+		cs->pos++;
+	}
+	refreshLine(cs);
+}
+
+/* Move the cursor to the start of the previous word. */
+static void clirEditMoveWordLeft(struct clirState *cs) {
+	if (cs->pos > 0) { cs->pos--; }
+	while (cs->pos > 0 && isspace((unsigned char)*editPtr(cs,cs->pos))) {
+		cs->pos--;
+	}
+	while (cs->pos > 0 &&
+		!isspace((unsigned char)*editPtr(cs,cs->pos-1))) {
+		cs->pos--;
+	}
+	refreshLine(cs);
+}
+
+/* Process the keys already read from the terminal, doing the action each
+ * is bound to in the keymap.
+ *
+ * Returns 1 when the line is complete, -1 when editing must stop without
+ * a line, with errno set, and 0 when the buffered keys were used up or the
+ * last one is incomplete. */
+static int clirEditProcess(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	while(1) {
+		size_t len;
+		int key;
+		char c;
+
+		if (cs->pasting) {
+			if (!clirEditPaste(cs)) return 0;
+			continue;
+		}
+		if ((len = inputKey(ctx,&key)) == 0) {
+			/* Nothing buffered, or the start of an escape sequence, that is
+			 * an ESC alone once it waited long enough for the rest. */
+			if (inputPending(ctx) == 0 || !inputEscExpired(ctx)) return 0;
+			len = 1;
+			key = LINENOISE_KEY_ESC;
+		}
+		ctx->esc_deadline = 0;
+		c = ctx->input_buf[ctx->input_pos];
+		ctx->input_pos += len;
+
+		/* Keys that were already read are all processed before the line
+		 * is refreshed, so a paste is drawn once, not once per byte. */
+		ctx->refresh_defer = inputPending(ctx) > 0;
+
+		/* In search mode keys edit the query, until one is pressed that
+		 * terminates the search. */
+		if (cs->searching && historySearchKey(cs,c)) continue;
+
+		/* While candidates are listed keys answer the pager. */
+		if (ctx->comp_list_state) {
+			if (completeListKey(cs,c)) refreshLine(cs);
+			continue;
+		}
+
+		if (key == LINENOISE_KEY_PASTE) {
+			cs->pasting = 1;
+			continue;
+		}
+
+		switch(ctx->keymap_valid ? ctx->keymap[key] : default_keymap[key]) {
+			case LINENOISE_ACTION_ACCEPT:
+				return 1;
+			case LINENOISE_ACTION_CANCEL:
+				errno = EAGAIN;
+				return -1;
+			case LINENOISE_ACTION_BACKSPACE:
+				clirEditBackspace(cs);
+				break;
+			case LINENOISE_ACTION_DELETE:
+				clirEditDelete(cs);
+				break;
+			case LINENOISE_ACTION_EOF_OR_DELETE:
+				/* Remove char at right of cursor, or if the line is empty,
+				 * act as end-of-file. */
+				if (cs->len > 0) {
+					clirEditDelete(cs);
+				} else {
+					errno = ENOENT;
+					return -1;
+				}
+				break;
+			case LINENOISE_ACTION_TRANSPOSE:
+				/* Swap current character with previous. */
+				if (cs->pos > 0 && cs->pos < cs->len) {
+					size_t a = editPrev(cs,cs->pos), b = editNext(cs,cs->pos);
+
+					/* Rotate the two clusters before the gap, by reversing
+					 * each and then both. */
+					editGapMove(cs,b);
+					editReverse(cs->buf+a,cs->pos-a);
+					editReverse(cs->buf+cs->pos,b-cs->pos);
+					editReverse(cs->buf+a,b-a);
+					editIndexFix(cs,a);
+					cs->pos = b != cs->len ? b : a+b-cs->pos;
+					refreshLine(cs);
+				}
+				break;
+			case LINENOISE_ACTION_LEFT:
+				clirEditMoveLeft(cs);
+				break;
+			case LINENOISE_ACTION_RIGHT:
+				clirEditMoveRight(cs);
+				break;
+			case LINENOISE_ACTION_HOME:
+				if (cs->pos > 0) {
+					cs->pos = 0;
+					refreshLine(cs);
+				}
+				break;
+			case LINENOISE_ACTION_END:
+				if (cs->pos != cs->len) {
+					cs->pos = cs->len;
+					refreshLine(cs);
+				}
+				break;
+			case LINENOISE_ACTION_WORD_LEFT:
+				clirEditMoveWordLeft(cs);
+				break;
+			case LINENOISE_ACTION_WORD_RIGHT:
+				clirEditMoveWordRight(cs);
+				break;
+			case LINENOISE_ACTION_HISTORY_PREV:
+				clirEditHistoryNext(cs, LINENOISE_HISTORY_PREV);
+				break;
+			case LINENOISE_ACTION_HISTORY_NEXT:
+				clirEditHistoryNext(cs, LINENOISE_HISTORY_NEXT);
+				break;
+			case LINENOISE_ACTION_KILL_LINE:
+				editSet(cs,"",0);
+				refreshLine(cs);
+				break;
+			case LINENOISE_ACTION_KILL_TO_END:
+				editErase(cs,cs->len-cs->pos,0);
+				refreshLine(cs);
+				break;
+			case LINENOISE_ACTION_DELETE_PREV_WORD:
+				clirEditDeletePrevWord(cs);
+				break;
+			case LINENOISE_ACTION_CLEAR_SCREEN:
+				clirCtxClearScreen(ctx);
+				refreshFromHere(cs);
+				refreshLine(cs);
+				break;
+			case LINENOISE_ACTION_SEARCH:
+				clirEditHistorySearch(cs);
+				break;
+			case LINENOISE_ACTION_COMPLETE:
+				/* Only autocomplete when the dictionary or a callback is
+				 * set. The line is shown again when the candidates were
+				 * listed below it. */
+				if (ctx->dict_len || ctx->completionCallback != NULL ||
+					ctx->asyncCompletionCallback != NULL) {
+					//c = completeLine(cs);
+					int listed = ctx->dict_len ? completeDictionary(cs) :
+						completeWord(cs);
+
+					if (listed) refreshLine(cs);
+					break;
+				}
+				/* fall through */
+			case LINENOISE_ACTION_INSERT:
+				if (key > 255) break;
+				if (clirEditInsert(cs, c)) return -1;
+				if (c == ' ') cs->word_pos = cs->pos;
+				break;
+		}
+	}
+}
+
+/* Show the line again after the terminal was resized: it is erased as it
+ * was drawn for the old width, that the terminal may have wrapped again,
+ * then drawn for the new one. While candidates are listed only the width
+ * is updated, for the next page. */
+static void clirEditResize(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab;
+
+	termProbe(ctx,cs->ofd);
+	if (ctx->comp_list_state == 0) {
+		if (ctx->mlmode) {
+			int rpos = (cs->oldpos+cs->cols)/cs->cols;
+
+			if (rpos > 1) abPrintf(ab,"\x1b[%dA",rpos-1);
+			cs->oldpos = 0;
+			cs->maxrows = 0;
+		}
+		abAppend(ab,"\x1b[0G\x1b[0J",8);
+		refreshInvalidate(ctx);
+	}
+	cs->cols = ctx->term_cols;
+	if (ctx->comp_list_state == 0) refreshLine(cs);
+}
+
+/* Handle what may wake up clirEditFeed() besides keys: the wake pipe, a
+ * resize of the terminal, the asynchronous completion, and the messages
+ * of clirPrintAbove() that may now be written.
+ *
+ * Returns 1 if something was handled, 0 otherwise. */
+static int clirEditEvents(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	char drain[64];
+	int handled = 0;
+
+	if (ctx->wake_fd[0] != -1)
+		while (read(ctx->wake_fd[0],drain,sizeof(drain)) > 0) handled = 1;
+	if (ctx->rawmode && ctx->term_winch != atomic_load(&winch_count)) {
+		clirEditResize(cs);
+		handled = 1;
+	}
+	if (completeAsyncPoll(cs)) handled = 1;
+	if (ctx->print_deadline != 0 && clirNow() >= ctx->print_deadline)
+		handled = 1;
+	return handled;
+}
+
+/* Remove the suggestion from the screen, once the line is done. */
+static void suggestHide(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	if (!ctx->refresh_frame_valid ||
+		ctx->refresh_frame_hint == ctx->refresh_frame.len) return;
+	ctx->refresh_defer = 0;
+	ctx->suggest_hidden = 1;
+	refreshLine(cs);
+	ctx->suggest_hidden = 0;
+}
+
+/* This function is the core of the line editing capability of clir,
+ * as part of the non blocking API. It processes the keys read so far, and
+ * if none was ready it reads from the terminal with a single read(), so it
+ * never blocks when called because 'stdin_fd' is readable, or when it is
+ * non blocking.
+ *
+ * It returns clirEditMore while the user is still editing the line. When
+ * the user types enter the line is returned, as a string allocated with
+ * malloc() that the caller must free: a copy of the line, or the growable
+ * buffer itself, that is then no longer used by the state. On ctrl+c NULL
+ * is returned with errno set to EAGAIN, on ctrl+d with an empty line, or
+ * end of file, NULL is returned with errno set to ENOENT. On end of file or
+ * error after some text was typed, that text is returned as the line.
+ *
+ * Keys read past the end of a line are kept for the next one, and are only
+ * processed by the first call after clirEditStart(), that with a non
+ * blocking 'stdin_fd' can be made right away.
+ *
+ * It is also called when the descriptor returned by clirEditWakeFd() is
+ * readable, after a resize of the terminal or an asynchronous completion,
+ * or when the time returned by clirEditTimeout() elapsed: then it reads
+ * nothing. */
+char *clirEditFeed(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	size_t pos = ctx->input_pos;
+	int retval = clirEditProcess(cs);
+	int handled = retval == 0 && clirEditEvents(cs);
+
+	if (retval == 0 && ctx->input_pos == pos && !handled) {
+		int nread = inputFill(ctx,cs->ifd);
+
+		if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return clirEditMore;
+		if (nread <= 0) {
+			if (cs->len == 0) {
+				if (nread == 0) errno = ENOENT;
+				return NULL;
+			}
+			retval = 1;
+		} else {
+			retval = clirEditProcess(cs);
+		}
+	}
+	if (retval != 0) {
+		editFlat(cs);
+		suggestHide(cs);
+	}
+	if (retval == -1) return NULL;
+
+	ctx->refresh_defer = 0;
+	if (retval == 0) printFlush(cs);
+	if (ctx->refresh_pending) refreshLine(cs);
+	if (retval == 0) return clirEditMore;
+	if (cs->growable) {
+		char *line = cs->buf;
+
+		cs->buf = NULL;
+		cs->growable = 0;
+		return line;
+	}
+	return strdup(cs->buf);
+}
+
+/* End the editing of a line started by clirEditStart(): the terminal is
+ * put back in normal mode, with the cursor on a new line. A growable
+ * buffer that was not returned as the line is freed. */
+void clirEditStop(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	if (cs->growable) {
+		free(cs->buf);
+		cs->buf = NULL;
+		cs->growable = 0;
+	}
+	completeAsyncCancel(ctx);
+	ctx->refresh_defer = ctx->refresh_pending = 0;
+	if (termWrite(ctx,cs->ofd,"\x1b[?2004l",8) == -1) {
+		/* nothing to do, just to avoid warning. */
+	}
+	disableRawMode(ctx,cs->ifd);
+	if (termWrite(ctx,cs->ofd,"\n",1) == -1) {
+		/* nothing to do, just to avoid warning. */
+	}
+	printSetEditing(ctx,0);
+}
+
+/* Return the descriptor that an event loop must watch, besides the input
+ * one, to call clirEditFeed() when it is readable, or -1 if there is none:
+ * resizes of the terminal, completed asynchronous completions and the
+ * messages of clirPrintAbove() write it. */
+int clirEditWakeFd(struct clirState *cs) {
+	return cs->ctx->wake_fd[0];
+}
+
+/* Return in how many milliseconds clirEditFeed() must be called even with
+ * nothing to read, to end an asynchronous completion that timed out, to
+ * take an ESC that was not followed by a sequence as a key, or to write
+ * the messages held back by the print rate, or -1 if it needs not. */
+int clirEditTimeout(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	long long deadline = ctx->esc_deadline, left;
+
+	if (ctx->comp_req != NULL && ctx->comp_deadline != 0 &&
+		(deadline == 0 || ctx->comp_deadline < deadline))
+		deadline = ctx->comp_deadline;
+	if (ctx->print_deadline != 0 &&
+		(deadline == 0 || ctx->print_deadline < deadline))
+		deadline = ctx->print_deadline;
+	if (deadline == 0) return -1;
+	left = deadline-clirNow();
+	return left > 0 ? (int)left : 0;
+}
+
+/* Block until clirEditFeed() has something to do. Without a wake pipe
+ * or a timeout that is left to its read() of the terminal. */
+static void clirEditWait(struct clirState *cs) {
+	struct pollfd fds[2];
+	int nfds = clirEditWakeFd(cs) == -1 ? 1 : 2;
+
+	if (nfds == 1 && clirEditTimeout(cs) == -1) return;
+	fds[0].fd = cs->ifd;
+	fds[0].events = POLLIN;
+	fds[1].fd = clirEditWakeFd(cs);
+	fds[1].events = POLLIN;
+	while (poll(fds,nfds,clirEditTimeout(cs)) == -1 && errno == EINTR);
+}
+
+/* Append to the refresh buffer what erases the prompt and the edited
+ * line, leaving the cursor where the prompt started. */
+static void refreshErase(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab;
+
+	if (ctx->mlmode) {
+		int rpos = (cs->oldpos+cs->cols)/cs->cols;
+
+		if (rpos > 1) abPrintf(ab,"\x1b[%dA",rpos-1);
+		abAppend(ab,"\x1b[0G\x1b[0J",8);
+		cs->oldpos = 0;
+		cs->maxrows = 0;
+	} else {
+		abAppend(ab,"\x1b[0G\x1b[0K",8);
+	}
+	refreshInvalidate(ctx);
+}
+
+/* Remove the prompt and the edited line from the screen, so that the
+ * program can write something while the line is being edited. */
+void clirHide(struct clirState *cs) {
+	refreshErase(cs);
+	abFlush(cs->ctx,&cs->ctx->refresh_ab,cs->ofd);
+}
+
+/* Show again the prompt and the edited line hidden by clirHide(). */
+void clirShow(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+
+	refreshInvalidate(ctx);
+	refreshLine(cs);
+}
+
+/* Write the text queued by clirPrintAbove() above the line: the line is
+ * erased, the whole queue written, and the line drawn again, all with a
+ * single write(). This is done at most print_rate times a second, and not
+ * while candidates are listed under the line: the text then waits in the
+ * queue, and clirEditTimeout() tells when to call clirEditFeed() again.
+ * The queue is swapped with print_out, so the lock is only held for that,
+ * and no allocation is made once both are big enough. */
+static void printFlush(struct clirState *cs) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *ab = &ctx->refresh_ab;
+	struct abuf out;
+	long long now;
+	size_t from, j;
+
+	if (ctx->comp_list_state != 0 ||
+		!atomic_load_explicit(&ctx->print_pending,memory_order_acquire)) return;
+	pthread_mutex_lock(&ctx->print_lock);
+	if (ctx->print_queue.len == 0) {
+		pthread_mutex_unlock(&ctx->print_lock);
+		return;
+	}
+	now = clirNow();
+	if (ctx->print_rate && now < ctx->print_last+1000/ctx->print_rate) {
+		ctx->print_deadline = ctx->print_last+1000/ctx->print_rate;
+		pthread_mutex_unlock(&ctx->print_lock);
+		return;
+	}
+	out = ctx->print_queue;
+	ctx->print_queue = ctx->print_out;
+	ctx->print_queue.len = 0;
+	ctx->print_woken = 0;
+	atomic_store_explicit(&ctx->print_pending,0,memory_order_relaxed);
+	pthread_mutex_unlock(&ctx->print_lock);
+	ctx->print_out = out;
+	ctx->print_last = now;
+	ctx->print_deadline = 0;
+
+	/* Output post processing is off in raw mode: every newline of the
+	 * text, that always ends with one, is sent as CR LF. */
+	refreshErase(cs);
+	for (from = j = 0; j < out.len; j++) {
+		if (out.b[j] != '\n') continue;
+		abAppend(ab,out.b+from,j-from);
+		abAppend(ab,"\r\n",2);
+		from = j+1;
+	}
+	refreshLine(cs);
+}
+
+/* Like termWrite(), for the output of clirPrintAbove() written with
+ * print_lock held, from any thread: the calls go to the counters guarded
+ * by the lock. */
+static int printWrite(struct clirContext *ctx, const char *buf, size_t len) {
+	while (len) {
+		ssize_t nwritten = write(ctx->print_ofd,buf,len);
+
+		if (ctx->print_stats) ctx->print_writes++;
+		if (nwritten == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (ctx->print_stats) ctx->print_write_bytes += nwritten;
+		buf += nwritten;
+		len -= nwritten;
+	}
+	return 0;
+}
+
+/* Start or stop queuing the output of clirPrintAbove(), when a line edit
+ * starts or ends. What is still queued at the end is written after the
+ * line, the terminal being back in normal mode. The wake pipe is opened
+ * so that the editor notices the queued text in clirEditWait() even
+ * without raw mode. */
+static void printSetEditing(struct clirContext *ctx, int editing) {
+	struct abuf *q = &ctx->print_queue;
+	int wake = editing && wakeOpen(ctx) == 0 ? ctx->wake_fd[1] : -1;
+
+	pthread_mutex_lock(&ctx->print_lock);
+	ctx->print_editing = editing;
+	ctx->print_ofd = ctx->ofd;
+	ctx->print_wake = wake;
+	ctx->print_woken = 0;
+	if (!editing && q->len) {
+		if (printWrite(ctx,q->b,q->len) == -1) {
+			/* nothing to do, just to avoid warning. */
+		}
+		q->len = 0;
+		atomic_store_explicit(&ctx->print_pending,0,memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&ctx->print_lock);
+	ctx->print_deadline = 0;
+}
+
+/* Add 'len' bytes of 'text' to the queue, with a newline if they do not
+ * end with one, and wake up the editor if it was not yet. When no line is
+ * being edited the text is written right away instead.
+ * Returns 0 on success, -1 on error. */
+static int printQueue(struct clirContext *ctx, const char *text, size_t len) {
+	struct abuf *q = &ctx->print_queue;
+	int nl = len == 0 || text[len-1] != '\n';
+	int retval = 0;
+
+	pthread_mutex_lock(&ctx->print_lock);
+	if (!ctx->print_editing) {
+		if (printWrite(ctx,text,len) == -1 ||
+			(nl && printWrite(ctx,"\n",1) == -1)) retval = -1;
+	} else if (abResize(q,q->len+len+nl) == -1) {
+		retval = -1;
+	} else {
+		memcpy(q->b+q->len-len-nl,text,len);
+		if (nl) q->b[q->len-1] = '\n';
+		atomic_store_explicit(&ctx->print_pending,1,memory_order_release);
+		if (!ctx->print_woken && ctx->print_wake != -1 &&
+			write(ctx->print_wake,"",1) == -1) {
+			/* Full pipe, the editor is already woken up. */
+		}
+		ctx->print_woken = 1;
+	}
+	pthread_mutex_unlock(&ctx->print_lock);
+	return retval;
+}
+
+/* Format the message of clirPrintAbove() and queue it. Short messages are
+ * formatted on the stack. */
+static int printFormat(struct clirContext *ctx, const char *fmt, va_list ap) {
+	char buf[LINENOISE_PRINT_INLINE], *text = buf;
+	va_list aq;
+	int len, retval;
+
+	va_copy(aq,ap);
+	len = vsnprintf(buf,sizeof(buf),fmt,aq);
+	va_end(aq);
+	if (len < 0) return -1;
+	if ((size_t)len >= sizeof(buf)) {
+		if ((text = malloc((size_t)len+1)) == NULL) return -1;
+		vsnprintf(text,(size_t)len+1,fmt,ap);
+	}
+	retval = printQueue(ctx,text,len);
+	if (text != buf) free(text);
+	return retval;
+}
+
+/* Print the printf() style formatted message above the line being edited,
+ * as a line of its own: a newline is added if it does not end with one.
+ * Any thread can call it, at any rate. While a line is edited messages
+ * are queued, and clirEditFeed() writes all those queued so far at once,
+ * redrawing the line once, so that the output is bounded by the rate set
+ * with clirCtxSetPrintRate() rather than by the rate of the messages.
+ * Otherwise the message is written right away.
+ *
+ * Returns 0 on success, -1 on error. */
+int clirCtxPrintAbove(struct clirContext *ctx, const char *fmt, ...) {
+	va_list ap;
+	int retval;
+
+	va_start(ap,fmt);
+	retval = printFormat(ctx,fmt,ap);
+	va_end(ap);
+	return retval;
+}
+
+/* Redraw the line for the messages of clirPrintAbove() at most 'fps' times
+ * a second, or as soon as they come with 0. The default is
+ * LINENOISE_PRINT_RATE. */
+void clirCtxSetPrintRate(struct clirContext *ctx, int fps) {
+	ctx->print_rate = fps > 0 ? fps : 0;
+}
+
+/* Edit a line on the terminal of 'ctx', blocking until it is complete,
+ * into '*lineptr', a buffer of '*n' bytes allocated with malloc() or NULL,
+ * that is grown with realloc() as needed, like getline() does. A loop that
+ * reuses the buffer makes no allocations once it is big enough.
+ *
+ * Returns the length of the line, or -1 with errno set as clirEditFeed()
+ * does. The buffer is updated either way, the caller must free it. */
+ssize_t clirCtxGetline(struct clirContext *ctx, const char *prompt,
+	char **lineptr, size_t *n)
+{
+	struct clirState cs;
+	char *res;
+
+	if (clirCtxEditStart(ctx,&cs,*lineptr,*lineptr ? *n : 0,prompt) == -1)
+		return -1;
+	cs.growable = 1; /* Even a caller's buffer can be reallocated. */
+	while((res = clirEditFeed(&cs)) == clirEditMore) clirEditWait(&cs);
+	*lineptr = res ? res : cs.buf;
+	*n = cs.buflen+1;
+	cs.growable = 0; /* Keep the buffer, it belongs to the caller. */
+	clirEditStop(&cs);
+	return res ? (ssize_t)cs.len : -1;
+}
+
+/* Edit a line on the terminal of 'ctx', blocking until it is complete.
+ * The line is returned as clirEditFeed() does. */
+char *clirCtx(struct clirContext *ctx, const char *prompt) {
+	char *line = NULL;
+	size_t n = 0;
+
+	if (clirCtxGetline(ctx,prompt,&line,&n) == -1) {
+		free(line);
+		return NULL;
+	}
+	return line;
+}
+
+/* Like clir(), with the line in a buffer reused across calls, see
+ * clirCtxGetline(). The line is edited on the terminal of the default
+ * context, stdin and stdout unless clirEditStart() was given others. */
+ssize_t clirGetline(const char *prompt, char **lineptr, size_t *n) {
+	ssize_t len;
+
+	if (default_ctx.ifd_tty == -1)
+		default_ctx.ifd_tty = isatty(default_ctx.ifd);
+	if (default_ctx.ifd_tty && !isUnsupportedTerm(&default_ctx))
+		return clirCtxGetline(&default_ctx,prompt,lineptr,n);
+
+	if (isUnsupportedTerm(&default_ctx)) {
+		printf("%s",prompt);
+		fflush(stdout);
+	}
+	if ((len = getline(lineptr,n,stdin)) == -1) return -1;
+	while(len && ((*lineptr)[len-1] == '\n' || (*lineptr)[len-1] == '\r')) {
+		len--;
+		(*lineptr)[len] = '\0';
+	}
+	return len;
+}
+
+/* The high level function that is the main API of the clir library.
+ * This function checks if the terminal has basic capabilities, just checking
+ * for a blacklist of stupid terminals, and later either calls the line
+ * editing function or uses dummy getline() so that you will be able to type
+ * something even in the most desperate of the conditions.
+ *
+ * The line is returned in the buffer it was edited in, there is no limit
+ * to its length. */
+char *clir(const char *prompt) {
+	char *line = NULL;
+	size_t n = 0;
+
+	if (clirGetline(prompt,&line,&n) == -1) {
+		free(line);
+		return NULL;
+	}
+	return line;
+}
+
+/* Read the lines of 'fd', that is not expected to be a terminal, calling
+ * 'fn' for each with its text, its length and 'privdata'. The line ending,
+ * "\n" or "\r\n", is not included, and the text is null terminated. It
+ * points into the buffer of the reader, valid only until 'fn' returns, so
+ * that lines are not copied: they are handed out straight from the buffer
+ * of large read()s, that only grows for a line longer than it. The last
+ * line may lack its newline. Nothing is written and the terminal is not
+ * checked, neither is the history changed.
+ *
+ * Returns 0 at end of file, -1 with errno set on error, or as soon as 'fn'
+ * returns something other than 0, that value. */
+int clirReadLines(int fd, clirLineCallback *fn, void *privdata) {
+	size_t cap = LINENOISE_READ_CHUNK, start = 0, scan = 0, end = 0;
+	char *buf = malloc(cap+1), *nl;
+	int retval = 0;
+
+	if (buf == NULL) return -1;
+	while(1) {
+		ssize_t nread;
+
+		/* Hand out the whole lines buffered. */
+		while ((nl = memchr(buf+scan,'\n',end-scan)) != NULL) {
+			char *line = buf+start;
+			size_t len = nl-line;
+
+			if (len && line[len-1] == '\r') len--;
+			line[len] = '\0';
+			start = scan = nl-buf+1;
+			if ((retval = fn(line,len,privdata)) != 0) goto done;
+		}
+		scan = end;
+
+		/* Keep the start of the next line and read more after it, in a
+		 * bigger buffer if it already fills this one. */
+		if (start > 0) {
+			memmove(buf,buf+start,end-start);
+			scan = end -= start;
+			start = 0;
+		}
+		if (end == cap) {
+			char *newbuf = realloc(buf,cap*2+1);
+
+			if (newbuf == NULL) {
+				retval = -1;
+				goto done;
+			}
+			buf = newbuf;
+			cap *= 2;
+		}
+		do {
+			nread = read(fd,buf+end,cap-end);
+		} while (nread == -1 && errno == EINTR);
+		if (nread == -1) {
+			retval = -1;
+			goto done;
+		}
+		if (nread == 0) break;
+		end += nread;
+	}
+
+	/* The last line, without a newline. */
+	if (end > 0) {
+		if (buf[end-1] == '\r') end--;
+		buf[end] = '\0';
+		retval = fn(buf,end,privdata);
+	}
+
+done:
+	free(buf);
+	return retval;
+}
+
+/* ================================ History ================================= */
+
+/* The history is kept in a circular buffer of 'history_cap' slots: the
+ * oldest entry is at 'history_head' and the newest 'history_len-1' slots
+ * after it, wrapping around. Adding and evicting just move the indexes, so
+ * they cost O(1) no matter how long the history is.
+ *
+ * Slots don't own their text: it lives null terminated in the contiguous
+ * 'history_text' arena, and slots just store its offset and length. Space
+ * of evicted entries is reclaimed by compacting the arena once it is more
+ * than half unused, so the cost is amortized over the entries added. */
+
+/* Return the slot holding the entry 'index' positions back from the newest
+ * one, so that 0 is the latest entry and history_len-1 the oldest. */
+static struct historyEntry *historySlot(struct clirContext *ctx, int index) {
+	return ctx->history + (ctx->history_head + ctx->history_len - 1 - index) % ctx->history_cap;
+}
+
+/* Return the slot of the entry with sequence number 'seq'. Slots are
+ * numbered consecutively, the newest one being history_seq-1. */
+static struct historyEntry *historySeqSlot(struct clirContext *ctx, unsigned int seq) {
+	return historySlot(ctx,ctx->history_seq - 1 - seq);
+}
+
+/* Return the text of the entry 'index' positions back from the newest. */
+static const char *historyStr(struct clirContext *ctx, int index) {
+	return ctx->history_text + historySlot(ctx,index)->off;
+}
+
+/* Remove the oldest slot from the history. */
+static void historyPopOldest(struct clirContext *ctx) {
+	struct historyEntry *e = ctx->history + ctx->history_head;
+
+	if (ctx->history_len == 0) return;
+	if (e->off == LINENOISE_HISTORY_DEAD) {
+		ctx->history_dead--;
+	} else {
+		if (ctx->history_erasedups)
+			dedupRemove(ctx,ctx->history_seq - ctx->history_len,ctx->history_text+e->off,e->len);
+		ctx->history_text_free += e->len+1;
+	}
+	ctx->history_head = (ctx->history_head + 1) % ctx->history_cap;
+	ctx->history_len--;
+	if (ctx->history_unsaved > ctx->history_len) ctx->history_unsaved = ctx->history_len;
+}
+
+/* Remove the oldest entry from the history, together with the slots of
+ * erased entries older than it. */
+static void historyEvict(struct clirContext *ctx) {
+	while (ctx->history_len) {
+		int dead = ctx->history[ctx->history_head].off == LINENOISE_HISTORY_DEAD;
+
+		historyPopOldest(ctx);
+		if (!dead) {
+			STATS_ADD(ctx,history_evictions,1);
+			break;
+		}
+	}
+}
+
+/* Erase the entry 'index' positions back from the newest. Its slot stays
+ * there, so that sequence numbers don't change, until it gets evicted or
+ * the slots compacted by historyCompact(). */
+static void historyErase(struct clirContext *ctx, int index) {
+	struct historyEntry *e = historySlot(ctx,index);
+
+	ctx->history_text_free += e->len+1;
+	e->off = LINENOISE_HISTORY_DEAD;
+	ctx->history_dead++;
+}
+
+/* Move the entries into a new array of 'cap' slots, oldest first, so that
+ * the ring starts again from slot zero. The caller makes sure that 'cap' is
+ * at least history_len. Returns -1 on out of memory. */
+static int historyRealloc(struct clirContext *ctx, int cap) {
+	struct historyEntry *new = malloc(sizeof(*new)*cap);
+	int j;
+
+	if (new == NULL) return -1;
+	for (j = 0; j < ctx->history_len; j++)
+		new[j] = ctx->history[(ctx->history_head + j) % ctx->history_cap];
+	free(ctx->history);
+	ctx->history = new;
+	ctx->history_cap = cap;
+	ctx->history_head = 0;
+	return 0;
+}
+
+/* Drop the slots of the erased entries. This renumbers the entries, so the
+ * indexes referring to sequence numbers are rebuilt. It only happens once
+ * the erased slots are more than the live ones, or the ring is full, so the
+ * cost is amortized over the entries erased. */
+static void historyCompact(struct clirContext *ctx) {
+	int j, live = 0, unsaved = 0;
+
+	for (j = 0; j < ctx->history_len; j++) {
+		struct historyEntry *e = ctx->history + (ctx->history_head + j) % ctx->history_cap;
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		if (j >= ctx->history_len - ctx->history_unsaved) unsaved++;
+		ctx->history[(ctx->history_head + live++) % ctx->history_cap] = *e;
+	}
+	ctx->history_len = live;
+	ctx->history_dead = 0;
+	ctx->history_unsaved = unsaved;
+	searchIndexFree(ctx);
+	suggestIndexFree(ctx);
+	if (ctx->history_erasedups) dedupBuild(ctx);
+}
+
+/* Make room in the text arena for 'need' more bytes. If more than half of
+ * the arena is taken by evicted entries, the live ones are copied in a new
+ * arena instead of growing the old one. Returns -1 on out of memory. */
+static int historyTextReserve(struct clirContext *ctx, size_t need) {
+	size_t live = ctx->history_text_len - ctx->history_text_free, cap;
+	char *new;
+	int j;
+
+	if (ctx->history_text_len + need <= ctx->history_text_cap &&
+		ctx->history_text_free <= live) return 0;
+
+	cap = ctx->history_text_cap ? ctx->history_text_cap : LINENOISE_HISTORY_TEXT_MIN;
+	if (ctx->history_text_free > live) {
+		/* Compact: the new arena is sized for twice the live data. */
+		while (cap > LINENOISE_HISTORY_TEXT_MIN && cap/2 >= (live+need)*2)
+			cap /= 2;
+		while (cap < live+need) cap *= 2;
+		if ((new = malloc(cap)) == NULL) return -1;
+		ctx->history_text_len = 0;
+		for (j = ctx->history_len-1; j >= 0; j--) {
+			struct historyEntry *e = historySlot(ctx,j);
+
+			if (e->off == LINENOISE_HISTORY_DEAD) continue;
+			memcpy(new+ctx->history_text_len,ctx->history_text+e->off,e->len+1);
+			e->off = ctx->history_text_len;
+			ctx->history_text_len += e->len+1;
+		}
+		free(ctx->history_text);
+		ctx->history_text_free = 0;
+	} else {
+		while (cap < ctx->history_text_len+need) cap *= 2;
+		if ((new = realloc(ctx->history_text,cap)) == NULL) return -1;
+	}
+	ctx->history_text = new;
+	ctx->history_text_cap = cap;
+	return 0;
+}
+
+/* Forget all the edits the user did to the history entries. */
+static void historyEditReset(struct clirContext *ctx) {
+	ctx->history_edits_len = 0;
+	ctx->history_scratch_len = 0;
+}
+
+/* Return the edited text of the history entry 'index' (0 being the line
+ * being typed, see clirEditHistoryNext()), or NULL if it was not edited. */
+static const char *historyEditGet(struct clirContext *ctx, int index) {
+	int j;
+
+	for (j = 0; j < ctx->history_edits_len; j++) {
+		if (ctx->history_edits[j].index == index)
+			return ctx->history_scratch + ctx->history_edits[j].off;
+	}
+	return NULL;
+}
+
+/* Store 'line' as the edited text of the history entry 'index'. The
+ * scratch buffer only grows, and is reused for every line typed, so after
+ * the first few lines this does not allocate. Returns -1 on out of memory. */
+static int historyEditSet(struct clirContext *ctx, int index, const char *line) {
+	size_t len = strlen(line)+1;
+	int j;
+
+	if (ctx->history_scratch_len+len > ctx->history_scratch_cap) {
+		size_t cap = ctx->history_scratch_cap ? ctx->history_scratch_cap : 256;
+		char *new;
+
+		while (cap < ctx->history_scratch_len+len) cap *= 2;
+		if ((new = realloc(ctx->history_scratch,cap)) == NULL) return -1;
+		ctx->history_scratch = new;
+		ctx->history_scratch_cap = cap;
+	}
+	for (j = 0; j < ctx->history_edits_len; j++)
+		if (ctx->history_edits[j].index == index) break;
+	if (j == ctx->history_edits_cap) {
+		int cap = ctx->history_edits_cap ? ctx->history_edits_cap*2 : 8;
+		struct historyEdit *new = realloc(ctx->history_edits,sizeof(*new)*cap);
+
+		if (new == NULL) return -1;
+		ctx->history_edits = new;
+		ctx->history_edits_cap = cap;
+	}
+	if (j == ctx->history_edits_len) ctx->history_edits_len++;
+	ctx->history_edits[j].index = index;
+	ctx->history_edits[j].off = ctx->history_scratch_len;
+	memcpy(ctx->history_scratch+ctx->history_scratch_len,line,len);
+	ctx->history_scratch_len += len;
+	return 0;
+}
+
+/* Free the history, but does not reset it. Only used when we have to
+ * exit() to avoid memory leaks are reported by valgrind & co. */
+static void freeHistory(struct clirContext *ctx) {
+	historyShareClose(ctx);
+	searchIndexFree(ctx);
+	suggestIndexFree(ctx);
+	free(ctx->suggest_prefix.b);
+	free(ctx->dedup_table);
+	free(ctx->history);
+	free(ctx->history_text);
+	free(ctx->history_scratch);
+	free(ctx->history_edits);
+}
+
+/* Restore the terminal of 'ctx' and free everything it allocated. */
+static void clirContextRelease(struct clirContext *ctx) {
+	disableRawMode(ctx,ctx->ifd);
+	freeHistory(ctx);
+	freeDictionary(ctx);
+	completeCacheFree(ctx);
+	completeAsyncCancel(ctx);
+	completeListEnd(ctx);
+	if (ctx->wake_fd[0] != -1) {
+		close(ctx->wake_fd[0]);
+		close(ctx->wake_fd[1]);
+		ctx->wake_fd[0] = ctx->wake_fd[1] = -1;
+	}
+	free(ctx->comp_line.b);
+	free(ctx->refresh_ab.b);
+	free(ctx->refresh_frame.b);
+	free(ctx->refresh_next.b);
+	free(ctx->refresh_frame_style.b);
+	free(ctx->refresh_next_style.b);
+	free(ctx->refresh_frame_width.b);
+	free(ctx->refresh_next_width.b);
+	free(ctx->edit_cols);
+	free(ctx->highlight_text.b);
+	free(ctx->highlight_style.b);
+	free(ctx->print_out.b);
+	pthread_mutex_lock(&ctx->print_lock);
+	free(ctx->print_queue.b);
+	memset(&ctx->print_queue,0,sizeof(ctx->print_queue));
+	atomic_store_explicit(&ctx->print_pending,0,memory_order_relaxed);
+	pthread_mutex_unlock(&ctx->print_lock);
+}
+
+/* At exit we'll try to fix the terminals to the initial conditions: those
+ * of all the contexts still in raw mode, then the default context is
+ * released. Other contexts are freed by clirContextFree(). */
+static void clirAtExit(void) {
+	struct clirContext *ctx;
+
+	pthread_mutex_lock(&raw_lock);
+	for (ctx = raw_list; ctx; ctx = ctx->raw_next) {
+		tcsetattr(ctx->raw_fd,TCSAFLUSH,&ctx->orig_termios);
+		ctx->rawmode = 0;
+	}
+	raw_list = NULL;
+	pthread_mutex_unlock(&raw_lock);
+	clirContextRelease(&default_ctx);
+}
+
+/* Register clirAtExit(), once, the first time a terminal enters raw mode. */
+static void clirAtExitRegister(void) {
+	atexit(clirAtExit);
+}
+
+/* Create a context editing lines read from 'ifd' on the terminal written
+ * by 'ofd', with its own empty history and settings. Returns NULL when out
+ * of memory. */
+struct clirContext *clirContextNew(int ifd, int ofd) {
+	struct clirContext *ctx = calloc(1,sizeof(*ctx));
+
+	if (ctx == NULL) return NULL;
+	ctx->ifd = ifd;
+	ctx->ofd = ofd;
+	ctx->history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
+	ctx->wake_fd[0] = ctx->wake_fd[1] = -1;
+	ctx->comp_query_items = LINENOISE_COMPLETION_QUERY_ITEMS;
+	ctx->term_unsupported = -1;
+	ctx->ifd_tty = -1;
+	ctx->esc_timeout = LINENOISE_ESC_TIMEOUT;
+	ctx->history_share_fd = -1;
+	ctx->history_share_next.size = -1;
+	ctx->fuzzy_threads = 1;
+	pthread_mutex_init(&ctx->print_lock,NULL);
+	ctx->print_ofd = ofd;
+	ctx->print_wake = -1;
+	ctx->print_rate = LINENOISE_PRINT_RATE;
+	return ctx;
+}
+
+/* Restore the terminal of a context created by clirContextNew() and free
+ * it. The descriptors are not closed. */
+void clirContextFree(struct clirContext *ctx) {
+	if (ctx == NULL) return;
+	clirContextRelease(ctx);
+	pthread_mutex_destroy(&ctx->print_lock);
+	free(ctx);
+}
+
+/* Add the 'len' bytes long 'line' as the newest entry of the history,
+ * evicting the oldest entry when the history is full. The slot array grows
+ * geometrically up to history_max_len, so a big limit does not cost memory
+ * until it is used. The line does not need to be null terminated.
+ *
+ * When erasing duplicates, an older copy of the line is erased, so that
+ * the entry just moves to the newest position. */
+static int historyAddLen(struct clirContext *ctx, const char *line, size_t len) {
+	struct historyEntry *e;
+	unsigned int hash = 0;
+
+	if (ctx->history_max_len == 0) return 0;
+	if (ctx->history_len) {
+		e = historySlot(ctx,0);
+		if (e->len == len && !memcmp(ctx->history_text+e->off,line,len))
+			return 0;
+	}
+	if (ctx->history_erasedups) {
+		long seq;
+
+		hash = dedupHash(line,len);
+		if ((seq = dedupFind(ctx,line,len,hash)) != -1) {
+			dedupRemove(ctx,seq,line,len);
+			historyErase(ctx,ctx->history_seq-1-seq);
+		}
+	}
+	if (ctx->history_dead && (ctx->history_len == ctx->history_cap ||
+		ctx->history_dead > ctx->history_len-ctx->history_dead)) historyCompact(ctx);
+
+	if (ctx->history_len - ctx->history_dead >= ctx->history_max_len) {
+		historyEvict(ctx);
+	} else if (ctx->history_len == ctx->history_cap) {
+		int cap = ctx->history_cap ? ctx->history_cap*2 : 16;
+
+		if (cap > ctx->history_max_len) cap = ctx->history_max_len;
+		if (historyRealloc(ctx,cap) == -1) return 0;
+	}
+	if (historyTextReserve(ctx,len+1) == -1) return 0;
+	e = ctx->history + (ctx->history_head + ctx->history_len) % ctx->history_cap;
+	e->off = ctx->history_text_len;
+	e->len = len;
+	memcpy(ctx->history_text+e->off,line,len);
+	ctx->history_text[e->off+len] = '\0';
+	ctx->history_text_len += len+1;
+	ctx->history_len++;
+	ctx->history_unsaved++;
+	STATS_ADD(ctx,history_adds,1);
+	if (ctx->history_erasedups) dedupInsert(ctx,ctx->history_seq,hash);
+	searchIndexAdd(ctx,ctx->history_seq,ctx->history_text+e->off,len);
+	suggestIndexAdd(ctx,ctx->history_seq++,ctx->history_text+e->off,len);
+	return 1;
+}
+
+/* Add a new entry as the newest one of the history. */
+int clirCtxHistoryAdd(struct clirContext *ctx, const char *line) {
+	if (ctx->history_share_fd != -1)
+		return historyShareAdd(ctx,line,strlen(line));
+	return historyAddLen(ctx,line,strlen(line));
+}
+
+/* Set the maximum length for the history. This function can be called even
+ * if there is already some history, the function will make sure to retain
+ * just the latest 'len' elements if the new history length value is smaller
+ * than the amount of items already inside the history.
+ *
+ * Raising the limit is O(1) since the ring grows lazily. Lowering it only
+ * frees the dropped entries, and gives back the slot array when it is way
+ * bigger than needed. */
+int clirCtxHistorySetMaxLen(struct clirContext *ctx, int len) {
+	if (len < 1) return 0;
+	while (ctx->history_len - ctx->history_dead > len) historyEvict(ctx);
+	if (ctx->history_dead) historyCompact(ctx);
+	if (ctx->history && ctx->history_cap > len*4 && historyRealloc(ctx,len) == -1)
+		return 0;
+	if (ctx->history_text && historyTextReserve(ctx,0) == -1) return 0;
+	ctx->history_max_len = len;
+	return 1;
+}
+
+/* Enable or disable erasing duplicated history entries: when enabled,
+ * adding a line already in the history moves it to the newest position
+ * instead of storing a second copy. Enabling it erases the duplicates
+ * already in the history, keeping the newest copy. */
+void clirCtxHistorySetEraseDups(struct clirContext *ctx, int erase) {
+	int j;
+
+	if (!erase) {
+		ctx->history_erasedups = 0;
+		free(ctx->dedup_table);
+		ctx->dedup_table = NULL;
+		ctx->dedup_size = ctx->dedup_used = 0;
+		return;
+	}
+	if (ctx->history_erasedups) return;
+	ctx->history_erasedups = 1;
+	dedupBuild(ctx);
+	for (j = 1; j < ctx->history_len; j++) {
+		struct historyEntry *e = historySlot(ctx,j);
+		const char *line = ctx->history_text+e->off;
+		unsigned int hash;
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		hash = dedupHash(line,e->len);
+		if (dedupFind(ctx,line,e->len,hash) != (long)(ctx->history_seq-1-j))
+			historyErase(ctx,j);
+	}
+	if (ctx->history_dead) historyCompact(ctx);
+}
+
+/* Format the entries in the 'count' newest history slots, oldest first, one
+ * per line, into a single heap allocated buffer. The length is stored in
+ * '*lenp' and the number of lines in '*linesp'. Returns NULL on out of
+ * memory. */
+static char *historyFormat(struct clirContext *ctx, int count, size_t *lenp, int *linesp) {
+	size_t len = 0, l;
+	char *buf, *p;
+	int j;
+
+	*linesp = 0;
+	for (j = 0; j < count; j++) {
+		if (historySlot(ctx,j)->off == LINENOISE_HISTORY_DEAD) continue;
+		len += historySlot(ctx,j)->len + 1;
+		(*linesp)++;
+	}
+	if ((buf = malloc(len ? len : 1)) == NULL) return NULL;
+	for (p = buf, j = count-1; j >= 0; j--) {
+		if (historySlot(ctx,j)->off == LINENOISE_HISTORY_DEAD) continue;
+		l = historySlot(ctx,j)->len;
+		memcpy(p,historyStr(ctx,j),l);
+		p += l;
+		*p++ = '\n';
+	}
+	*lenp = len;
+	return buf;
+}
+
+/* Save the history in 'filename' as clirCtxHistorySave() does, storing
+ * in '*st', when not NULL, the status of the file written. */
+static int historySave(struct clirContext *ctx, const char *filename,
+	struct stat *st)
+{
+	size_t len = strlen(filename), buflen;
+	char *tmpname = malloc(len+8), *buf;
+	struct stat old;
+	int fd, lines, retval = -1;
+
+	if (tmpname == NULL) return -1;
+	memcpy(tmpname,filename,len);
+	memcpy(tmpname+len,".XXXXXX",8);
+	if ((fd = mkstemp(tmpname)) == -1) {
+		free(tmpname);
+		return -1;
+	}
+	/* mkstemp() creates the file as 0600, keep the mode of the file we
+	 * are replacing if there is one. */
+	if (stat(filename,&old) == 0) fchmod(fd,old.st_mode & 07777);
+
+	if ((buf = historyFormat(ctx,ctx->history_len,&buflen,&lines)) != NULL) {
+		if (writeAll(fd,buf,buflen) == 0 && fsync(fd) == 0 &&
+			(st == NULL || fstat(fd,st) == 0))
+			retval = 0;
+		free(buf);
+	}
+	if (close(fd) == -1) retval = -1;
+	if (retval == 0 && rename(tmpname,filename) == -1) retval = -1;
+	if (retval == -1) unlink(tmpname);
+	free(tmpname);
+	if (retval == 0) {
+		ctx->history_unsaved = 0;
+		ctx->history_unsynced = 0;
+		ctx->history_file_lines = lines;
+	}
+	return retval;
+}
+
+/* Save the history in the specified file. On success 0 is returned
+ * otherwise -1 is returned.
+ *
+ * The entries are written to a temporary file in the same directory which
+ * is then renamed over 'filename', so a crash while saving can never leave
+ * a truncated history behind. This is also the compaction pass used by
+ * clirCtxHistoryAppend(): entries evicted from memory are dropped from the
+ * file. */
+int clirCtxHistorySave(struct clirContext *ctx, char *filename) {
+	return historySave(ctx,filename,NULL);
+}
+
+/* Append to 'fd' only the entries added to the history since the last
+ * save, load or append, with a single write(). This makes saving after
+ * every line cost the size of the new entry instead of the size of the
+ * whole history. The file is fsync()ed according to the batching set with
+ * clirCtxHistorySetSync().
+ *
+ * On success 0 is returned otherwise -1 is returned. */
+int clirCtxHistoryAppendFd(struct clirContext *ctx, int fd) {
+	size_t len;
+	char *buf;
+	int count;
+
+	if (ctx->history_unsaved == 0) return 0;
+	if ((buf = historyFormat(ctx,ctx->history_unsaved,&len,&count)) == NULL) return -1;
+	if (writeAll(fd,buf,len) == -1) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	ctx->history_unsaved = 0;
+	ctx->history_file_lines += count;
+	ctx->history_unsynced += count;
+	if (ctx->history_sync_every && ctx->history_unsynced >= ctx->history_sync_every) {
+		if (fsync(fd) == -1) return -1;
+		ctx->history_unsynced = 0;
+	}
+	return 0;
+}
+
+/* Like clirCtxHistoryAppendFd() but opening 'filename' in append mode. When
+ * the file collected more than LINENOISE_HISTORY_COMPACT_FACTOR times the
+ * maximum history length worth of lines, it is compacted instead by
+ * rewriting it with clirCtxHistorySave().
+ *
+ * On success 0 is returned otherwise -1 is returned. */
+int clirCtxHistoryAppend(struct clirContext *ctx, char *filename) {
+	int fd, retval;
+
+	/* A shared history is already written entry by entry. */
+	if (ctx->history_share_fd != -1) return 0;
+	if (ctx->history_file_lines + ctx->history_unsaved >
+		(long)ctx->history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR)
+		return clirCtxHistorySave(ctx,filename);
+
+	if (ctx->history_unsaved == 0) return 0;
+	fd = open(filename,O_WRONLY|O_APPEND|O_CREAT,0666);
+	if (fd == -1) return -1;
+	retval = clirCtxHistoryAppendFd(ctx,fd);
+	if (close(fd) == -1) retval = -1;
+	return retval;
+}
+
+/* Set how often clirCtxHistoryAppend() and clirCtxHistoryAppendFd()
+ * fsync() the history file: after every 'every' appended entries, or never
+ * if 0. */
+void clirCtxHistorySetSync(struct clirContext *ctx, int every) {
+	ctx->history_sync_every = every < 0 ? 0 : every;
+}
+
+/* Read the whole file 'fd' into memory: mmap() it when it is a regular
+ * file of '*sizep' bytes, otherwise read() it in big chunks into a heap
+ * buffer and store the length read in '*sizep'. On success '*mapped' tells
+ * which of the two happened. Returns NULL on error. */
+static char *historyMapFile(int fd, size_t *sizep, int *mapped) {
+	size_t len = 0, cap = 65536;
+	char *buf;
+
+	if (*sizep) {
+		buf = mmap(NULL,*sizep,PROT_READ,MAP_PRIVATE,fd,0);
+		if (buf != MAP_FAILED) {
+			*mapped = 1;
+			return buf;
+		}
+	}
+	*mapped = 0;
+	if ((buf = malloc(cap)) == NULL) return NULL;
+	while (1) {
+		ssize_t nread;
+
+		if (len == cap) {
+			char *new = realloc(buf,cap*2);
+			if (new == NULL) break;
+			buf = new;
+			cap *= 2;
+		}
+		nread = read(fd,buf+len,cap-len);
+		if (nread == 0) {
+			*sizep = len;
+			return buf;
+		}
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread == -1) break;
+		len += nread;
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Load the history from the specified file. If the file does not exist
+ * -1 is returned, with errno set to ENOENT by open(), and the history is
+ * left as it is.
+ *
+ * The file is mapped in memory and scanned for newlines in a single pass
+ * with memchr(), that libc implements with vector instructions. Only the
+ * start and length of the last history_max_len lines are remembered while
+ * scanning, so just the entries that will survive are copied into the
+ * history, and loading is linear in the size of the file. Lines of any
+ * length are loaded as a single entry.
+ *
+ * If the file exists and the operation succeeded 0 is returned, otherwise
+ * on error -1 is returned. */
+int clirCtxHistoryLoad(struct clirContext *ctx, char *filename) {
+	struct line { size_t off, len; } *lines = NULL, *prev;
+	size_t size, off, len, l, j, first = 0, count = 0, cap = 0;
+	long nlines = 0;
+	struct stat st;
+	int fd, mapped, retval = -1;
+	char *buf, *nl;
+
+	if ((fd = open(filename,O_RDONLY)) == -1) return -1;
+	if (fstat(fd,&st) == -1) {
+		close(fd);
+		return -1;
+	}
+	size = S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+	buf = historyMapFile(fd,&size,&mapped);
+	close(fd);
+	if (buf == NULL) return -1;
+
+	/* 'lines' is used as a ring of the last history_max_len lines, while
+	 * consecutive duplicates are collapsed exactly like
+	 * clirCtxHistoryAdd() would do. */
+	for (off = 0; off < size; off += len+1) {
+		nl = memchr(buf+off,'\n',size-off);
+		len = nl ? (size_t)(nl-(buf+off)) : size-off;
+		l = (len && buf[off+len-1] == '\r') ? len-1 : len;
+		nlines++;
+
+		/* Lines may be erased as duplicates of newer ones, so we can't
+		 * know in advance which ones will survive. */
+		if (ctx->history_erasedups) {
+			historyAddLen(ctx,buf+off,l);
+			continue;
+		}
+		if (ctx->history_max_len == 0) continue;
+		prev = count ? &lines[(first+count-1) % cap] : NULL;
+		if (prev && prev->len == l && !memcmp(buf+prev->off,buf+off,l))
+			continue;
+		if (count == (size_t)ctx->history_max_len) {
+			first = (first+1) % cap;
+			count--;
+		} else if (count == cap) {
+			size_t newcap = cap ? cap*2 : 256;
+			struct line *new;
+
+			if (newcap > (size_t)ctx->history_max_len) newcap = ctx->history_max_len;
+			if ((new = malloc(sizeof(*new)*newcap)) == NULL) goto done;
+			for (j = 0; j < count; j++) new[j] = lines[(first+j) % cap];
+			free(lines);
+			lines = new;
+			cap = newcap;
+			first = 0;
+		}
+		lines[(first+count) % cap].off = off;
+		lines[(first+count) % cap].len = l;
+		count++;
+	}
+	for (j = 0; j < count; j++) {
+		prev = &lines[(first+j) % cap];
+		historyAddLen(ctx,buf+prev->off,prev->len);
+	}
+	ctx->history_file_lines = nlines;
+	/* What we just loaded is already on disk. */
+	ctx->history_unsaved = 0;
+	retval = 0;
+
+done:
+	free(lines);
+	if (mapped) munmap(buf,size);
+	else free(buf);
+	return retval;
+}
+
+/* A history file can be shared by the processes that edit lines at the
+ * same time, see clirCtxHistoryShare(). It stays a plain file of lines,
+ * that is only appended to: each process keeps it open, remembers up to
+ * where it read it, and adds to its history the records appended by the
+ * others since then. It does that before each line is edited, and before
+ * appending its own entries, so that they are all in the same order as in
+ * the file.
+ *
+ * Appends and reads are done holding a flock() on the file, exclusive or
+ * shared, so that records are never interleaved or read half written, and
+ * each entry is written with a single write() on a descriptor opened with
+ * O_APPEND. Once the file collected LINENOISE_HISTORY_COMPACT_FACTOR times
+ * the maximum history length worth of lines, the process appending is
+ * the one that compacts it, by renaming a new file over it, then appending
+ * to the old one a record that starts with a null byte, that no entry
+ * has, with the device, inode, size and lines of the new file. The others
+ * notice that the file they locked is no longer the one with that name:
+ * they read what is left of the old one and go on with the new one, past
+ * what the compaction wrote, as they already have what it kept, but not
+ * the records appended to the new file since. */
+
+/* Stop sharing the history file of 'ctx'. */
+static void historyShareClose(struct clirContext *ctx) {
+	if (ctx->history_share_fd == -1) return;
+	close(ctx->history_share_fd);
+	ctx->history_share_fd = -1;
+	free(ctx->history_share_path);
+	ctx->history_share_path = NULL;
+}
+
+/* Append to the shared file 'fd', that was just replaced by the
+ * compaction that wrote the file of status 'st', the record telling the
+ * others where it ends. Returns 0 on success, -1 on error. */
+static int historyShareMark(struct clirContext *ctx, int fd, struct stat *st) {
+	char rec[128];
+	struct stat old;
+	int len = 0;
+
+	if (fstat(fd,&old) == -1) return -1;
+	/* Like an entry, it must start a line. */
+	if (old.st_size > ctx->history_share_off) rec[len++] = '\n';
+	rec[len++] = '\0';
+	len += snprintf(rec+len,sizeof(rec)-len,"%llu %llu %lld %ld\n",
+		(unsigned long long)st->st_dev,(unsigned long long)st->st_ino,
+		(long long)st->st_size,ctx->history_file_lines);
+	return writeAll(fd,rec,len);
+}
+
+/* Remember the file that replaced the shared one, from the 'len' bytes
+ * long record 'rec' appended by historyShareMark(), without its null
+ * byte. */
+static void historyShareMarkRead(struct clirContext *ctx, const char *rec,
+	size_t len)
+{
+	struct historyCompaction *next = &ctx->history_share_next;
+	unsigned long long dev, ino;
+	long long size;
+	char buf[128];
+
+	if (len >= sizeof(buf)) return;
+	memcpy(buf,rec,len);
+	buf[len] = '\0';
+	if (sscanf(buf,"%llu %llu %lld %ld",&dev,&ino,&size,&next->lines) != 4)
+		return;
+	next->dev = (dev_t)dev;
+	next->ino = (ino_t)ino;
+	next->size = (off_t)size;
+}
+
+/* Add to the history the records appended to the shared file since the
+ * last one read. The file is mapped from there, and a record the writer
+ * did not terminate yet is left for the next time. Returns 0 on success,
+ * -1 on error. */
+static int historyShareRead(struct clirContext *ctx) {
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start = ctx->history_share_off & ~(off_t)(page-1);
+	size_t off = ctx->history_share_off-start, size, len;
+	struct stat st;
+	char *buf, *nl;
+
+	if (fstat(ctx->history_share_fd,&st) == -1) return -1;
+	if (st.st_size <= ctx->history_share_off) return 0;
+	size = st.st_size-start;
+	buf = mmap(NULL,size,PROT_READ,MAP_PRIVATE,ctx->history_share_fd,start);
+	if (buf == MAP_FAILED) return -1;
+	for (; (nl = memchr(buf+off,'\n',size-off)) != NULL; off = nl-buf+1) {
+		len = nl-(buf+off);
+		if (len && buf[off+len-1] == '\r') len--;
+		if (len && buf[off] == '\0') {
+			historyShareMarkRead(ctx,buf+off+1,len-1);
+			continue;
+		}
+		historyAddLen(ctx,buf+off,len);
+		ctx->history_file_lines++;
+	}
+	munmap(buf,size);
+	ctx->history_share_off = start+off;
+	/* What we just read is already on disk. */
+	ctx->history_unsaved = 0;
+	return 0;
+}
+
+/* Lock the shared history file with the flock() operation 'op', LOCK_SH
+ * or LOCK_EX. When it was replaced by a compaction the rest of the old
+ * file is read, and the new one opened and locked instead. Returns 0 on
+ * success, -1 on error, when the history is no longer shared. */
+static int historyShareLock(struct clirContext *ctx, int op) {
+	struct historyCompaction *next = &ctx->history_share_next;
+	struct stat fst, st;
+
+	while (1) {
+		int fd = ctx->history_share_fd;
+
+		while (flock(fd,op) == -1)
+			if (errno != EINTR) goto fail;
+		if (fstat(fd,&fst) == -1) goto fail;
+		if (ctx->history_share_off == -1) {
+			/* A compacted file, the records after it are new. When
+			 * the compaction was not seen ending, only those appended
+			 * from now on can be read. */
+			if (next->size != -1 && next->dev == fst.st_dev &&
+				next->ino == fst.st_ino && next->size <= fst.st_size)
+			{
+				ctx->history_share_off = next->size;
+				ctx->history_file_lines = next->lines;
+			} else {
+				ctx->history_share_off = fst.st_size;
+				ctx->history_file_lines = ctx->history_len;
+			}
+		}
+		next->size = -1;
+		if (stat(ctx->history_share_path,&st) == 0 &&
+			st.st_dev == fst.st_dev && st.st_ino == fst.st_ino) return 0;
+		historyShareRead(ctx);
+		close(fd);
+		fd = open(ctx->history_share_path,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0666);
+		if ((ctx->history_share_fd = fd) == -1) goto fail;
+		ctx->history_share_off = -1;
+	}
+
+fail:
+	historyShareClose(ctx);
+	return -1;
+}
+
+/* See the entries the other processes sharing the history file added. */
+static void historyShareSync(struct clirContext *ctx) {
+	if (ctx->history_share_fd == -1 ||
+		historyShareLock(ctx,LOCK_SH) == -1) return;
+	historyShareRead(ctx);
+	flock(ctx->history_share_fd,LOCK_UN);
+}
+
+/* Add the 'len' bytes long 'line' to the history, after the entries the
+ * other processes appended, and append it to the shared file, compacting
+ * the file when it grew too long. Returns 1 if it was added, 0 if not,
+ * as clirCtxHistoryAdd() does. */
+static int historyShareAdd(struct clirContext *ctx, const char *line, size_t len) {
+	struct stat st;
+	char *rec;
+	size_t reclen = 0;
+	int added;
+
+	if (historyShareLock(ctx,LOCK_EX) == -1) return historyAddLen(ctx,line,len);
+	historyShareRead(ctx);
+	if (!(added = historyAddLen(ctx,line,len))) goto unlock;
+	ctx->history_unsaved = 0;
+
+	/* A record left without its newline by a writer that died is ended
+	 * first, so that ours starts a line. */
+	if (fstat(ctx->history_share_fd,&st) == -1 ||
+		(rec = malloc(len+2)) == NULL) goto unlock;
+	if (st.st_size > ctx->history_share_off) rec[reclen++] = '\n';
+	memcpy(rec+reclen,line,len);
+	reclen += len;
+	rec[reclen++] = '\n';
+	if (writeAll(ctx->history_share_fd,rec,reclen) == 0) {
+		ctx->history_share_off = st.st_size+reclen;
+		ctx->history_file_lines++;
+		ctx->history_unsynced++;
+		if (ctx->history_sync_every &&
+			ctx->history_unsynced >= ctx->history_sync_every &&
+			fsync(ctx->history_share_fd) == 0) ctx->history_unsynced = 0;
+	}
+	free(rec);
+
+	/* The entry is appended before compacting, so that the others, that
+	 * read the old file to its end, have all the compaction kept. */
+	if (ctx->history_file_lines >
+		(long)ctx->history_max_len * LINENOISE_HISTORY_COMPACT_FACTOR)
+	{
+		/* Keep the old file locked until the new one replaced it and
+		 * the others were told where it ends. The new one is opened
+		 * after, and read from there the next time it is locked, as
+		 * others may append to it before. */
+		int fd = ctx->history_share_fd;
+
+		if (historySave(ctx,ctx->history_share_path,&st) == 0) {
+			historyShareMark(ctx,fd,&st);
+			ctx->history_share_fd = open(ctx->history_share_path,
+				O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0666);
+			close(fd);
+			if (ctx->history_share_fd == -1) {
+				historyShareClose(ctx);
+				return added;
+			}
+			ctx->history_share_next.dev = st.st_dev;
+			ctx->history_share_next.ino = st.st_ino;
+			ctx->history_share_next.size = st.st_size;
+			ctx->history_share_next.lines = ctx->history_file_lines;
+			ctx->history_share_off = -1;
+			return added;
+		}
+	}
+
+unlock:
+	flock(ctx->history_share_fd,LOCK_UN);
+	return added;
+}
+
+/* Share the history with the other processes using 'filename' the same
+ * way: its entries are loaded, then those the others add are seen before
+ * each line is edited, and clirCtxHistoryAdd() appends the new entries
+ * to it right away, so clirCtxHistoryAppend() has nothing left to do.
+ * It is called instead of clirCtxHistoryLoad(), and NULL stops sharing.
+ * Set the maximum length of the history before, as the file is compacted
+ * according to it.
+ *
+ * Returns 0 on success, -1 on error. */
+int clirCtxHistoryShare(struct clirContext *ctx, const char *filename) {
+	historyShareClose(ctx);
+	if (filename == NULL) return 0;
+	if ((ctx->history_share_path = strdup(filename)) == NULL) return -1;
+	ctx->history_share_fd = open(filename,O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC,0666);
+	if (ctx->history_share_fd == -1) {
+		historyShareClose(ctx);
+		return -1;
+	}
+	ctx->history_share_off = 0;
+	ctx->history_share_next.size = -1;
+	ctx->history_file_lines = 0;
+	if (historyShareLock(ctx,LOCK_SH) == -1) return -1;
+	if (historyShareRead(ctx) == -1) {
+		historyShareClose(ctx);
+		return -1;
+	}
+	flock(ctx->history_share_fd,LOCK_UN);
+	return 0;
+}
+
+/* ============================= History search ============================= */
+
+/* The incremental search is backed by a trigram index: for every sequence
+ * of three bytes found in the history, the sorted list of the sequence
+ * numbers of the entries containing it. Entry 'seq' is always found
+ * history_seq-seq positions back in the history, so lists don't need to be
+ * updated when entries are evicted: stale numbers are just skipped.
+ *
+ * A query is answered walking back the shortest list among the trigrams
+ * of the query and verifying the candidates, so the cost depends on how
+ * rare the query is rather than on the size of the history.
+ *
+ * The index is built the first time a search is performed, then kept up to
+ * date by historyAddLen(). Once as many entries as the history holds were
+ * added, at most half of it is stale, and it is thrown away to be rebuilt
+ * by the next search. */
+
+/* Return the trigram starting at 'p'. */
+static unsigned int trigramAt(const char *p) {
+	const unsigned char *u = (const unsigned char*)p;
+	return (u[0]<<16) | (u[1]<<8) | u[2];
 }
 
-/* Insert the character 'c' at cursor current position.
- *
- * On error writing to the terminal -1 is returned, otherwise 0. */
-int clirEditInsert(struct clirState *cs, int c) {
-	if (cs->len < cs->buflen) {
-		if (cs->len == cs->pos) {
-			cs->buf[cs->pos] = c;
-			cs->pos++;
-			cs->len++;
-			cs->buf[cs->len] = '\0';
-			if ((!mlmode && cs->plen+cs->len < cs->cols) /* || mlmode */) {
-				/* Avoid a full update of the line in the
-				 * trivial case. */
-				if (write(cs->fd,&c,1) == -1) return -1;
-			} else {
-				refreshLine(cs);
+/* Return the hash table slot for the trigram 'tri'. */
+static size_t searchIndexSlot(struct searchPosting *table, size_t size,
+		unsigned int tri) {
+	size_t j = ((tri * 2654435761u) >> 7) & (size-1);
+
+	while (table[j].ids != NULL && table[j].tri != tri) j = (j+1) & (size-1);
+	return j;
+}
+
+/* Return the posting list of the trigram 'tri', or NULL if no entry
+ * contains it. */
+static struct searchPosting *searchIndexFind(struct clirContext *ctx, unsigned int tri) {
+	struct searchPosting *p;
+
+	if (ctx->search_index == NULL) return NULL;
+	p = ctx->search_index + searchIndexSlot(ctx->search_index,ctx->search_index_size,tri);
+	return p->ids ? p : NULL;
+}
+
+/* Free the index. */
+static void searchIndexFree(struct clirContext *ctx) {
+	size_t j;
+
+	for (j = 0; j < ctx->search_index_size; j++) free(ctx->search_index[j].ids);
+	free(ctx->search_index);
+	ctx->search_index = NULL;
+	ctx->search_index_size = ctx->search_index_used = 0;
+}
+
+/* Insert in the index the entry 'seq' holding the 'len' bytes of 'line'. */
+static void searchIndexInsert(struct clirContext *ctx, unsigned int seq, const char *line, size_t len) {
+	size_t j;
+
+	for (j = 0; j+3 <= len; j++) {
+		unsigned int tri = trigramAt(line+j);
+		struct searchPosting *p;
+
+		/* Keep the table at most half full. */
+		if (ctx->search_index_used*2 >= ctx->search_index_size) {
+			size_t size = ctx->search_index_size*2, k;
+			struct searchPosting *new = calloc(size,sizeof(*new));
+
+			if (new == NULL) {
+				searchIndexFree(ctx);
+				return;
 			}
-		} else {
-			memmove(cs->buf+cs->pos+1,cs->buf+cs->pos,cs->len-cs->pos);
-			cs->buf[cs->pos] = c;
-			cs->len++;
-			cs->pos++;
-			cs->buf[cs->len] = '\0';
-			refreshLine(cs);
+			for (k = 0; k < ctx->search_index_size; k++) {
+				if (ctx->search_index[k].ids == NULL) continue;
+				new[searchIndexSlot(new,size,ctx->search_index[k].tri)] =
+					ctx->search_index[k];
+			}
+			free(ctx->search_index);
+			ctx->search_index = new;
+			ctx->search_index_size = size;
+		}
+		p = ctx->search_index + searchIndexSlot(ctx->search_index,ctx->search_index_size,tri);
+		if (p->ids == NULL) {
+			p->tri = tri;
+			p->len = 0;
+			p->cap = 4;
+			if ((p->ids = malloc(sizeof(unsigned int)*p->cap)) == NULL) {
+				searchIndexFree(ctx);
+				return;
+			}
+			ctx->search_index_used++;
+		} else if (p->ids[p->len-1] == seq) {
+			continue; /* Trigram seen before in this same entry. */
+		} else if (p->len == p->cap) {
+			unsigned int *ids = realloc(p->ids,sizeof(unsigned int)*p->cap*2);
+
+			if (ids == NULL) {
+				searchIndexFree(ctx);
+				return;
+			}
+			p->ids = ids;
+			p->cap *= 2;
 		}
+		p->ids[p->len++] = seq;
 	}
-	return 0;
 }
 
-/* Move cursor on the left. */
-void clirEditMoveLeft(struct clirState *cs) {
-	if (cs->pos > 0) {
-		cs->pos--;
-		refreshLine(cs);
+/* Add to the index the new history entry 'seq' holding the 'len' bytes of
+ * 'line'. Does nothing if the index was not built. */
+static void searchIndexAdd(struct clirContext *ctx, unsigned int seq, const char *line, size_t len) {
+	if (ctx->search_index == NULL) return;
+	if (++ctx->search_index_adds > ctx->history_len) {
+		searchIndexFree(ctx);
+		return;
 	}
+	searchIndexInsert(ctx,seq,line,len);
 }
 
-/* Move cursor on the right. */
-void clirEditMoveRight(struct clirState *cs) {
-	if (cs->pos != cs->len) {
-		cs->pos++;
-		refreshLine(cs);
+/* Build the index of the whole history. */
+static void searchIndexBuild(struct clirContext *ctx) {
+	int j;
+
+	searchIndexFree(ctx);
+	ctx->search_index_size = 1024;
+	if ((ctx->search_index = calloc(ctx->search_index_size,sizeof(*ctx->search_index))) == NULL)
+		return;
+	ctx->search_index_adds = 0;
+	for (j = ctx->history_len-1; j >= 0 && ctx->search_index; j--) {
+		struct historyEntry *e = historySlot(ctx,j);
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		searchIndexInsert(ctx,ctx->history_seq-1-j,ctx->history_text+e->off,e->len);
 	}
 }
 
-/* Substitute the currently edited line with the next or previous history
- * entry as specified by 'dir'. */
-#define LINENOISE_HISTORY_NEXT 0
-#define LINENOISE_HISTORY_PREV 1
-void clirEditHistoryNext(struct clirState *cs, int dir) {
-	if (history_len > 1) {
-		/* Update the current history entry before to
-		 * overwrite it with the next one. */
-		free(history[history_len - 1 - cs->history_index]);
-		history[history_len - 1 - cs->history_index] = strdup(cs->buf);
-		/* Show the new entry */
-		cs->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
-		if (cs->history_index < 0) {
-			cs->history_index = 0;
-			return;
-		} else if (cs->history_index >= history_len) {
-			cs->history_index = history_len-1;
-			return;
+/* Return the sequence number of the newest history entry older than the
+ * sequence number 'before' that contains the 'qlen' bytes long 'query', or
+ * -1 if there is none. */
+static long historySearch(struct clirContext *ctx, const char *query, size_t qlen, unsigned int before) {
+	unsigned int oldest = ctx->history_seq - ctx->history_len, seq;
+	struct searchPosting *best = NULL;
+	size_t j, lo, hi;
+
+	if (qlen == 0 || ctx->history_len == 0) return -1;
+	if (before > ctx->history_seq) before = ctx->history_seq;
+
+	/* Queries too short to have a trigram are matched by a linear scan,
+	 * they match something soon enough anyway. */
+	if (qlen < 3) {
+		for (seq = before; seq-- > oldest; ) {
+			struct historyEntry *e = historySeqSlot(ctx,seq);
+
+			if (e->off != LINENOISE_HISTORY_DEAD &&
+				strstr(ctx->history_text+e->off,query)) return seq;
 		}
-		strncpy(cs->buf,history[history_len - 1 - cs->history_index],cs->buflen);
-		cs->buf[cs->buflen-1] = '\0';
-		cs->len = cs->pos = strlen(cs->buf);
-		refreshLine(cs);
+		return -1;
 	}
-}
 
-/* Delete the character at the right of the cursor without altering the cursor
- * position. Basically this is what happens with the "Delete" keyboard key. */
-void clirEditDelete(struct clirState *cs) {
-	if (cs->len > 0 && cs->pos < cs->len) {
-		memmove(cs->buf+cs->pos,cs->buf+cs->pos+1,cs->len-cs->pos-1);
-		cs->len--;
-		cs->buf[cs->len] = '\0';
-		refreshLine(cs);
+	if (ctx->search_index == NULL) searchIndexBuild(ctx);
+	if (ctx->search_index == NULL) return -1;
+	for (j = 0; j+3 <= qlen; j++) {
+		struct searchPosting *p = searchIndexFind(ctx,trigramAt(query+j));
+
+		if (p == NULL) return -1; /* No entry has this trigram. */
+		if (best == NULL || p->len < best->len) best = p;
+	}
+
+	/* Find the first candidate older than 'before' with a binary search,
+	 * then walk back verifying the candidates. */
+	lo = 0;
+	hi = best->len;
+	while (lo < hi) {
+		size_t mid = lo+(hi-lo)/2;
+		if (best->ids[mid] < before) lo = mid+1;
+		else hi = mid;
+	}
+	while (lo-- > 0) {
+		struct historyEntry *e;
+
+		seq = best->ids[lo];
+		if (seq < oldest) break;
+		e = historySeqSlot(ctx,seq);
+		if (e->off != LINENOISE_HISTORY_DEAD &&
+			strstr(ctx->history_text+e->off,query)) return seq;
 	}
+	return -1;
 }
 
-/* Backspace implementation. */
-void clirEditBackspace(struct clirState *cs) {
-	if (cs->pos > 0 && cs->len > 0) {
-		memmove(cs->buf+cs->pos-1,cs->buf+cs->pos,cs->len-cs->pos);
-		cs->pos--;
-		cs->len--;
-		cs->buf[cs->len] = '\0';
-		refreshLine(cs);
+/* In fuzzy mode the search finds the best match rather than the newest
+ * one. The entries are ordered by score, then the newest first, that is
+ * by the keys score<<32|seq, and a search finds the highest key below the
+ * one of the previous match, so that it needs no sorting and no memory,
+ * just a scan of the whole history. Big histories are split between
+ * threads, each scanning a range of it. */
+
+struct fuzzyScan {
+	struct clirContext *ctx;
+	const char *query;
+	size_t qlen;
+	int fold;
+	int lo, hi;                 /* History indexes scanned. */
+	long long below;            /* Only keys below it. */
+	long long best;             /* Highest key found, or -1. */
+};
+
+/* Find the best key of a range of the history, see historyFuzzySearch().
+ * The history is only read, so ranges can be scanned at the same time. */
+static void *fuzzyScanRange(void *arg) {
+	struct fuzzyScan *scan = arg;
+	struct clirContext *ctx = scan->ctx;
+	int j;
+
+	for (j = scan->lo; j < scan->hi; j++) {
+		struct historyEntry *e = historySlot(ctx,j);
+		long long key;
+		size_t start;
+		int score;
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		score = fuzzyScore(scan->query,scan->qlen,ctx->history_text+e->off,
+			e->len,scan->fold,&start);
+		if (score == -1) continue;
+		key = (long long)score << 32 | (ctx->history_seq-1-j);
+		if (key < scan->below && key > scan->best) scan->best = key;
 	}
+	return NULL;
 }
 
-/* Delete the previosu word, maintaining the cursor at the start of the
- * current word. */
-void clirEditDeletePrevWord(struct clirState *cs) {
-	size_t old_pos = cs->pos;
-	size_t diff;
+/* Return the key of the entry that fuzzy matches the query 'query' of
+ * 'qlen' bytes the best, among those with a key below 'below', or -1 if
+ * none does. The sequence number of the entry is the low 32 bits. */
+static long long historyFuzzySearch(struct clirContext *ctx, const char *query,
+	size_t qlen, long long below)
+{
+	struct fuzzyScan scans[LINENOISE_FUZZY_THREADS_MAX];
+	pthread_t threads[LINENOISE_FUZZY_THREADS_MAX];
+	int started[LINENOISE_FUZZY_THREADS_MAX];
+	int nthreads = ctx->fuzzy_threads, j;
+	long long best = -1;
 
-	while (cs->pos > 0 && cs->buf[cs->pos-1] == ' ')
-		cs->pos--;
-	while (cs->pos > 0 && cs->buf[cs->pos-1] != ' ')
-		cs->pos--;
-	diff = old_pos - cs->pos;
-	memmove(cs->buf+cs->pos,cs->buf+old_pos,cs->len-old_pos+1);
-	cs->len -= diff;
-	refreshLine(cs);
+	if (ctx->history_len < LINENOISE_FUZZY_PARALLEL_MIN) nthreads = 1;
+	for (j = 0; j < nthreads; j++) {
+		scans[j].ctx = ctx;
+		scans[j].query = query;
+		scans[j].qlen = qlen;
+		scans[j].fold = fuzzyFold(query,qlen);
+		scans[j].lo = (int)((long long)ctx->history_len*j/nthreads);
+		scans[j].hi = (int)((long long)ctx->history_len*(j+1)/nthreads);
+		scans[j].below = below;
+		scans[j].best = -1;
+	}
+	for (j = 1; j < nthreads; j++)
+		started[j] = pthread_create(&threads[j],NULL,fuzzyScanRange,&scans[j]) == 0;
+	fuzzyScanRange(&scans[0]);
+	for (j = 0; j < nthreads; j++) {
+		if (j > 0 && started[j]) pthread_join(threads[j],NULL);
+		else if (j > 0) fuzzyScanRange(&scans[j]);
+		if (scans[j].best > best) best = scans[j].best;
+	}
+	return best;
 }
 
-/* This function is the core of the line editing capability of clir.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
- *
- * The resulting string is put into 'buf' when the user type enter, or
- * when ctrl+d is typed.
+/* ============================== Suggestions =============================== */
+
+/* At the end of the line the rest of the newest history entry starting
+ * with it is suggested, drawn in grey after the cursor, and accepted by
+ * moving right. It is looked up on every key typed, in a radix trie of
+ * the history: every node is a prefix of some entries, and stores the
+ * newest of them. The position reached in the trie by the line is kept,
+ * so that typing one more byte walks it one more step, and the lookup
+ * costs the same with any number of entries.
  *
- * The function returns the length of the current buffer. */
-static int clirEdit(int fd, char *buf, size_t buflen, const char *prompt)
+ * Like the search index, the trie is built by the first lookup, then kept
+ * up to date by historyAddLen(). Entries are never removed from it:
+ * when the newest entry of a node was evicted, all the others were too,
+ * and the node suggests nothing. Once as many entries as the history holds
+ * were added it is thrown away, to be rebuilt without the evicted ones. */
+
+/* Free the trie. */
+static void suggestIndexFree(struct clirContext *ctx) {
+	free(ctx->suggest_trie);
+	ctx->suggest_trie = NULL;
+	ctx->suggest_trie_len = ctx->suggest_trie_cap = 0;
+	free(ctx->suggest_text.b);
+	ctx->suggest_text.b = NULL;
+	ctx->suggest_text.len = ctx->suggest_text.cap = 0;
+	ctx->suggest_prefix.len = 0;
+	ctx->suggest_node = ctx->suggest_label = 0;
+}
+
+/* Return a new node of the trie, with the 'len' bytes of 'label' as the
+ * label of its edge, or 0 on out of memory. */
+static unsigned int suggestNodeNew(struct clirContext *ctx, const char *label,
+	size_t len)
 {
-	struct clirState cs;
+	struct suggestNode *n;
+	size_t off = ctx->suggest_text.len;
 
-	/* Populate the clir state that we pass to functions implementing
-	 * specific editing functionalities. */
-	cs.fd = fd;
-	cs.buf = buf;
-	cs.buflen = buflen;
-	cs.prompt = prompt;
-	cs.plen = strlen(prompt);
-	cs.oldpos = cs.pos = 0;
-	cs.len = 0;
-	cs.cols = getColumns();
-	cs.maxrows = 0;
-	cs.history_index = 0;
-	cs.word_pos = 0;
+	if (ctx->suggest_trie_len == ctx->suggest_trie_cap) {
+		unsigned int cap = ctx->suggest_trie_cap ? ctx->suggest_trie_cap*2 : 256;
+		struct suggestNode *new = realloc(ctx->suggest_trie,sizeof(*new)*cap);
 
-	/* Buffer starts empty. */
-	buf[0] = '\0';
-	buflen--; /* Make sure there is always space for the nulterm */
+		if (new == NULL) return 0;
+		ctx->suggest_trie = new;
+		ctx->suggest_trie_cap = cap;
+	}
+	if (len) abAppend(&ctx->suggest_text,label,len);
+	if (ctx->suggest_text.len != off+len) return 0;
+	n = ctx->suggest_trie + ctx->suggest_trie_len;
+	n->off = off;
+	n->len = len;
+	n->child = n->next = n->newest = n->longer = 0;
+	return ctx->suggest_trie_len++;
+}
 
-	/* The latest history entry is always our current buffer, that
-	 * initially is just an empty string. */
-	clirHistoryAdd("");
+/* Insert in the trie the entry 'seq' holding the 'len' bytes of 'line'.
+ * Walking down, the nodes get it as their newest entry, and when its text
+ * leaves the label of an edge the edge is split there. */
+static void suggestIndexInsert(struct clirContext *ctx, unsigned int seq, const char *line, size_t len) {
+	struct suggestNode *trie;
+	unsigned int node = 0, id = seq+1, c;
+	size_t pos = 0, l;
 
-	if (write(fd,prompt,cs.plen) == -1) return -1;
-	while(1) {
-		char c;
-		int nread;
-		char seq[2], seq2[2];
-
-		nread = read(fd, &c, 1);
-		if (nread <= 0) return cs.len;
-
-		/* Only autocomplete when the callback is set. It returns < 0 when
-		 * there was an error reading from fd. Otherwise it will return the
-		 * character that should be handled next. */
-		if (c == 9 && completionCallback != NULL) { /* tab key */
-
-			//c = completeLine(&cs);
-			c = completeWord(&cs);
-
-			/* Return on errors */
-			if (c < 0) return (int)cs.len;
-			/* Read next character when 0 */
-			if (c == 0) continue;
-			/* List all the completions */
-			if (c > 0) {
-				refreshLine(&cs);
-				continue;
+	/* Nodes may be split, forget where the line was. */
+	ctx->suggest_prefix.len = 0;
+	ctx->suggest_node = ctx->suggest_label = 0;
+	while (1) {
+		trie = ctx->suggest_trie;
+		trie[node].newest = id;
+		if (pos == len) break;
+		trie[node].longer = id;
+		for (c = trie[node].child; c; c = trie[c].next)
+			if (ctx->suggest_text.b[trie[c].off] == line[pos]) break;
+		if (c == 0) {
+			if ((c = suggestNodeNew(ctx,line+pos,len-pos)) == 0) {
+				suggestIndexFree(ctx);
+				return;
 			}
+			trie = ctx->suggest_trie;
+			trie[c].next = trie[node].child;
+			trie[c].newest = id;
+			trie[node].child = c;
+			break;
 		}
+		for (l = 0; l < trie[c].len && pos+l < len; l++)
+			if (ctx->suggest_text.b[trie[c].off+l] != line[pos+l]) break;
+		if (l < trie[c].len) {
+			/* The new lower node takes the rest of the label, and what
+			 * was below, so every entry below the upper one is longer. */
+			unsigned int m = suggestNodeNew(ctx,NULL,0);
 
-		switch(c) {
-			case 13:    /* enter */
-				history_len--;
-				free(history[history_len]);
-				return (int)cs.len;
-			case 3:     /* ctrl-c */
-				errno = EAGAIN;
-				return -1;
-			case 127:   /* backspace */
-			case 8:     /* ctrl-h */
-				clirEditBackspace(&cs);
-				break;
-			case 4:     /* ctrl-d, remove char at right of cursor, or of the
-										 line is empty, act as end-of-file. */
-				if (cs.len > 0) {
-					clirEditDelete(&cs);
-				} else {
-					history_len--;
-					free(history[history_len]);
-					return -1;
-				}
-				break;
-			case 20:    /* ctrl-t, swaps current character with previous. */
-				if (cs.pos > 0 && cs.pos < cs.len) {
-					int aux = buf[cs.pos-1];
-					buf[cs.pos-1] = buf[cs.pos];
-					buf[cs.pos] = aux;
-					if (cs.pos != cs.len-1) cs.pos++;
-					refreshLine(&cs);
-				}
-				break;
-			case 2:     /* ctrl-b */
-				clirEditMoveLeft(&cs);
-				break;
-			case 6:     /* ctrl-f */
-				clirEditMoveRight(&cs);
-				break;
-			case 16:    /* ctrl-p */
-				clirEditHistoryNext(&cs, LINENOISE_HISTORY_PREV);
-				break;
-			case 14:    /* ctrl-n */
-				clirEditHistoryNext(&cs, LINENOISE_HISTORY_NEXT);
-				break;
-			case 27:    /* escape sequence */
-				/* Read the next two bytes representing the escape sequence. */
-				if (read(fd,seq,2) == -1) break;
-
-				if (seq[0] == 91) {
-					switch(seq[1]) {
-						case 65: /* up arrow */
-							clirEditHistoryNext(&cs,LINENOISE_HISTORY_PREV);
-							break;
-						case 66: /* down arrow */
-							clirEditHistoryNext(&cs,LINENOISE_HISTORY_NEXT);
-							break;
-						case 67: /* right arrow */
-							clirEditMoveRight(&cs);
-							break;
-						case 68: /* left arrow */
-							clirEditMoveLeft(&cs);
-							break;
-						case 90: /* shift tab */
-							// todo: complete line from history
-							break;
-						default:
-							if (seq[1] > 48 && seq[1] < 55) {
-								/* Read the next two bytes continuing the escape sequence. */
-								if (read(fd,seq2,2) == -1) break;
-
-								if (seq[1] == 51 && seq2[0] == 126) {
-									/* delete key. */
-									clirEditDelete(&cs);
-								} else if (seq[1] == 49 && seq2[0] == 59) { // modifier key
-									char seq3[1];
-									if (read(fd,seq3,1) == -1) break;
-
-									if (seq2[1] == 53) { // ctrl key
-										if (seq3[0] == 67) {
-											while (!isspace(buf[cs.pos]) && cs.pos < cs.len) {
-												cs.pos++;
-											}
-											while (isspace(buf[cs.pos]) && cs.pos <= cs.len) {
-												cs.pos++;
-											}
-											refreshLine(&cs);
-										} else if (seq3[0] == 68) {
-											if (cs.pos > 0) { cs.pos--; }
-											while (isspace(buf[cs.pos]) && cs.pos > 0) {
-												cs.pos--;
-											}
-											while (!isspace(buf[cs.pos-1]) && cs.pos > 0) {
-												cs.pos--;
-											}
-											refreshLine(&cs);
-										}
-									}
-								}
-							}
-							break;
-					}
-				} else if (seq[0] == 79 && seq[1] == 72) {
-					/* home button */
-					if (cs.pos > 0) {
-						cs.pos = 0;
-						refreshLine(&cs);
-					}
-				} else if (seq[0] == 79 && seq[1] == 70) {
-					/* end button */
-					if (cs.pos != cs.len) {
-						cs.pos = cs.len;
-						refreshLine(&cs);
-					}
-				}
-				break;
-			case 21: /* ctrl-u, delete the whole line. */
-				buf[0] = '\0';
-				cs.pos = cs.len = 0;
-				refreshLine(&cs);
-				break;
-			case 11: /* ctrl-k, delete from current to end of line. */
-				buf[cs.pos] = '\0';
-				cs.len = cs.pos;
-				refreshLine(&cs);
-				break;
-			case 1:  /* ctrl-a, go to the start of the line */
-				cs.pos = 0;
-				refreshLine(&cs);
-				break;
-			case 5:  /* ctrl-e, go to the end of the line */
-				cs.pos = cs.len;
-				refreshLine(&cs);
-				break;
-			case 12: /* ctrl-l, clear screen */
-				clirClearScreen();
-				refreshLine(&cs);
-				break;
-			case 23: /* ctrl-w, delete previous word */
-				clirEditDeletePrevWord(&cs);
-				break;
-			default:
-				if (clirEditInsert(&cs, c)) return -1;
-				if (c == ' ') cs.word_pos = cs.pos;
-				break;
+			if (m == 0) {
+				suggestIndexFree(ctx);
+				return;
+			}
+			trie = ctx->suggest_trie;
+			trie[m] = trie[c];
+			trie[m].off += l;
+			trie[m].len -= l;
+			trie[m].next = 0;
+			trie[c].len = l;
+			trie[c].child = m;
+			trie[c].longer = trie[c].newest;
 		}
+		node = c;
+		pos += l;
 	}
-	return cs.len;
 }
 
-/* This function calls the line editing function clirEdit() using
- * the STDIN file descriptor set in raw mode. */
-static int clirRaw(char *buf, size_t buflen, const char *prompt) {
-	int fd = STDIN_FILENO;
-	int count;
+/* Add to the trie the new history entry 'seq' holding the 'len' bytes of
+ * 'line'. Does nothing if the trie was not built. */
+static void suggestIndexAdd(struct clirContext *ctx, unsigned int seq, const char *line, size_t len) {
+	if (ctx->suggest_trie == NULL) return;
+	if (++ctx->suggest_trie_adds > ctx->history_len) {
+		suggestIndexFree(ctx);
+		return;
+	}
+	suggestIndexInsert(ctx,seq,line,len);
+}
 
-	if (buflen == 0) {
-		errno = EINVAL;
-		return -1;
+/* Build the trie of the whole history, the oldest entry first. */
+static void suggestIndexBuild(struct clirContext *ctx) {
+	int j;
+
+	suggestIndexFree(ctx);
+	if (suggestNodeNew(ctx,NULL,0) != 0) { /* The root. */
+		suggestIndexFree(ctx);
+		return;
 	}
-	if (!isatty(STDIN_FILENO)) {
-		if (fgets(buf, buflen, stdin) == NULL) return -1;
-		count = strlen(buf);
-		if (count && buf[count-1] == '\n') {
-			count--;
-			buf[count] = '\0';
-		}
-	} else {
-		if (enableRawMode(fd) == -1) return -1;
-		count = clirEdit(fd, buf, buflen, prompt);
-		disableRawMode(fd);
-		printf("\n");
+	ctx->suggest_trie_adds = 0;
+	for (j = ctx->history_len-1; j >= 0 && ctx->suggest_trie; j--) {
+		struct historyEntry *e = historySlot(ctx,j);
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		suggestIndexInsert(ctx,ctx->history_seq-1-j,ctx->history_text+e->off,e->len);
 	}
-	return count;
 }
 
-/* The high level function that is the main API of the clir library.
- * This function checks if the terminal has basic capabilities, just checking
- * for a blacklist of stupid terminals, and later either calls the line
- * editing function or uses dummy fgets() so that you will be able to type
- * something even in the most desperate of the conditions. */
-char *clir(const char *prompt) {
-	char buf[LINENOISE_MAX_LINE];
-	int count;
+/* Return the suggestion for the edited line, the rest of the newest
+ * history entry that starts with it and is longer, storing its length in
+ * '*lenp', or NULL if there is none. The walk in the trie starts from
+ * where the previous lookup stopped, if the line still starts with what
+ * it walked. */
+static const char *suggestFind(struct clirState *cs, size_t *lenp) {
+	struct clirContext *ctx = cs->ctx;
+	struct abuf *walked = &ctx->suggest_prefix;
+	struct suggestNode *trie, *n;
+	unsigned int id, node, label;
+	struct historyEntry *e;
+	const char *buf;
+	size_t depth;
+	int found = 1;
 
-	if (isUnsupportedTerm()) {
-		size_t len;
+	if (!ctx->suggest || ctx->suggest_hidden || cs->searching ||
+		ctx->comp_list_state || cs->len == 0 || cs->pos != cs->len ||
+		ctx->history_len == 0) return NULL;
+	if (ctx->suggest_trie == NULL) suggestIndexBuild(ctx);
+	if (ctx->suggest_trie == NULL) return NULL;
 
-		printf("%s",prompt);
-		fflush(stdout);
-		if (fgets(buf,LINENOISE_MAX_LINE,stdin) == NULL) return NULL;
-		len = strlen(buf);
-		while(len && (buf[len-1] == '\n' || buf[len-1] == '\r')) {
-			len--;
-			buf[len] = '\0';
+	buf = editFlat(cs);
+	if (walked->len > cs->len ||
+		(walked->len && memcmp(walked->b,buf,walked->len) != 0)) {
+		walked->len = 0;
+		ctx->suggest_node = ctx->suggest_label = 0;
+	}
+	trie = ctx->suggest_trie;
+	node = ctx->suggest_node;
+	label = ctx->suggest_label;
+	for (depth = walked->len; depth < cs->len; depth++, label++) {
+		if (label == trie[node].len) {
+			unsigned int c;
+
+			for (c = trie[node].child; c; c = trie[c].next)
+				if (ctx->suggest_text.b[trie[c].off] == buf[depth]) break;
+			if (c == 0) {
+				found = 0;
+				break;
+			}
+			node = c;
+			label = 0;
+		}
+		if (ctx->suggest_text.b[trie[node].off+label] != buf[depth]) {
+			found = 0;
+			break;
 		}
-		return strdup(buf);
+	}
+	if (depth > walked->len) abAppend(walked,buf+walked->len,depth-walked->len);
+	if (walked->len == depth) {
+		ctx->suggest_node = node;
+		ctx->suggest_label = label;
 	} else {
-		count = clirRaw(buf,LINENOISE_MAX_LINE,prompt);
-		if (count == -1) return NULL;
-		return strdup(buf);
+		walked->len = 0;
+		ctx->suggest_node = ctx->suggest_label = 0;
 	}
+	if (!found) return NULL;
+
+	/* Inside a label every entry below is longer than the line. */
+	n = trie+node;
+	id = label < n->len ? n->newest : n->longer;
+	if (id == 0 || ctx->history_seq-id >= (unsigned int)ctx->history_len)
+		return NULL;
+	e = historySeqSlot(ctx,id-1);
+	if (e->off == LINENOISE_HISTORY_DEAD || e->len <= cs->len) return NULL;
+	*lenp = e->len-cs->len;
+	return ctx->history_text+e->off+cs->len;
 }
 
-/* ================================ History ================================= */
+/* Suggest the rest of the newest history entry starting with the line
+ * when the cursor is at its end, if 'enable' is true. */
+void clirCtxSetSuggestions(struct clirContext *ctx, int enable) {
+	ctx->suggest = enable;
+	if (!enable) suggestIndexFree(ctx);
+}
 
-/* Free the history, but does not reset it. Only used when we have to
- * exit() to avoid memory leaks are reported by valgrind & co. */
-static void freeHistory(void) {
-	if (history) {
-		int j;
+/* ========================= History deduplication ========================== */
 
-		for (j = 0; j < history_len; j++)
-			free(history[j]);
-		free(history);
+/* When erasing duplicates, a hash table maps the text of every live entry
+ * to its sequence number, so that an older copy of a line being added is
+ * found in O(1). It uses open addressing with linear probing, and is kept
+ * at most half full. */
+
+/* FNV-1a hash of the 'len' bytes of 'line'. */
+static unsigned int dedupHash(const char *line, size_t len) {
+	unsigned int hash = 2166136261u;
+	size_t j;
+
+	for (j = 0; j < len; j++) {
+		hash ^= (unsigned char)line[j];
+		hash *= 16777619u;
 	}
+	return hash;
 }
 
-/* At exit we'll try to fix the terminal to the initial conditions. */
-static void clirAtExit(void) {
-	disableRawMode(STDIN_FILENO);
-	freeHistory();
+/* Return the sequence number of the entry with the 'len' bytes of 'line'
+ * as text, or -1 if there is none. */
+static long dedupFind(struct clirContext *ctx, const char *line, size_t len, unsigned int hash) {
+	size_t j;
+
+	if (ctx->dedup_table == NULL) return -1;
+	for (j = hash & (ctx->dedup_size-1); ctx->dedup_table[j].id; j = (j+1) & (ctx->dedup_size-1)) {
+		struct historyEntry *e;
+
+		if (ctx->dedup_table[j].hash != hash) continue;
+		e = historySeqSlot(ctx,ctx->dedup_table[j].id-1);
+		if (e->len == len && !memcmp(ctx->history_text+e->off,line,len))
+			return ctx->dedup_table[j].id-1;
+	}
+	return -1;
 }
 
-/* Using a circular buffer is smarter, but a bit more complex to handle. */
-int clirHistoryAdd(const char *line) {
-	char *linecopy;
-
-	if (history_max_len == 0) return 0;
-	if (history == NULL) {
-		history = malloc(sizeof(char*)*history_max_len);
-		if (history == NULL) return 0;
-		memset(history,0,(sizeof(char*)*history_max_len));
-	}
-	linecopy = strdup(line);
-	if (!linecopy) return 0;
-	if (history_len == history_max_len) {
-		free(history[0]);
-		memmove(history,history+1,sizeof(char*)*(history_max_len-1));
-		history_len--;
-	}
-	if (history_len && !strcmp(history[history_len-1], line)) return 0;
-	history[history_len] = linecopy;
-	history_len++;
-	return 1;
+/* Store in 'table' the entry 'seq' with the given hash. */
+static void dedupStore(struct dedupSlot *table, size_t size,
+		unsigned int seq, unsigned int hash) {
+	size_t j = hash & (size-1);
+
+	while (table[j].id) j = (j+1) & (size-1);
+	table[j].id = seq+1;
+	table[j].hash = hash;
 }
 
-/* Set the maximum length for the history. This function can be called even
- * if there is already some history, the function will make sure to retain
- * just the latest 'len' elements if the new history length value is smaller
- * than the amount of items already inside the history. */
-int clirHistorySetMaxLen(int len) {
-	char **new;
+/* Add the entry 'seq' with the given hash to the table. On out of memory
+ * deduplication is disabled. */
+static void dedupInsert(struct clirContext *ctx, unsigned int seq, unsigned int hash) {
+	if (ctx->dedup_used*2 >= ctx->dedup_size) {
+		size_t size = ctx->dedup_size ? ctx->dedup_size*2 : 64, j;
+		struct dedupSlot *new = calloc(size,sizeof(*new));
 
-	if (len < 1) return 0;
-	if (history) {
-		int tocopy = history_len;
+		if (new == NULL) {
+			clirCtxHistorySetEraseDups(ctx,0);
+			return;
+		}
+		for (j = 0; j < ctx->dedup_size; j++)
+			if (ctx->dedup_table[j].id)
+				dedupStore(new,size,ctx->dedup_table[j].id-1,ctx->dedup_table[j].hash);
+		free(ctx->dedup_table);
+		ctx->dedup_table = new;
+		ctx->dedup_size = size;
+	}
+	dedupStore(ctx->dedup_table,ctx->dedup_size,seq,hash);
+	ctx->dedup_used++;
+}
 
-		new = malloc(sizeof(char*)*len);
-		if (new == NULL) return 0;
+/* Remove the entry 'seq' with the 'len' bytes of 'line' as text from the
+ * table. Following entries of the same probe sequence are shifted back, so
+ * no tombstones are needed. */
+static void dedupRemove(struct clirContext *ctx, unsigned int seq, const char *line, size_t len) {
+	size_t mask = ctx->dedup_size-1, j, k;
 
-		/* If we can't copy everything, free the elements we'll not use. */
-		if (len < tocopy) {
-			int j;
+	if (ctx->dedup_table == NULL) return;
+	for (j = dedupHash(line,len) & mask; ctx->dedup_table[j].id != seq+1;
+		 j = (j+1) & mask) {
+		if (ctx->dedup_table[j].id == 0) return;
+	}
+	ctx->dedup_used--;
+	for (k = (j+1) & mask; ctx->dedup_table[k].id; k = (k+1) & mask) {
+		size_t home = ctx->dedup_table[k].hash & mask;
 
-			for (j = 0; j < tocopy-len; j++) free(history[j]);
-			tocopy = len;
+		/* Move 'k' into the hole at 'j' unless its home slot is
+		 * cyclically in (j,k]. */
+		if ((j < k) ? (home <= j || home > k) : (home <= j && home > k)) {
+			ctx->dedup_table[j] = ctx->dedup_table[k];
+			j = k;
 		}
-		memset(new,0,sizeof(char*)*len);
-		memcpy(new,history+(history_len-tocopy), sizeof(char*)*tocopy);
-		free(history);
-		history = new;
 	}
-	history_max_len = len;
-	if (history_len > history_max_len)
-		history_len = history_max_len;
-	return 1;
+	ctx->dedup_table[j].id = 0;
 }
 
-/* Save the history in the specified file. On success 0 is returned
- * otherwise -1 is returned. */
-int clirHistorySave(char *filename) {
-	FILE *fp = fopen(filename,"w");
+/* Rebuild the table from the live history entries. When the history holds
+ * duplicates only the newest copy is stored. */
+static void dedupBuild(struct clirContext *ctx) {
 	int j;
 
-	if (fp == NULL) return -1;
-	for (j = 0; j < history_len; j++)
-		fprintf(fp,"%s\n",history[j]);
-	fclose(fp);
-	return 0;
+	free(ctx->dedup_table);
+	ctx->dedup_table = NULL;
+	ctx->dedup_size = ctx->dedup_used = 0;
+	for (j = 0; j < ctx->history_len && ctx->history_erasedups; j++) {
+		struct historyEntry *e = historySlot(ctx,j);
+		const char *line = ctx->history_text+e->off;
+		unsigned int hash;
+
+		if (e->off == LINENOISE_HISTORY_DEAD) continue;
+		hash = dedupHash(line,e->len);
+		if (dedupFind(ctx,line,e->len,hash) == -1)
+			dedupInsert(ctx,ctx->history_seq-1-j,hash);
+	}
+}
+
+/* ============================ Default context ============================= */
+
+/* The API without a context works on the default one, that edits lines on
+ * stdin and stdout. */
+
+int clirEditStart(struct clirState *cs, int stdin_fd, int stdout_fd,
+	char *buf, size_t buflen, const char *prompt)
+{
+	if (default_ctx.ifd != stdin_fd) default_ctx.ifd_tty = -1;
+	default_ctx.ifd = stdin_fd;
+	default_ctx.ofd = stdout_fd;
+	return clirCtxEditStart(&default_ctx,cs,buf,buflen,prompt);
+}
+
+void clirSetMultiLine(int ml) {
+	clirCtxSetMultiLine(&default_ctx,ml);
+}
+
+void clirClearScreen(void) {
+	clirCtxClearScreen(&default_ctx);
+}
+
+void clirSetCompletionCallback(clirCompletionCallback *fn) {
+	clirCtxSetCompletionCallback(&default_ctx,fn);
+}
+
+int clirSetAsyncCompletionCallback(clirAsyncCompletionCallback *fn) {
+	return clirCtxSetAsyncCompletionCallback(&default_ctx,fn);
+}
+
+void clirSetCompletionQueryItems(int items) {
+	clirCtxSetCompletionQueryItems(&default_ctx,items);
+}
+
+void clirSetCompletionTimeout(int ms) {
+	clirCtxSetCompletionTimeout(&default_ctx,ms);
+}
+
+int clirSetCompletionDictionary(const char **words, size_t count) {
+	return clirCtxSetCompletionDictionary(&default_ctx,words,count);
+}
+
+size_t clirLastRefreshBytes(void) {
+	return clirCtxLastRefreshBytes(&default_ctx);
+}
+
+int clirBindKey(int key, int action) {
+	return clirCtxBindKey(&default_ctx,key,action);
+}
+
+void clirSetEscapeTimeout(int ms) {
+	clirCtxSetEscapeTimeout(&default_ctx,ms);
+}
+
+void clirSetStats(int enable) {
+	clirCtxSetStats(&default_ctx,enable);
+}
+
+void clirGetStats(clirStats *stats) {
+	clirCtxGetStats(&default_ctx,stats);
+}
+
+void clirResetStats(void) {
+	clirCtxResetStats(&default_ctx);
+}
+
+void clirSetHook(clirHookCallback *fn, void *privdata) {
+	clirCtxSetHook(&default_ctx,fn,privdata);
+}
+
+void clirSetHighlightCallback(clirHighlightCallback *fn) {
+	clirCtxSetHighlightCallback(&default_ctx,fn);
+}
+
+void clirSetSuggestions(int enable) {
+	clirCtxSetSuggestions(&default_ctx,enable);
+}
+
+void clirSetFuzzy(int flags) {
+	clirCtxSetFuzzy(&default_ctx,flags);
+}
+
+void clirSetFuzzyThreads(int threads) {
+	clirCtxSetFuzzyThreads(&default_ctx,threads);
+}
+
+int clirHistoryShare(const char *filename) {
+	return clirCtxHistoryShare(&default_ctx,filename);
+}
+
+int clirHistoryAdd(const char *line) {
+	return clirCtxHistoryAdd(&default_ctx,line);
+}
+
+int clirHistorySetMaxLen(int len) {
+	return clirCtxHistorySetMaxLen(&default_ctx,len);
+}
+
+void clirHistorySetEraseDups(int erase) {
+	clirCtxHistorySetEraseDups(&default_ctx,erase);
+}
+
+int clirHistorySave(char *filename) {
+	return clirCtxHistorySave(&default_ctx,filename);
+}
+
+int clirHistoryAppendFd(int fd) {
+	return clirCtxHistoryAppendFd(&default_ctx,fd);
+}
+
+int clirHistoryAppend(char *filename) {
+	return clirCtxHistoryAppend(&default_ctx,filename);
+}
+
+void clirHistorySetSync(int every) {
+	clirCtxHistorySetSync(&default_ctx,every);
 }
 
-/* Load the history from the specified file. If the file does not exist
- * zero is returned and no operation is performed.
- *
- * If the file exists and the operation succeeded 0 is returned, otherwise
- * on error -1 is returned. */
 int clirHistoryLoad(char *filename) {
-	FILE *fp = fopen(filename,"r");
-	char buf[LINENOISE_MAX_LINE];
+	return clirCtxHistoryLoad(&default_ctx,filename);
+}
 
-	if (fp == NULL) return -1;
+int clirPrintAbove(const char *fmt, ...) {
+	va_list ap;
+	int retval;
 
-	while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
-		char *p;
+	va_start(ap,fmt);
+	retval = printFormat(&default_ctx,fmt,ap);
+	va_end(ap);
+	return retval;
+}
 
-		p = strchr(buf,'\r');
-		if (!p) p = strchr(buf,'\n');
-		if (p) *p = '\0';
-		clirHistoryAdd(buf);
-	}
-	fclose(fp);
-	return 0;
+void clirSetPrintRate(int fps) {
+	clirCtxSetPrintRate(&default_ctx,fps);
 }
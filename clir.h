@@ -37,21 +37,240 @@
 #ifndef __LINENOISE_H
 #define __LINENOISE_H
 
+#include <sys/types.h>
+
+#define LINENOISE_SEARCH_MAX_LEN 256
+
+/* All the state of a terminal lines are edited on, see clirContextNew(). */
+typedef struct clirContext clirContext;
+
+/* The clirState structure represents the state during line editing.
+ * We pass this state to functions implementing specific editing
+ * functionalities. */
+struct clirState {
+	clirContext *ctx;   /* Context the line is edited in. */
+	int ifd;            /* Terminal stdin file descriptor. */
+	int ofd;            /* Terminal stdout file descriptor. */
+	char *buf;          /* Edited line buffer, with a gap at gap_pos. */
+	size_t buflen;      /* Edited line buffer size. */
+	size_t gap_pos;     /* Position of the gap, the text after is at the end. */
+	int growable;       /* Buffer is on the heap and grows as needed. */
+	const char *prompt; /* Prompt to display. */
+	size_t plen;        /* Prompt length. */
+	size_t pos;         /* Current cursor position. */
+	size_t oldpos;      /* Cursor cell of the last refresh. */
+	size_t len;         /* Current edited line length. */
+	size_t cols;        /* Number of columns in terminal. */
+	size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
+	int history_index;  /* The history index we are currently editing. */
+	size_t word_pos;    /* Position of the last word's first character. */
+	int searching;      /* In incremental history search (ctrl-r) mode. */
+	int searchfailed;   /* Last search did not find anything. */
+	long searchseq;     /* Sequence number of the current match, or -1. */
+	int searchindex;    /* History index the search started from. */
+	size_t searchlen;   /* Length of the search query. */
+	char search[LINENOISE_SEARCH_MAX_LEN+1];       /* Search query. */
+	char searchprompt[LINENOISE_SEARCH_MAX_LEN+40]; /* Search mode prompt. */
+	const char *origprompt; /* Prompt to restore after the search. */
+	int pasting;        /* Inside a bracketed paste. */
+};
+
 typedef struct clirCompletions {
 	size_t len;
 	char **cvec;
+	size_t cap;               /* Allocated slots of cvec. */
+	struct clirArena *arena;  /* Blocks holding the copied options. */
+	int narrowable;           /* See clirSetCompletionNarrowable(). */
 } clirCompletions;
 
 typedef void(clirCompletionCallback)(const char *, clirCompletions *);
 void clirSetCompletionCallback(clirCompletionCallback *);
 void clirAddCompletion(clirCompletions *, char *);
+void clirAddCompletionLen(clirCompletions *, const char *, size_t);
+void clirAddCompletionBorrowed(clirCompletions *, const char *);
+void clirSetCompletionNarrowable(clirCompletions *, int);
+int clirSetCompletionDictionary(const char **words, size_t count);
+void clirSetCompletionQueryItems(int items);
+
+/* Highlighting, see clirCtxSetHighlightCallback(). The style of a byte is
+ * a colour made with LINENOISE_COLOR(), or 0 for the default one, combined
+ * with any of the LINENOISE_STYLE_* attributes. */
+#define LINENOISE_BLACK 0
+#define LINENOISE_RED 1
+#define LINENOISE_GREEN 2
+#define LINENOISE_YELLOW 3
+#define LINENOISE_BLUE 4
+#define LINENOISE_MAGENTA 5
+#define LINENOISE_CYAN 6
+#define LINENOISE_WHITE 7
+#define LINENOISE_COLOR(c) (0x08|((c)&7))
+#define LINENOISE_STYLE_COLOR 0x08     /* A colour is set. */
+#define LINENOISE_STYLE_BRIGHT 0x10    /* Its bright variant. */
+#define LINENOISE_STYLE_BOLD 0x20
+#define LINENOISE_STYLE_UNDERLINE 0x40
+#define LINENOISE_STYLE_REVERSE 0x80
+typedef void(clirHighlightCallback)(const char *buf, size_t len, size_t start, size_t end, unsigned char *styles);
+void clirSetHighlightCallback(clirHighlightCallback *fn);
+
+/* Fuzzy matching, see clirCtxSetFuzzy(). */
+#define LINENOISE_FUZZY_COMPLETION 1
+#define LINENOISE_FUZZY_HISTORY 2
+void clirSetFuzzy(int flags);
+void clirSetFuzzyThreads(int threads);
+
+/* Asynchronous completion, see clirCtxSetAsyncCompletionCallback(). */
+typedef struct clirCompletionRequest clirCompletionRequest;
+typedef void(clirAsyncCompletionCallback)(const char *, clirCompletionRequest *);
+int clirSetAsyncCompletionCallback(clirAsyncCompletionCallback *);
+void clirSetCompletionTimeout(int ms);
+void clirRequestAddCompletion(clirCompletionRequest *, const char *);
+void clirRequestSetNarrowable(clirCompletionRequest *, int);
+int clirRequestCanceled(clirCompletionRequest *);
+void clirRequestComplete(clirCompletionRequest *);
+
+/* Keys are the byte values 0 to 255, then the keys sent as escape
+ * sequences. Each is bound to one of the editing actions. */
+#define LINENOISE_KEY_UP 256
+#define LINENOISE_KEY_DOWN 257
+#define LINENOISE_KEY_RIGHT 258
+#define LINENOISE_KEY_LEFT 259
+#define LINENOISE_KEY_HOME 260
+#define LINENOISE_KEY_END 261
+#define LINENOISE_KEY_DELETE 262
+#define LINENOISE_KEY_CTRL_RIGHT 263
+#define LINENOISE_KEY_CTRL_LEFT 264
+#define LINENOISE_KEY_SHIFT_TAB 265
+#define LINENOISE_KEY_ESC 266      /* ESC not followed by a sequence. */
+#define LINENOISE_KEY_UNKNOWN 267  /* Any other escape sequence. */
+#define LINENOISE_KEY_COUNT 268
+
+#define LINENOISE_ACTION_INSERT 0  /* Insert the byte, ignored for others. */
+#define LINENOISE_ACTION_NONE 1
+#define LINENOISE_ACTION_ACCEPT 2
+#define LINENOISE_ACTION_CANCEL 3
+#define LINENOISE_ACTION_EOF_OR_DELETE 4
+#define LINENOISE_ACTION_BACKSPACE 5
+#define LINENOISE_ACTION_DELETE 6
+#define LINENOISE_ACTION_LEFT 7
+#define LINENOISE_ACTION_RIGHT 8
+#define LINENOISE_ACTION_HOME 9
+#define LINENOISE_ACTION_END 10
+#define LINENOISE_ACTION_WORD_LEFT 11
+#define LINENOISE_ACTION_WORD_RIGHT 12
+#define LINENOISE_ACTION_HISTORY_PREV 13
+#define LINENOISE_ACTION_HISTORY_NEXT 14
+#define LINENOISE_ACTION_TRANSPOSE 15
+#define LINENOISE_ACTION_KILL_LINE 16
+#define LINENOISE_ACTION_KILL_TO_END 17
+#define LINENOISE_ACTION_DELETE_PREV_WORD 18
+#define LINENOISE_ACTION_CLEAR_SCREEN 19
+#define LINENOISE_ACTION_SEARCH 20
+#define LINENOISE_ACTION_COMPLETE 21 /* Inserts the byte without completion. */
+#define LINENOISE_ACTION_COUNT 22
 
+int clirBindKey(int key, int action);
+void clirSetEscapeTimeout(int ms);
+
+/* Counters of a context, see clirCtxSetStats(). Times are nanoseconds. */
+typedef struct clirStats {
+	unsigned long long reads;             /* read() calls on the terminal. */
+	unsigned long long read_bytes;
+	unsigned long long writes;            /* write() calls on the terminal. */
+	unsigned long long write_bytes;
+	unsigned long long refresh_single;    /* Single line refreshes. */
+	unsigned long long refresh_multi;     /* Multi line refreshes. */
+	unsigned long long refresh_append;    /* Keys echoed without a refresh. */
+	unsigned long long refresh_ns;        /* Time spent refreshing. */
+	unsigned long long completions;       /* Completion callback calls. */
+	unsigned long long completion_ns;     /* Time until they answered. */
+	unsigned long long completion_max_ns; /* Slowest answer. */
+	unsigned long long history_adds;
+	unsigned long long history_evictions;
+} clirStats;
+
+/* Events of the hook, around the calls of the callbacks. */
+#define LINENOISE_HOOK_COMPLETION_BEGIN 0
+#define LINENOISE_HOOK_COMPLETION_END 1
+#define LINENOISE_HOOK_ASYNC_COMPLETION_BEGIN 2
+#define LINENOISE_HOOK_ASYNC_COMPLETION_END 3
+#define LINENOISE_HOOK_HIGHLIGHT_BEGIN 4
+#define LINENOISE_HOOK_HIGHLIGHT_END 5
+
+typedef void(clirHookCallback)(int event, void *privdata);
+void clirSetStats(int enable);
+void clirGetStats(clirStats *stats);
+void clirResetStats(void);
+void clirSetHook(clirHookCallback *fn, void *privdata);
+
+/* Non blocking API. */
+extern char *clirEditMore;
+int clirEditStart(struct clirState *cs, int stdin_fd, int stdout_fd, char *buf, size_t buflen, const char *prompt);
+char *clirEditFeed(struct clirState *cs);
+void clirEditStop(struct clirState *cs);
+int clirEditWakeFd(struct clirState *cs);
+int clirEditTimeout(struct clirState *cs);
+void clirHide(struct clirState *cs);
+void clirShow(struct clirState *cs);
+
+/* Output above the edited line, from any thread. */
+int clirPrintAbove(const char *fmt, ...);
+void clirSetPrintRate(int fps);
+
+/* Blocking API. */
 char *clir(const char *prompt);
+ssize_t clirGetline(const char *prompt, char **lineptr, size_t *n);
 int clirHistoryAdd(const char *line);
 int clirHistorySetMaxLen(int len);
+void clirHistorySetEraseDups(int erase);
 int clirHistorySave(char *filename);
+int clirHistoryAppend(char *filename);
+int clirHistoryAppendFd(int fd);
+void clirHistorySetSync(int every);
 int clirHistoryLoad(char *filename);
+int clirHistoryShare(const char *filename);
 void clirClearScreen(void);
 void clirSetMultiLine(int ml);
+void clirSetSuggestions(int enable);
+size_t clirLastRefreshBytes(void);
+
+/* Fast reading of lines from a pipe or a file, see clirReadLines(). */
+typedef int(clirLineCallback)(const char *line, size_t len, void *privdata);
+int clirReadLines(int fd, clirLineCallback *fn, void *privdata);
+
+/* Context API: the same functions, working on the given context. */
+clirContext *clirContextNew(int ifd, int ofd);
+void clirContextFree(clirContext *ctx);
+int clirCtxEditStart(clirContext *ctx, struct clirState *cs, char *buf, size_t buflen, const char *prompt);
+char *clirCtx(clirContext *ctx, const char *prompt);
+ssize_t clirCtxGetline(clirContext *ctx, const char *prompt, char **lineptr, size_t *n);
+void clirCtxSetCompletionCallback(clirContext *ctx, clirCompletionCallback *fn);
+int clirCtxSetCompletionDictionary(clirContext *ctx, const char **words, size_t count);
+int clirCtxSetAsyncCompletionCallback(clirContext *ctx, clirAsyncCompletionCallback *fn);
+void clirCtxSetCompletionTimeout(clirContext *ctx, int ms);
+void clirCtxSetCompletionQueryItems(clirContext *ctx, int items);
+void clirCtxSetHighlightCallback(clirContext *ctx, clirHighlightCallback *fn);
+void clirCtxSetFuzzy(clirContext *ctx, int flags);
+void clirCtxSetFuzzyThreads(clirContext *ctx, int threads);
+int clirCtxHistoryAdd(clirContext *ctx, const char *line);
+int clirCtxHistorySetMaxLen(clirContext *ctx, int len);
+void clirCtxHistorySetEraseDups(clirContext *ctx, int erase);
+int clirCtxHistorySave(clirContext *ctx, char *filename);
+int clirCtxHistoryAppend(clirContext *ctx, char *filename);
+int clirCtxHistoryAppendFd(clirContext *ctx, int fd);
+void clirCtxHistorySetSync(clirContext *ctx, int every);
+int clirCtxHistoryLoad(clirContext *ctx, char *filename);
+int clirCtxHistoryShare(clirContext *ctx, const char *filename);
+void clirCtxClearScreen(clirContext *ctx);
+void clirCtxSetMultiLine(clirContext *ctx, int ml);
+void clirCtxSetSuggestions(clirContext *ctx, int enable);
+size_t clirCtxLastRefreshBytes(clirContext *ctx);
+int clirCtxBindKey(clirContext *ctx, int key, int action);
+void clirCtxSetEscapeTimeout(clirContext *ctx, int ms);
+void clirCtxSetStats(clirContext *ctx, int enable);
+void clirCtxGetStats(clirContext *ctx, clirStats *stats);
+void clirCtxResetStats(clirContext *ctx);
+void clirCtxSetHook(clirContext *ctx, clirHookCallback *fn, void *privdata);
+int clirCtxPrintAbove(clirContext *ctx, const char *fmt, ...);
+void clirCtxSetPrintRate(clirContext *ctx, int fps);
 
 #endif /* __LINENOISE_H */
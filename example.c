@@ -1,6 +1,10 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
 #include "clir.h"
 
 
@@ -13,19 +17,125 @@ void completion(const char *buf, clirCompletions *lc) {
     }
 }
 
+/* A slow provider, answering from its own thread half a second later. */
+void *slowCompletionThread(void *arg) {
+    clirCompletionRequest *req = arg;
+
+    usleep(500000);
+    if (!clirRequestCanceled(req)) {
+        clirRequestAddCompletion(req,"hello");
+        clirRequestAddCompletion(req,"hi");
+        clirRequestAddCompletion(req,"hey");
+        clirRequestAddCompletion(req,"howzit");
+    }
+    clirRequestComplete(req);
+    return NULL;
+}
+
+void slowCompletion(const char *buf, clirCompletionRequest *req) {
+    pthread_t thread;
+
+    if (buf[0] != 'h' ||
+        pthread_create(&thread,NULL,slowCompletionThread,req) != 0)
+    {
+        clirRequestComplete(req);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* With --highlight the completions are shown in bold green, and the
+ * numbers in cyan. Only the words touching the bytes that changed are
+ * looked at. */
+void highlight(const char *buf, size_t len, size_t start, size_t end,
+    unsigned char *styles)
+{
+    static const char *words[] = {"hello","hi","hey","howzit",NULL};
+    size_t j, k;
+    int w;
+
+    while (start > 0 && buf[start-1] != ' ') start--;
+    while (end < len && buf[end] != ' ') end++;
+    for (j = start; j < end; j = k) {
+        unsigned char style = 0;
+
+        while (j < end && buf[j] == ' ') styles[j++] = 0;
+        for (k = j; k < end && buf[k] != ' '; k++);
+        if (k == j) break;
+        for (w = 0; words[w]; w++)
+            if (strlen(words[w]) == k-j && !memcmp(buf+j,words[w],k-j))
+                style = LINENOISE_COLOR(LINENOISE_GREEN)|LINENOISE_STYLE_BOLD;
+        if (strspn(buf+j,"0123456789") >= k-j)
+            style = LINENOISE_COLOR(LINENOISE_CYAN);
+        memset(styles+j,style,k-j);
+    }
+}
+
+/* With --log another thread prints a log line ten times a second, above
+ * the line being edited. */
+void *logThread(void *arg) {
+    unsigned long n = 0;
+
+    (void)arg;
+    while (1) {
+        usleep(100000);
+        clirPrintAbove("log: event %lu",++n);
+    }
+    return NULL;
+}
+
+/* With --batch the lines are read from a pipe or a file, just echoed. */
+int batchLine(const char *line, size_t len, void *privdata) {
+    (void)privdata;
+    fwrite(line,1,len,stdout);
+    putchar('\n');
+    return 0;
+}
+
 int main(int argc, char **argv) {
     char *line;
     char *prgname = argv[0];
+    int async = 0, slow = 0;
 
-    /* Parse options, with --multiline we enable multi line editing. */
+    /* Parse options, with --multiline we enable multi line editing,
+     * with --async the non blocking API is used, with --slow the
+     * completions come from another thread, with --fuzzy completion and
+     * history search match fuzzily, with --suggest history entries are
+     * suggested as you type, with --highlight the line is colored, with
+     * --log lines are printed above it meanwhile, with --batch standard
+     * input is read without editing. */
     while(argc > 1) {
         argc--;
         argv++;
         if (!strcmp(*argv,"--multiline")) {
             clirSetMultiLine(1);
             printf("Multi-line mode enabled.\n");
+        } else if (!strcmp(*argv,"--async")) {
+            async = 1;
+        } else if (!strcmp(*argv,"--slow")) {
+            slow = 1;
+        } else if (!strcmp(*argv,"--fuzzy")) {
+            clirSetFuzzy(LINENOISE_FUZZY_COMPLETION|LINENOISE_FUZZY_HISTORY);
+        } else if (!strcmp(*argv,"--suggest")) {
+            clirSetSuggestions(1);
+        } else if (!strcmp(*argv,"--highlight")) {
+            clirSetHighlightCallback(highlight);
+        } else if (!strcmp(*argv,"--log")) {
+            pthread_t thread;
+
+            if (pthread_create(&thread,NULL,logThread,NULL) == 0)
+                pthread_detach(thread);
+        } else if (!strcmp(*argv,"--batch")) {
+            if (clirReadLines(STDIN_FILENO,batchLine,NULL) == -1) {
+                perror("read");
+                exit(1);
+            }
+            return 0;
         } else {
-            fprintf(stderr, "Usage: %s [--multiline]\n", prgname);
+            fprintf(stderr,
+                "Usage: %s [--multiline] [--async] [--slow] [--fuzzy] "
+                "[--suggest] [--highlight] [--log] [--batch]\n",
+                prgname);
             exit(1);
         }
     }
@@ -33,10 +143,12 @@ int main(int argc, char **argv) {
     /* Set the completion callback. This will be called every time the
      * user uses the <tab> key. */
     clirSetCompletionCallback(completion);
+    if (slow) clirSetAsyncCompletionCallback(slowCompletion);
 
     /* Load history from file. The history file is just a plain text file
-     * where entries are separated by newlines. */
-    clirHistoryLoad("history.txt"); /* Load the history at startup */
+     * where entries are separated by newlines. It is shared: the entries
+     * typed in other instances running at the same time show up too. */
+    clirHistoryShare("history.txt"); /* Load the history at startup */
 
     /* Now this is the main loop of the typical clir-based application.
      * The call to clir() will block as long as the user types something
@@ -44,12 +156,63 @@ int main(int argc, char **argv) {
      *
      * The typed string is returned as a malloc() allocated string by
      * clir, so the user needs to free() it. */
-    while((line = clir("hello> ")) != NULL) {
+    while(1) {
+        if (!async) {
+            line = clir("hello> ");
+            if (line == NULL) break;
+        } else {
+            /* With the non blocking API the program waits for input
+             * itself, here with select(), and can do something else
+             * meanwhile: every second of idle time some output is shown
+             * over the line being edited. */
+            struct clirState cs;
+            char buf[1024];
+
+            if (clirEditStart(&cs,STDIN_FILENO,STDOUT_FILENO,buf,sizeof(buf),
+                "hello> ") == -1) break;
+            while(1) {
+                fd_set readfds;
+                struct timeval tv;
+                int retval, maxfd = cs.ifd, wakefd = clirEditWakeFd(&cs);
+                int timeout = clirEditTimeout(&cs);
+
+                FD_ZERO(&readfds);
+                FD_SET(cs.ifd, &readfds);
+                if (wakefd != -1) {
+                    FD_SET(wakefd, &readfds);
+                    if (wakefd > maxfd) maxfd = wakefd;
+                }
+                if (timeout < 0 || timeout > 1000) timeout = 1000;
+                tv.tv_sec = timeout/1000;
+                tv.tv_usec = (timeout%1000)*1000;
+
+                retval = select(maxfd+1, &readfds, NULL, NULL, &tv);
+                if (retval == -1 && errno == EINTR) {
+                    /* A resize, the wake descriptor is now readable. */
+                    continue;
+                } else if (retval == -1) {
+                    perror("select()");
+                    exit(1);
+                } else if (retval || clirEditTimeout(&cs) == 0) {
+                    line = clirEditFeed(&cs);
+                    /* A NULL return means: line editing canceled. */
+                    if (line != clirEditMore) break;
+                } else {
+                    static int counter = 0;
+
+                    clirHide(&cs);
+                    printf("Async output %d.\n", counter++);
+                    clirShow(&cs);
+                }
+            }
+            clirEditStop(&cs);
+            if (line == NULL) break;
+        }
+
         /* Do something with the string. */
         if (line[0] != '\0' && line[0] != '/') {
             //printf("echo: '%s'\n", line);
-            clirHistoryAdd(line); /* Add to the history. */
-            clirHistorySave("history.txt"); /* Save the history on disk. */
+            clirHistoryAdd(line); /* Add to the history, and to the file. */
         } else if (!strncmp(line,"/historylen",11)) {
             /* The "/historylen" command will change the history len. */
             int len = atoi(line+11);